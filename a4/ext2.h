@@ -18,8 +18,11 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
-#define EXT2_BLOCK_SIZE 1024
+/* The superblock always starts 1024 bytes into the image, and blocks are 1024 << s_log_block_size bytes. */
+#define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_MAX_BLOCK_SIZE 4096
+#define EXT2_BLOCK_SIZE(s) (EXT2_MIN_BLOCK_SIZE << (s)->s_log_block_size)
 
 /*
  * Structure of the super block
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2.h"
+#include "ext2_util.h"
+#include "ext2_tools.h"
+#include "ext2_journal.h"
+
+#define MAX_ARGS 4
+
+/**
+ * Splits the given line on whitespace into at most max_args arguments. A '#' starts a comment that runs
+ * to the end of the line. Returns the number of arguments, or -1 if there are too many.
+**/
+static int split_args(char *line, char **args, int max_args) {
+  char *comment = strchr(line, '#');
+  if(comment != NULL) {
+    *comment = '\0';
+  }
+
+  int count = 0;
+  char *save;
+  for(char *arg = strtok_r(line, " \t\r\n", &save); arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save)) {
+    if(count == max_args) {
+      return -1;
+    }
+    args[count++] = arg;
+  }
+  return count;
+}
+
+/**
+ * Runs one command against the image. Returns 0 on success, otherwise the code the matching tool exits with.
+**/
+static int run_command(char **args, int count) {
+  if(strcmp(args[0], "cp") == 0 && count == 3) {
+    return ext2_cp(args[1], args[2]);
+  }
+  if(strcmp(args[0], "cp") == 0 && count == 4 && strcmp(args[1], "-r") == 0) {
+    return ext2_cp_tree(args[2], args[3]);
+  }
+  if(strcmp(args[0], "mkdir") == 0 && count == 2) {
+    return ext2_mkdir(args[1]);
+  }
+  if(strcmp(args[0], "ln") == 0 && count == 3) {
+    return ext2_ln(0, args[1], args[2]);
+  }
+  if(strcmp(args[0], "ln") == 0 && count == 4 && strcmp(args[1], "-s") == 0) {
+    return ext2_ln(1, args[2], args[3]);
+  }
+  if(strcmp(args[0], "rm") == 0 && count == 2) {
+    return ext2_rm(0, args[1]);
+  }
+  if(strcmp(args[0], "rm") == 0 && count == 3 && strcmp(args[1], "-r") == 0) {
+    return ext2_rm(1, args[2]);
+  }
+  if(strcmp(args[0], "restore") == 0 && count == 2) {
+    return ext2_restore(args[1]);
+  }
+  if(strcmp(args[0], "restore") == 0 && count == 3 && strcmp(args[1], "--all") == 0) {
+    return ext2_restore_all(args[2], 0);
+  }
+  fprintf(stderr, "Unknown command or wrong number of arguments\n");
+  return 1;
+}
+
+/**
+ * Runs a script of cp [-r], mkdir, ln, rm [-r] and restore [--all] commands against one mapping of the image, so the
+ * image is opened and mapped once rather than once per command. Commands take the same arguments as the
+ * tools, without the image name. Stops at the first command that fails.
+ * The whole script is one transaction, committed once at the end, so a failure or crash leaves the image as it
+ * was before the script. With --commit-every N every N commands are committed together instead, and a failure
+ * or crash only undoes the commands since the last commit.
+**/
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int index = take_option(&argc, argv, "--index");
+  const char *commit_every_arg = take_option_value(&argc, argv, "--commit-every");
+  unsigned long commit_every = 0;
+  char *end = NULL;
+  if (commit_every_arg != NULL) {
+    commit_every = strtoul(commit_every_arg, &end, 10);
+  }
+  if ((argc != 2 && argc != 3) || (commit_every_arg != NULL && (commit_every == 0 || *end != '\0'))) {
+    fprintf(stderr, "Usage: %s [--sync] [--index] [--commit-every N] <image file name> [command file]\n", argv[0]);
+    exit(1);
+  }
+
+  // Read the commands from standard input unless a file is given
+  FILE *script = stdin;
+  if(argc == 3 && strcmp(argv[2], "-") != 0 && (script = fopen(argv[2], "r")) == NULL) {
+    perror("fopen");
+    exit(1);
+  }
+
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+  index_growing_dirs(index);
+
+  int ret = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  unsigned int line_num = 0;
+  unsigned long uncommitted = 0;
+  while(ret == 0 && getline(&line, &line_cap, script) != -1) {
+    char *args[MAX_ARGS];
+    line_num++;
+
+    int count = split_args(line, args, MAX_ARGS);
+    if(count == 0) {
+      continue;
+    }
+    if(count == -1) {
+      fprintf(stderr, "Too many arguments\n");
+      ret = 1;
+    } else {
+      ret = run_command(args, count);
+    }
+    if(ret != 0) {
+      fprintf(stderr, "Line %u failed\n", line_num);
+    }
+    // Commands that failed are never committed, whatever was changed since the last commit is rolled back
+    // as the tool exits
+    if(ret == 0 && commit_every != 0 && ++uncommitted == commit_every) {
+      uncommitted = 0;
+      if(journal_commit() == -1) {
+        ret = 1;
+      }
+    }
+  }
+  free(line);
+
+  return journal_finish(ret);
+}
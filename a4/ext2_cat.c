@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <string.h>
+#include "ext2.h"
+#include "ext2_util.h"
+
+// Number of runs handed to a single writev
+#define EXPORT_IOV_MAX 256
+
+// Read in place of holes
+static unsigned char zero_block[EXT2_MAX_BLOCK_SIZE];
+
+/**
+ * The runs of a file waiting to be written, each a stretch of physically contiguous blocks in the mapping.
+**/
+struct export {
+  int fd;
+  int count;
+  struct iovec iov[EXPORT_IOV_MAX];
+};
+
+/**
+ * Writes out every pending run with as few writev calls as it takes, picking up after short writes.
+ * Returns 0 on success, or -1 on error.
+**/
+static int export_flush(struct export *export) {
+  struct iovec *iov = export->iov;
+  int count = export->count;
+
+  while (count > 0) {
+    ssize_t written = writev(export->fd, iov, count);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written == -1) {
+      return -1;
+    }
+    // Skip the runs written in full, and move into the one cut short
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (unsigned char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  export->count = 0;
+  return 0;
+}
+
+/**
+ * Adds len bytes at data to the output, growing the last run when data follows right after it.
+ * Returns 0 on success, or -1 on error.
+**/
+static int export_add(struct export *export, unsigned char *data, size_t len) {
+  if (export->count > 0) {
+    struct iovec *last = &export->iov[export->count - 1];
+    if ((unsigned char *)last->iov_base + last->iov_len == data && data != zero_block) {
+      last->iov_len += len;
+      return 0;
+    }
+  }
+  if (export->count == EXPORT_IOV_MAX && export_flush(export) == -1) {
+    return -1;
+  }
+  export->iov[export->count].iov_base = data;
+  export->iov[export->count].iov_len = len;
+  export->count++;
+  return 0;
+}
+
+/**
+ * Writes the contents of the file at file_path in the image to out_fd. Blocks are written straight out of the
+ * mapping, each run of contiguous blocks as one piece of a writev, and holes read as zeros. The last block is
+ * cut off at the file's size. Returns 0 on success, otherwise the error code the tool exits with.
+**/
+static int ext2_cat(const char *file_path, int out_fd) {
+  if (file_path[0] != '/') {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
+  }
+
+  char *path = malloc(strlen(file_path) + 1);
+  strcpy(path, file_path);
+  int inode_num = traverse_path(EXT2_ROOT_INO, path);
+  free(path);
+  if (inode_num == 0) {
+    fprintf(stderr, "File does not exist\n");
+    return -ENOENT;
+  }
+
+  struct ext2_inode *inode = get_inode(inode_num);
+  if ((inode->i_mode & 0xF000) != EXT2_S_IFREG) {
+    fprintf(stderr, "Not a regular file\n");
+    return (inode->i_mode & 0xF000) == EXT2_S_IFDIR ? -EISDIR : -EINVAL;
+  }
+
+  struct export export = {out_fd, 0};
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  size_t remaining = inode->i_size;
+  int n;
+
+  block_iter_init(&iter, inode);
+  while (remaining > 0 && (n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n && remaining > 0; i++) {
+      size_t len = remaining < block_size ? remaining : block_size;
+      unsigned char *data = blocks[i] != 0 ? disk + block(blocks[i]) : zero_block;
+      if (export_add(&export, data, len) == -1) {
+        perror("writev");
+        return -EIO;
+      }
+      remaining -= len;
+    }
+  }
+  if (export_flush(&export) == -1) {
+    perror("writev");
+    return -EIO;
+  }
+  return 0;
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <image file name> <path to file> [host file]\n", argv[0]);
+    exit(1);
+  }
+  // Exporting never changes the image, so it can run against images in use or on read-only storage
+  init_disk_readonly(argv[1]);
+
+  int out_fd = STDOUT_FILENO;
+  if (argc == 4 && (out_fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror(argv[3]);
+    exit(1);
+  }
+
+  int ret = ext2_cat(argv[2], out_fd);
+  if (out_fd != STDOUT_FILENO && close(out_fd) == -1) {
+    perror(argv[3]);
+    return 1;
+  }
+  return ret;
+}
@@ -6,80 +6,200 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "ext2.h"
 #include "ext2_util.h"
+#include "ext2_journal.h"
 
 #define COUNTER_FIX_STR "Fixed: %s's %s counter was off by %d compared to the bitmap\n"
 #define INODE_MISMATCH_STR "Fixed: Entry type vs inode mismatch: inode [%d]\n"
 #define UNMARKED_INODE_STR "Fixed: inode [%d] not marked as in-use\n"
 #define DTIME_NOT_ZERO_STR "Fixed: valid inode marked for deletion: [%d]\n"
 #define UNMARKED_BLOCKS_STR "Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n"
+#define LEAKED_BLOCKS_STR "Fixed: %d blocks marked in use but owned by no inode were freed\n"
+#define DUPLICATE_BLOCK_STR "Found: block [%d] is claimed by inode [%d] and inode [%d]\n"
+#define METADATA_BLOCK_STR "Found: block [%d] of inode [%d] holds file system metadata\n"
+#define ORPHAN_INODE_STR "Found: inode [%d] is in use but not reachable from the root\n"
 #define TOTAL_FIXES_STR "%d file system inconsistencies repaired!\n"
+#define DRY_RUN_FIXES_STR "%d file system inconsistencies found, image left unchanged\n"
+
+// Most threads checking block groups at once
+#define CHECK_THREADS_MAX 8
+
+// Owner recorded in the block ownership map for superblocks, descriptors, bitmaps and inode tables
+#define METADATA_OWNER 0xFFFFFFFF
+
+// The resize inode. Its double indirect block points at the reserved descriptor blocks, which are owned as metadata
+#define EXT2_RESIZE_INO 7
+
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+
+// s_reserved_gdt_blocks sits where struct ext2_super_block has s_padding1
+#define EXT2_RESERVED_GDT_BLOCKS(sb) ((sb)->s_padding1)
 
 int num_fixes = 0;
 
+/*
+ * A thread's share of the block groups: first, first + stride, first + 2 * stride, ...
+ */
+struct group_task {
+  pthread_t thread;
+  unsigned int first;
+  unsigned int stride;
+  void (*check_group)(unsigned int group);
+};
+
+// Used blocks and inodes of one group, as counted from its bitmaps
+struct group_counts {
+  int blocks;
+  int inodes;
+};
+struct group_counts *group_counts;
+
+/*
+ * What is wrong with one reachable inode. Found while the groups are checked in parallel, fixed afterwards.
+ */
+struct inode_report {
+  unsigned int inode_num;
+  int dtime_set;
+  int unmarked;
+  unsigned int unmarked_count;
+  unsigned int *unmarked_blocks;
+};
+
+// The reports of one group, in inode order
+struct group_report {
+  struct inode_report *reports;
+  unsigned int count;
+  unsigned int capacity;
+};
+struct group_report *group_reports;
+
+// Bit i - 1 is set once inode i has been reached from the root
+unsigned char *reachable;
+
+// For scan mode: the inode owning each block, 0 for none
+unsigned int *block_owner;
+
 /**
- * Returns the number of inodes based on the bitmap
+ * Returns the number of used inodes in the given group based on its bitmap
  */
-int count_inode_bitmap() {
-  int ret = 0;
-  for(int i = 0; i < (int)sb->s_inodes_count/8; i++) {
-    for(int j = 0; j < 8; j++) {
-      if(inode_bitmap[i] & (1 << j)) {
-        ret++;
-      } 
-    }
+int count_inode_bitmap(unsigned int group) {
+  return bitmap_count(get_inode_bitmap(group), 0, sb->s_inodes_per_group);
+}
+
+/**
+ * Returns the number of used blocks in the given group based on its bitmap
+ */
+int count_block_bitmap(unsigned int group) {
+  return bitmap_count(get_block_bitmap(group), 0, group_blocks_count(group));
+}
+
+/**
+ * Thread body checking the groups of a group_task.
+ */
+void *group_worker(void *arg) {
+  struct group_task *task = arg;
+  for(unsigned int group = task->first; group < group_count; group += task->stride) {
+    task->check_group(group);
   }
-  return ret;
+  return NULL;
 }
 
-int count_block_bitmap() {
-  int ret = 0;
-  for(int i = 0; i < (int)sb->s_blocks_count/8; i++) {
-    for(int j = 0; j < 8; j++) {
-      if(block_bitmap[i] & (1 << j)) {
-        ret++;
-      } 
+/**
+ * Runs check_group on every block group, spread over up to CHECK_THREADS_MAX threads. check_group must only
+ * read the image and write its own group's results; fixes are applied afterwards, one group at a time.
+ */
+void for_each_group_parallel(void (*check_group)(unsigned int group)) {
+  struct group_task tasks[CHECK_THREADS_MAX];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int thread_count = cpus < 1 ? 1 : (cpus > CHECK_THREADS_MAX ? CHECK_THREADS_MAX : cpus);
+  if(thread_count > group_count) {
+    thread_count = group_count;
+  }
+
+  // Thread t checks groups t, t + thread_count, ..., which spreads large and small groups evenly
+  unsigned int started = 0;
+  for(unsigned int t = 0; t < thread_count; t++) {
+    tasks[t].first = t;
+    tasks[t].stride = thread_count;
+    tasks[t].check_group = check_group;
+    if(t > 0 && pthread_create(&tasks[t].thread, NULL, group_worker, &tasks[t]) == 0) {
+      started++;
+    } else if(t > 0) {
+      break;
     }
   }
-  return ret;
+  // Whatever threads couldn't be started for are checked here
+  for(unsigned int t = started + 1; t < thread_count; t++) {
+    group_worker(&tasks[t]);
+  }
+  group_worker(&tasks[0]);
+  for(unsigned int t = 1; t <= started; t++) {
+    pthread_join(tasks[t].thread, NULL);
+  }
 }
 
+/**
+ * Counts the used blocks and inodes of one group from its bitmaps.
+ */
+void count_group(unsigned int group) {
+  group_counts[group].blocks = count_block_bitmap(group);
+  group_counts[group].inodes = count_inode_bitmap(group);
+}
 
 void checkCounters() {
-  int bitmap_count = count_block_bitmap();
-  int inode_count = count_inode_bitmap();
+  int bitmap_count = 0;
+  int inode_count = 0;
+
+  group_counts = calloc(group_count, sizeof(struct group_counts));
+  for_each_group_parallel(count_group);
+
+  for(unsigned int group = 0; group < group_count; group++) {
+    int group_bitmap_count = group_counts[group].blocks;
+    int group_inode_count = group_counts[group].inodes;
+    int group_blocks = group_blocks_count(group);
+    struct ext2_group_desc *gd = &bgdt[group];
+
+    if(group_bitmap_count != (group_blocks - gd->bg_free_blocks_count)) {
+      printf(COUNTER_FIX_STR, "block group", "free blocks", (group_blocks - gd->bg_free_blocks_count) - group_bitmap_count);
+      journal_access(gd, sizeof(struct ext2_group_desc));
+      gd->bg_free_blocks_count = group_blocks - group_bitmap_count;
+      num_fixes++;
+    }
 
+    if(group_inode_count != (sb->s_inodes_per_group - gd->bg_free_inodes_count)) {
+      printf(COUNTER_FIX_STR, "block group", "free inode", (sb->s_inodes_per_group - gd->bg_free_inodes_count) - group_inode_count);
+      journal_access(gd, sizeof(struct ext2_group_desc));
+      gd->bg_free_inodes_count = sb->s_inodes_per_group - group_inode_count;
+      num_fixes++;
+    }
 
-  if(bitmap_count != (sb->s_blocks_count - sb->s_free_blocks_count)) {
-    printf(COUNTER_FIX_STR ,"superblock", "free blocks", sb->s_blocks_count - bitmap_count);
-    sb->s_free_blocks_count = sb->s_blocks_count - bitmap_count;
-    num_fixes++;
+    bitmap_count += group_bitmap_count;
+    inode_count += group_inode_count;
   }
-
-  if(bitmap_count != (sb->s_blocks_count - bgdt->bg_free_blocks_count)) {
-    printf(COUNTER_FIX_STR, "block group", "free blocks", (sb->s_blocks_count - bgdt->bg_free_blocks_count) - bitmap_count);
-    bgdt->bg_free_blocks_count = sb->s_blocks_count - bitmap_count;
+  free(group_counts);
+
+  // Blocks before s_first_data_block belong to no group
+  int data_blocks = sb->s_blocks_count - sb->s_first_data_block;
+  if(bitmap_count != (data_blocks - sb->s_free_blocks_count)) {
+    printf(COUNTER_FIX_STR ,"superblock", "free blocks", (data_blocks - sb->s_free_blocks_count) - bitmap_count);
+    journal_access(sb, sizeof(struct ext2_super_block));
+    sb->s_free_blocks_count = data_blocks - bitmap_count;
     num_fixes++;
   }
 
   if(inode_count != (sb->s_inodes_count - sb->s_free_inodes_count)) {
-    printf(COUNTER_FIX_STR, "superblock", "free inode", sb->s_inodes_count - inode_count);
+    printf(COUNTER_FIX_STR, "superblock", "free inode", (sb->s_inodes_count - sb->s_free_inodes_count) - inode_count);
+    journal_access(sb, sizeof(struct ext2_super_block));
     sb->s_free_inodes_count = sb->s_inodes_count - inode_count;
     num_fixes++;
   }
-
-  if(inode_count != (sb->s_inodes_per_group - bgdt->bg_free_inodes_count)) {
-    printf(COUNTER_FIX_STR, "block group", "free inode", (sb->s_inodes_per_group - bgdt->bg_free_inodes_count) - inode_count);
-    bgdt->bg_free_inodes_count = sb->s_inodes_per_group - inode_count;
-    num_fixes++;
-  }
-
 }
 
 int translate_inode_type_to_dir(int inode_index) {
   int ret = EXT2_FT_UNKNOWN;
-  struct ext2_inode *inode = &inode_table[inode_index-1];
+  struct ext2_inode *inode = get_inode(inode_index);
   switch(inode->i_mode & 0xF000) {
     case EXT2_S_IFLNK :
       ret = EXT2_FT_SYMLINK;
@@ -96,109 +216,341 @@ int translate_inode_type_to_dir(int inode_index) {
   return ret;
 }
 
-void unmarked_block_check(int parent_inode, int block) {
-  if(!(block_bitmap[(block-1)/ 8] & 1 << (block - 1) % 8)) {
-    printf(UNMARKED_BLOCKS_STR, block, parent_inode);
-    block_bitmap[(block - 1)/ 8] |= 1 << (block - 1) % 8;
-    sb->s_free_blocks_count--;
-    bgdt->bg_free_blocks_count--;
-    num_fixes++;
+/**
+ * Block visitor adding each block not marked in use to the inode_report pointed to by arg.
+ */
+int unmarked_block_visitor(unsigned int block_num, void *arg) {
+  struct inode_report *report = arg;
+  if(!block_in_use(block_num)) {
+    report->unmarked_blocks = realloc(report->unmarked_blocks, sizeof(unsigned int) * (report->unmarked_count + 1));
+    report->unmarked_blocks[report->unmarked_count++] = block_num;
   }
-
+  return 0;
 }
 
-void unmarked_inode_check(int inode_num) {
-  if(!(inode_bitmap[(inode_num - 1) / 8] & 1 << (inode_num - 1) % 8)) {
-    printf(UNMARKED_INODE_STR, inode_num);
-    inode_bitmap[(inode_num  - 1)/ 8] |= 1 << (inode_num - 1) % 8;
-    sb->s_free_inodes_count--;
-    bgdt->bg_free_inodes_count--;
-    num_fixes++;
+/**
+ * Checks every reachable inode of the group: its deletion time, its inode bitmap bit, and the bitmap bits
+ * of its blocks. Only reads the image, what needs fixing is added to the group's reports.
+ */
+void inode_group_check(unsigned int group) {
+  struct group_report *group_report = &group_reports[group];
+  unsigned int first = group * sb->s_inodes_per_group + 1;
+
+  for(unsigned int inode_num = first; inode_num < first + sb->s_inodes_per_group && inode_num <= sb->s_inodes_count; inode_num++) {
+    if(!(reachable[(inode_num - 1) / 8] & (1 << ((inode_num - 1) % 8)))) {
+      continue;
+    }
+
+    struct ext2_inode *inode = get_inode(inode_num);
+    struct inode_report report = {inode_num, inode->i_dtime != 0, !inode_in_use(inode_num), 0, NULL};
+    for_each_inode_block(inode, unmarked_block_visitor, &report);
+    if(!report.dtime_set && !report.unmarked && report.unmarked_count == 0) {
+      continue;
+    }
+
+    if(group_report->count == group_report->capacity) {
+      group_report->capacity = group_report->capacity ? group_report->capacity * 2 : 16;
+      group_report->reports = realloc(group_report->reports, sizeof(struct inode_report) * group_report->capacity);
+    }
+    group_report->reports[group_report->count++] = report;
   }
+}
+
+/**
+ * Applies the fixes in the inode reports, group by group in inode order, so the output doesn't depend on
+ * how the groups were spread over threads.
+ */
+void fix_inode_reports() {
+  for(unsigned int group = 0; group < group_count; group++) {
+    struct group_report *group_report = &group_reports[group];
+    for(unsigned int i = 0; i < group_report->count; i++) {
+      struct inode_report *report = &group_report->reports[i];
+
+      if(report->dtime_set) {
+        printf(DTIME_NOT_ZERO_STR, report->inode_num);
+        journal_access(get_inode(report->inode_num), sizeof(struct ext2_inode));
+        get_inode(report->inode_num)->i_dtime = 0;
+        num_fixes++;
+      }
+      if(report->unmarked) {
+        printf(UNMARKED_INODE_STR, report->inode_num);
+        allocate_inode(report->inode_num);
+        num_fixes++;
+      }
 
+      // A block shared with an inode fixed before is already marked by now
+      int fixed = 0;
+      for(unsigned int j = 0; j < report->unmarked_count; j++) {
+        if(!block_in_use(report->unmarked_blocks[j])) {
+          allocate_block(report->unmarked_blocks[j]);
+          fixed++;
+        }
+      }
+      if(fixed) {
+        printf(UNMARKED_BLOCKS_STR, fixed, report->inode_num);
+        num_fixes++;
+      }
+      free(report->unmarked_blocks);
+    }
+    free(group_report->reports);
+  }
 }
 
-void inode_check(int root_idx) {
-  struct ext2_inode *root = &inode_table[root_idx-1];
-  if(root->i_dtime !=  0) {
-    printf(DTIME_NOT_ZERO_STR, root_idx);
-    root->i_dtime = 0;
-    num_fixes++;
+/*
+ * Directories reached but not walked yet. Each directory is queued once, when it is first marked reachable.
+ */
+struct dir_queue {
+  unsigned int *inodes;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int capacity;
+};
+
+/**
+ * Marks the inode as reachable, and queues it to be walked if it's a directory seen for the first time.
+ */
+void reach_inode(struct dir_queue *queue, unsigned int inode_num, int is_dir) {
+  unsigned char mask = 1 << ((inode_num - 1) % 8);
+  if(reachable[(inode_num - 1) / 8] & mask) {
+    return;
   }
-  unmarked_inode_check(root_idx);
+  reachable[(inode_num - 1) / 8] |= mask;
 
-  for(int i = 0; i < root->i_blocks / (2 << sb->s_log_block_size); i++) {
-    if (i < 12 && root->i_block[i] != 0) {
-      unmarked_block_check(root_idx, root->i_block[i]);
-    } else if( i > 11 &&
-        ((int *)(disk + block(root->i_block[INDIRECT_BLOCK_IDX])))[i - (INDIRECT_BLOCK_IDX)] != 0){
-      unmarked_block_check(root_idx, ((int *)(disk + block(root->i_block[INDIRECT_BLOCK_IDX])))[i - (INDIRECT_BLOCK_IDX)]);
+  if(is_dir) {
+    if(queue->tail == queue->capacity) {
+      queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+      queue->inodes = realloc(queue->inodes, sizeof(unsigned int) * queue->capacity);
     }
+    queue->inodes[queue->tail++] = inode_num;
   }
 }
 
-void traversal_check(int root_idx);
-
-void dir_block_check(int block_idx) {
+/**
+ * Fixes the type of every entry in the directory block and marks the inodes they point to as reachable.
+ */
+void dir_block_check(struct dir_queue *queue, int block_idx) {
   struct ext2_dir_entry *directory = (struct ext2_dir_entry *)(disk + block(block_idx));
   int i = 0;
-  while(i < EXT2_BLOCK_SIZE && directory->rec_len != 0) {
-    if(directory->file_type != translate_inode_type_to_dir(directory->inode)) {
-      printf(INODE_MISMATCH_STR, directory->inode);
-      directory->file_type = translate_inode_type_to_dir(directory->inode);
-      num_fixes++;
+  while(i < block_size && directory->rec_len != 0) {
+    // An entry pointing outside the inode tables can't be checked
+    if(directory->inode != 0 && directory->inode <= sb->s_inodes_count) {
+      if(directory->file_type != translate_inode_type_to_dir(directory->inode)) {
+        printf(INODE_MISMATCH_STR, directory->inode);
+        journal_access(directory, sizeof(struct ext2_dir_entry));
+        directory->file_type = translate_inode_type_to_dir(directory->inode);
+        num_fixes++;
+      }
+      // '.' and '..' point at directories that are already marked, so they are never walked twice
+      reach_inode(queue, directory->inode, directory->file_type == EXT2_FT_DIR);
     }
-
-    if(directory->file_type & EXT2_FT_DIR && directory->name_len > 0 && 
-      !((directory->name_len == strlen(".") && strncmp(".", directory->name, directory->name_len) == 0) ||
-          (directory->name_len == strlen("..") && strncmp("..", directory->name, directory->name_len) == 0))) {
-            traversal_check(directory->inode);
-          } else if(directory->inode) {
-            inode_check(directory->inode);
-          }
     i+= directory->rec_len;
-    if(i < EXT2_BLOCK_SIZE) {
+    if(i < block_size) {
       directory = (struct ext2_dir_entry *)(disk + block(block_idx) + i);
     }
   }
 }
 
+/**
+ * Walks the directory tree from the given directory breadth first, fixing entry types and marking every inode
+ * it reaches. Every directory is walked once however many entries point to it, so hard links and loops cost
+ * nothing extra and deep trees don't grow the stack. The inodes themselves are checked afterwards, group by group.
+ */
 void traversal_check(int root_idx) {
-  struct ext2_inode *root = &inode_table[root_idx-1];
-  if(root->i_dtime != 0) {
-    printf(DTIME_NOT_ZERO_STR, root_idx);
-    root->i_dtime = 0;
-    num_fixes++;
+  struct dir_queue queue = {NULL, 0, 0, 0};
+  reach_inode(&queue, root_idx, 1);
+
+  while(queue.head < queue.tail) {
+    struct ext2_inode *dir = get_inode(queue.inodes[queue.head++]);
+    struct block_iter iter;
+    unsigned int blocks[BLOCK_ITER_BATCH];
+    int n;
+
+    block_iter_init(&iter, dir);
+    while((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+      for(int i = 0; i < n; i++) {
+        if(blocks[i] != 0) {
+          dir_block_check(&queue, blocks[i]);
+        }
+      }
+    }
+  }
+  free(queue.inodes);
+}
+
+/**
+ * Returns 1 if the given group holds a copy of the superblock and group descriptors, otherwise 0.
+ * With sparse superblocks only groups 0, 1 and powers of 3, 5 and 7 do.
+ */
+int group_has_super(unsigned int group) {
+  if(group <= 1 || !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+    return 1;
+  }
+  for(unsigned int base = 3; base <= 7; base += 2) {
+    unsigned int power = base;
+    while(power < group) {
+      power *= base;
+    }
+    if(power == group) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Records owner as the owner of count blocks starting at first, reporting every block already claimed.
+ */
+void claim_blocks(unsigned int first, unsigned int count, unsigned int owner) {
+  for(unsigned int block_num = first; block_num < first + count && block_num < sb->s_blocks_count; block_num++) {
+    unsigned int previous = block_owner[block_num];
+    if(previous == 0) {
+      block_owner[block_num] = owner;
+    } else if(previous == METADATA_OWNER) {
+      printf(METADATA_BLOCK_STR, block_num, owner);
+    } else {
+      printf(DUPLICATE_BLOCK_STR, block_num, previous, owner);
+    }
+  }
+}
+
+/**
+ * Claims the indirect block for owner along with every block below it, depth levels of indirection deep.
+ */
+void claim_indirect_block(unsigned int block_num, int depth, unsigned int owner) {
+  if(block_num == 0 || block_num >= sb->s_blocks_count) {
+    return;
+  }
+  claim_blocks(block_num, 1, owner);
+  unsigned int *pointers = (unsigned int *)(disk + block(block_num));
+  for(unsigned int i = 0; i < POINTERS_PER_BLOCK; i++) {
+    if(depth == 1) {
+      if(pointers[i] != 0 && pointers[i] < sb->s_blocks_count) {
+        claim_blocks(pointers[i], 1, owner);
+      }
+    } else {
+      claim_indirect_block(pointers[i], depth - 1, owner);
+    }
+  }
+}
+
+/**
+ * Claims every block the inode points to for it. Unlike for_each_inode_block this doesn't stop at i_size,
+ * a block past the end of the file is still taken and mustn't be freed.
+ */
+void claim_inode_blocks(unsigned int inode_num) {
+  struct ext2_inode *inode = get_inode(inode_num);
+  // A fast symlink keeps its target in i_block
+  if((inode->i_mode & 0xF000) == EXT2_S_IFLNK && inode->i_blocks == 0) {
+    return;
+  }
+  for(int i = 0; i < INDIRECT_BLOCK_IDX; i++) {
+    if(inode->i_block[i] != 0 && inode->i_block[i] < sb->s_blocks_count) {
+      claim_blocks(inode->i_block[i], 1, inode_num);
+    }
+  }
+  claim_indirect_block(inode->i_block[INDIRECT_BLOCK_IDX], 1, inode_num);
+  claim_indirect_block(inode->i_block[DOUBLE_INDIRECT_BLOCK_IDX], 2, inode_num);
+  claim_indirect_block(inode->i_block[TRIPLE_INDIRECT_BLOCK_IDX], 3, inode_num);
+}
+
+/**
+ * Reads the inode tables in order and builds a map of which inode owns each block. The file system's
+ * own metadata is claimed first, so any inode pointing into it is reported. Blocks claimed twice and
+ * in-use inodes the traversal never reached are reported, blocks marked in use that nothing owns are freed.
+ */
+void scan_check() {
+  block_owner = calloc(sb->s_blocks_count, sizeof(unsigned int));
+  unsigned int gdt_blocks = (group_count * sizeof(struct ext2_group_desc) + block_size - 1) / block_size;
+  unsigned int inode_size = sb->s_rev_level == 0 ? sizeof(struct ext2_inode) : sb->s_inode_size;
+  unsigned int table_blocks = (sb->s_inodes_per_group * inode_size + block_size - 1) / block_size;
+
+  // Blocks before s_first_data_block belong to no group
+  claim_blocks(0, sb->s_first_data_block, METADATA_OWNER);
+  for(unsigned int group = 0; group < group_count; group++) {
+    if(group_has_super(group)) {
+      claim_blocks(group_first_block(group), 1 + gdt_blocks + EXT2_RESERVED_GDT_BLOCKS(sb), METADATA_OWNER);
+    }
+    claim_blocks(bgdt[group].bg_block_bitmap, 1, METADATA_OWNER);
+    claim_blocks(bgdt[group].bg_inode_bitmap, 1, METADATA_OWNER);
+    claim_blocks(bgdt[group].bg_inode_table, table_blocks, METADATA_OWNER);
   }
-  unmarked_inode_check(root_idx);
-  inode_check(root_idx);
-
-  for(int i = 0; i < root->i_blocks/(2 << sb->s_log_block_size); i++) {
-    if(i < INDIRECT_BLOCK_IDX) {
-      dir_block_check(root->i_block[i]);
-    } else if (((int *)(disk + block(root->i_block[INDIRECT_BLOCK_IDX]))) ){
-      dir_block_check(((int *)(disk + block(root->i_block[INDIRECT_BLOCK_IDX])))[i - (INDIRECT_BLOCK_IDX-1)]);
-      for(int j = 0; j < EXT2_BLOCK_SIZE && ((int *)(disk + block(root->i_block[i])))[j] != 0; j++) {
-        dir_block_check(((int *)(disk + block(root->i_block[i])))[j]);
-        unmarked_block_check(root_idx, ((int *)(disk + block(root->i_block[i])))[j]);
+
+  for(unsigned int inode_num = 1; inode_num <= sb->s_inodes_count; inode_num++) {
+    if(!inode_in_use(inode_num)) {
+      continue;
+    }
+    if(inode_num == EXT2_RESIZE_INO) {
+      unsigned int dind = get_inode(inode_num)->i_block[DOUBLE_INDIRECT_BLOCK_IDX];
+      if(dind != 0) {
+        claim_blocks(dind, 1, inode_num);
       }
+      continue;
     }
+    if(!(reachable[(inode_num - 1) / 8] & (1 << ((inode_num - 1) % 8))) &&
+       (inode_num == EXT2_ROOT_INO || inode_num >= sb->s_first_ino)) {
+      printf(ORPHAN_INODE_STR, inode_num);
+    }
+    claim_inode_blocks(inode_num);
+  }
 
+  // Free every run of blocks marked in use that no one claimed
+  unsigned int leaked = 0;
+  for(unsigned int group = 0; group < group_count; group++) {
+    char *bitmap = get_block_bitmap(group);
+    unsigned int first = group_first_block(group);
+    int bit = 0;
+    while((bit = bitmap_find_one(bitmap, bit, group_blocks_count(group))) != -1) {
+      unsigned int run = 0;
+      while(bit + run < group_blocks_count(group) && block_owner[first + bit + run] == 0 &&
+            (bitmap[(bit + run) / 8] >> ((bit + run) % 8)) & 1) {
+        run++;
+      }
+      if(run > 0) {
+        deallocate_block_run(first + bit, run);
+        leaked += run;
+      }
+      bit += run > 0 ? run : 1;
+    }
+  }
+  if(leaked) {
+    printf(LEAKED_BLOCKS_STR, leaked);
+    num_fixes++;
   }
+  free(block_owner);
 }
 
 int main(int argc, char const *argv[]) {
+  int scan = take_option(&argc, argv, "--scan");
+  int sync = take_option(&argc, argv, "--sync");
+  int dry_run = take_option(&argc, argv, "--dry-run");
   if (argc != 2) {
-    fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [--scan] [--sync] [--dry-run] <image file name>\n", argv[0]);
     exit(1);
   }
-  init_disk(argv[1]);
+  // A dry run makes every fix on a private copy of the pages it changes, so later checks see the
+  // earlier fixes and report the same things a real run would, without the image ever being written
+  if(dry_run) {
+    init_disk_readonly(argv[1]);
+  } else {
+    init_disk(argv[1]);
+    journal_sync_commits(sync);
+  }
   checkCounters();
-  traversal_check(EXT2_ROOT_INO);
-  printf(TOTAL_FIXES_STR, num_fixes);
 
+  reachable = calloc(sb->s_inodes_count / 8 + 1, 1);
+  traversal_check(EXT2_ROOT_INO);
 
+  group_reports = calloc(group_count, sizeof(struct group_report));
+  for_each_group_parallel(inode_group_check);
+  fix_inode_reports();
+  free(group_reports);
 
+  // Only a scan of the whole inode table finds blocks and inodes the tree doesn't lead to
+  if(scan) {
+    scan_check();
+  }
+  free(reachable);
 
-  return 0;
+  printf(dry_run ? DRY_RUN_FIXES_STR : TOTAL_FIXES_STR, num_fixes);
+  return journal_finish(0);
 }
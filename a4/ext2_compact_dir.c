@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2.h"
+#include "ext2_util.h"
+#include "ext2_htree.h"
+#include "ext2_journal.h"
+
+// Space taken by a directory entry with a name of the given length
+#define DIR_ENTRY_SIZE(name_len) (((sizeof(struct ext2_dir_entry) + (name_len) + 3) / 4) * 4)
+
+/*
+ * What compacting a tree of directories did, reported once at the end.
+ */
+struct compact_stats {
+  unsigned int dirs;
+  unsigned int blocks_before;
+  unsigned int blocks_after;
+  unsigned int skipped;
+};
+
+/*
+ * The live entries of a directory, copied out so its blocks can be written over.
+ */
+struct entry_list {
+  unsigned char *data;
+  size_t used;
+  size_t capacity;
+  size_t *offsets;          // offset of each entry in data
+  unsigned int count;
+  unsigned int offsets_capacity;
+};
+
+static void entry_list_add(struct entry_list *list, struct ext2_dir_entry *entry) {
+  size_t size = sizeof(struct ext2_dir_entry) + entry->name_len;
+  if (list->used + size > list->capacity) {
+    list->capacity = list->capacity * 2 > list->used + size ? list->capacity * 2 : list->used + size + 4096;
+    list->data = realloc(list->data, list->capacity);
+  }
+  if (list->count == list->offsets_capacity) {
+    list->offsets_capacity = list->offsets_capacity ? list->offsets_capacity * 2 : 64;
+    list->offsets = realloc(list->offsets, sizeof(size_t) * list->offsets_capacity);
+  }
+  memcpy(list->data + list->used, entry, size);
+  list->offsets[list->count++] = list->used;
+  list->used += size;
+}
+
+static struct ext2_dir_entry *entry_list_get(struct entry_list *list, unsigned int i) {
+  return (struct ext2_dir_entry *)(list->data + list->offsets[i]);
+}
+
+// The list being sorted, as qsort passes the comparison no context
+static struct entry_list *sort_list;
+
+static int compare_entry_names(const void *a, const void *b) {
+  struct ext2_dir_entry *entry_a = entry_list_get(sort_list, *(const unsigned int *)a);
+  struct ext2_dir_entry *entry_b = entry_list_get(sort_list, *(const unsigned int *)b);
+  int len = entry_a->name_len < entry_b->name_len ? entry_a->name_len : entry_b->name_len;
+  int cmp = memcmp(entry_a->name, entry_b->name, len);
+  return cmp != 0 ? cmp : entry_a->name_len - entry_b->name_len;
+}
+
+static int is_dot_entry(struct ext2_dir_entry *entry) {
+  return (entry->name_len == 1 && entry->name[0] == '.') ||
+    (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+}
+
+/**
+ * Copies the live entries of the directory into list, in the order the blocks hold them. Returns 0 on success,
+ * or -1 if the directory has a hole or a damaged entry, which compacting would only make worse.
+**/
+static int gather_entries(struct ext2_inode *dir, struct entry_list *list) {
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  int n;
+
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (blocks[i] == 0) {
+        return -1;
+      }
+      for (unsigned int offset = 0; offset < block_size;) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(blocks[i]) + offset);
+        if (entry->rec_len < DIR_ENTRY_SIZE(0) || entry->rec_len % 4 != 0 || offset + entry->rec_len > block_size ||
+            DIR_ENTRY_SIZE(entry->name_len) > entry->rec_len) {
+          return -1;
+        }
+        if (entry->inode != 0) {
+          entry_list_add(list, entry);
+        }
+        offset += entry->rec_len;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns the number of blocks the entries take up packed densely in the order given by order.
+**/
+static unsigned int packed_blocks(struct entry_list *list, unsigned int *order) {
+  unsigned int blocks = 1;
+  unsigned int offset = 0;
+  for (unsigned int i = 0; i < list->count; i++) {
+    unsigned int size = DIR_ENTRY_SIZE(entry_list_get(list, order[i])->name_len);
+    if (offset + size > block_size) {
+      blocks++;
+      offset = 0;
+    }
+    offset += size;
+  }
+  return blocks;
+}
+
+/**
+ * Writes the entries, in the order given by order, densely into the directory's first blocks, the last entry of
+ * each block taking up the rest of it. Blocks that come out the same are left alone. Returns the number of blocks used.
+**/
+static unsigned int pack_entries(struct ext2_inode *dir, struct entry_list *list, unsigned int *order) {
+  unsigned char buf[EXT2_MAX_BLOCK_SIZE];
+  struct ext2_dir_entry *last = NULL;
+  unsigned int logical = 0;
+  unsigned int offset = 0;
+
+  for (unsigned int i = 0; i <= list->count; i++) {
+    struct ext2_dir_entry *entry = i < list->count ? entry_list_get(list, order[i]) : NULL;
+    // Close the block when it is full or there is nothing left to put in it
+    if (entry == NULL || offset + DIR_ENTRY_SIZE(entry->name_len) > block_size) {
+      if (last == NULL) {
+        last = (struct ext2_dir_entry *)buf;
+        memset(last, 0, sizeof(struct ext2_dir_entry));
+      }
+      last->rec_len = block_size - ((unsigned char *)last - buf);
+      // Clear the leftovers so nothing stale is read back from the slack
+      memset((unsigned char *)last + DIR_ENTRY_SIZE(last->name_len), 0, last->rec_len - DIR_ENTRY_SIZE(last->name_len));
+
+      unsigned int block_num = get_inode_block(dir, logical);
+      if (memcmp(disk + block(block_num), buf, block_size) != 0) {
+        journal_block(block_num);
+        memcpy(disk + block(block_num), buf, block_size);
+      }
+      logical++;
+      offset = 0;
+      last = NULL;
+      if (entry == NULL) {
+        break;
+      }
+    }
+    last = (struct ext2_dir_entry *)(buf + offset);
+    memcpy(last, entry, sizeof(struct ext2_dir_entry) + entry->name_len);
+    last->rec_len = DIR_ENTRY_SIZE(entry->name_len);
+    memset(last->name + entry->name_len, 0, last->rec_len - sizeof(struct ext2_dir_entry) - entry->name_len);
+    offset += last->rec_len;
+  }
+  return logical;
+}
+
+/**
+ * Repacks the live entries of a linear directory into as few blocks as they fit in, sorted by name after '.' and
+ * '..' when sort is set, and frees the blocks left empty at the end. Indexed directories are left alone unless
+ * their entries now fit in a single block: a lookup in one only reads a single leaf, and the index pins every
+ * entry to the leaf its hash belongs to.
+**/
+static void compact_dir(unsigned int dir_inode_num, int sort, struct compact_stats *stats) {
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  struct entry_list list = {NULL, 0, 0, NULL, 0, 0};
+  unsigned int blocks_before = inode_logical_blocks(dir);
+
+  int indexed = (dir->i_flags & EXT2_INDEX_FL) != 0;
+  if ((indexed && !dx_is_indexed(dir)) || blocks_before == 0 || gather_entries(dir, &list) == -1) {
+    stats->skipped++;
+    goto out;
+  }
+
+  unsigned int *order = malloc(sizeof(unsigned int) * (list.count + 1));
+  unsigned int fixed = 0;
+  for (unsigned int i = 0; i < list.count; i++) {
+    order[i] = i;
+  }
+  // '.' and '..' stay at the front of the first block
+  while (fixed < list.count && fixed < 2 && is_dot_entry(entry_list_get(&list, fixed))) {
+    fixed++;
+  }
+  if (sort) {
+    sort_list = &list;
+    qsort(order + fixed, list.count - fixed, sizeof(unsigned int), compare_entry_names);
+    // Packed in their old order the entries never need more blocks than they had, sorted they might
+    if (packed_blocks(&list, order) > blocks_before) {
+      for (unsigned int i = 0; i < list.count; i++) {
+        order[i] = i;
+      }
+    }
+  }
+
+  // An index is only dropped once what is left of the directory fits in one block, which needs no index
+  if (indexed && packed_blocks(&list, order) > 1) {
+    stats->skipped++;
+    free(order);
+    goto out;
+  }
+  if (indexed) {
+    dx_drop_index(dir);
+  }
+
+  unsigned int blocks_after = pack_entries(dir, &list, order);
+  dspace_forget(dir_inode_num);
+  free(order);
+  if (blocks_after < blocks_before) {
+    truncate_inode_blocks(dir, blocks_after);
+    journal_access(dir, sizeof(struct ext2_inode));
+    dir->i_size = blocks_after * block_size;
+  }
+  stats->dirs++;
+  stats->blocks_before += blocks_before;
+  stats->blocks_after += blocks_after;
+
+out:
+  free(list.data);
+  free(list.offsets);
+}
+
+/**
+ * Compacts the directory and, when recursive is set, every directory below it.
+**/
+static void compact_tree(unsigned int dir_inode_num, int sort, int recursive, struct compact_stats *stats) {
+  compact_dir(dir_inode_num, sort, stats);
+  if (!recursive) {
+    return;
+  }
+
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  unsigned int logical = 0;
+  int n;
+
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n; i++, logical++) {
+      if (blocks[i] == 0 || dx_is_index_block(dir, logical)) {
+        continue;
+      }
+      for (unsigned int offset = 0; offset < block_size;) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(blocks[i]) + offset);
+        if (entry->rec_len < DIR_ENTRY_SIZE(0)) {
+          break;
+        }
+        // lost+found keeps the blocks it was made with, so e2fsck has room to reconnect files without allocating
+        int is_lost_found = dir_inode_num == EXT2_ROOT_INO && entry->name_len == 10 && strncmp(entry->name, "lost+found", 10) == 0;
+        if (entry->inode != 0 && entry->file_type == EXT2_FT_DIR && !is_dot_entry(entry) && !is_lost_found &&
+            (get_inode(entry->inode)->i_mode & 0xF000) == EXT2_S_IFDIR) {
+          compact_tree(entry->inode, sort, recursive, stats);
+        }
+        offset += entry->rec_len;
+      }
+    }
+  }
+}
+
+/**
+ * Repacks the directory at dir_path, and every directory below it with -r, so lookups and ext2_cp's inserts walk
+ * fewer blocks. Removed entries are written over, so ext2_restore can no longer bring them back.
+**/
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int sort = take_option(&argc, argv, "--sort");
+  int recursive = take_option(&argc, argv, "-r");
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s [--sync] [--sort] [-r] <image file name> <path to directory>\n", argv[0]);
+    exit(1);
+  }
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+
+  if (argv[2][0] != '/') {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
+  }
+  char *path = malloc(strlen(argv[2]) + 1);
+  strcpy(path, argv[2]);
+  int dir_inode_num = traverse_path(EXT2_ROOT_INO, path);
+  free(path);
+  if (dir_inode_num == 0 || (get_inode(dir_inode_num)->i_mode & 0xF000) != EXT2_S_IFDIR) {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
+  }
+
+  struct compact_stats stats = {0, 0, 0, 0};
+  compact_tree(dir_inode_num, sort, recursive, &stats);
+  printf("%u directories compacted from %u to %u blocks", stats.dirs, stats.blocks_before, stats.blocks_after);
+  if (stats.skipped > 0) {
+    printf(", %u indexed or damaged ones left as they were", stats.skipped);
+  }
+  printf("\n");
+  return journal_finish(0);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -7,120 +8,579 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "ext2.h"
 #include "ext2_util.h"
+#include "ext2_tools.h"
+#include "ext2_journal.h"
 
+// Most threads copying file data at once in recursive mode
+#define CP_WORKERS_MAX 8
+// Most files waiting for their data at once in recursive mode, which bounds the open host files
+#define CP_QUEUE_MAX 64
+// Blocks read at a time when looking for blocks of zeros in a host file
+#define CP_SCAN_BLOCKS 64
 
+/*
+ * A host file being copied into the image. Its blocks and inode are taken by the thread doing the
+ * metadata, its data can then be copied by any thread as it only touches the file's own blocks.
+ */
+struct cp_file {
+  int src_fd;
+  off_t size;
+  unsigned int inode_num;
+  // Logical blocks in the file, holes included
+  unsigned int data_blocks;
+  // Every block reserved for the file, indirect blocks included
+  unsigned int num_blocks;
+  unsigned int *blocks;
+  // The data blocks in file order, 0 for holes
+  unsigned int *data;
+  // Where the file ends up in the image, kept so a failed copy can be removed again
+  char *image_path;
+  struct cp_file *next;
+};
 
-int main(int argc, char const *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <image file name> <path to source file> <path to dest>\n", argv[0]);
-    exit(1);
+/*
+ * The threads copying file data in recursive mode, and the files queued up for them.
+ */
+struct cp_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct cp_file *head;
+  struct cp_file *tail;
+  unsigned int queued;
+  int closing;
+  // Files whose data could not be copied
+  struct cp_file *failed;
+  pthread_t workers[CP_WORKERS_MAX];
+  int worker_count;
+};
+
+/**
+ * Closes the host file and frees everything held for it.
+**/
+static void free_file(struct cp_file *file) {
+  if(file->src_fd != -1) {
+    close(file->src_fd);
   }
+  free(file->blocks);
+  free(file->data);
+  free(file->image_path);
+  free(file);
+}
 
-  init_disk(argv[1]);
+/**
+ * Returns 1 if the len bytes at data are all zero, otherwise 0.
+**/
+static int is_zero(const unsigned char *data, size_t len) {
+  return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+/**
+ * Stores the logical blocks of the host file holding anything but zeros in logical, in increasing order, looking
+ * no further than the file->size it was measured at. logical needs room for file->data_blocks entries.
+ * Holes in the host file are skipped with SEEK_DATA and SEEK_HOLE without being read, the data around them
+ * is read to find blocks that are all zeros anyway. Returns the number of blocks stored, or -1 on error.
+**/
+static int find_data_blocks(struct cp_file *file, unsigned int *logical) {
+  unsigned char *buf = malloc(CP_SCAN_BLOCKS * block_size);
+  unsigned int count = 0;
+  // The first logical block not looked at yet
+  unsigned int next = 0;
+  off_t data = 0;
+
+  while(data < file->size && (data = lseek(file->src_fd, data, SEEK_DATA)) != -1) {
+    off_t hole = lseek(file->src_fd, data, SEEK_HOLE);
+    if(hole == -1) {
+      goto error;
+    }
+    // The file may have grown since it was measured, only the size taken then is copied and has room in logical
+    if(hole > file->size) {
+      hole = file->size;
+    }
+    unsigned int first = data / block_size > next ? data / block_size : next;
+    unsigned int end = (hole + block_size - 1) / block_size;
+    if(end > file->data_blocks) {
+      end = file->data_blocks;
+    }
+
+    for(unsigned int chunk = first; chunk < end; chunk += CP_SCAN_BLOCKS) {
+      unsigned int blocks = end - chunk < CP_SCAN_BLOCKS ? end - chunk : CP_SCAN_BLOCKS;
+      off_t offset = (off_t)chunk * block_size;
+      size_t len = (size_t)blocks * block_size;
+      if(offset + (off_t)len > file->size) {
+        len = file->size - offset;
+      }
+      if(pread(file->src_fd, buf, len, offset) != (ssize_t)len) {
+        goto error;
+      }
+      for(unsigned int i = 0; i < blocks; i++) {
+        size_t block_len = len - (size_t)i * block_size < block_size ? len - (size_t)i * block_size : block_size;
+        if(!is_zero(buf + (size_t)i * block_size, block_len)) {
+          logical[count++] = chunk + i;
+        }
+      }
+    }
+    next = end;
+    data = hole;
+  }
+  // Running out of data before the end of the file only means the rest is a hole
+  if(data == -1 && errno != ENXIO) {
+    goto error;
+  }
+  free(buf);
+  return count;
+
+error:
+  free(buf);
+  return -1;
+}
 
-  char *path;
-  char *nf_name;
+/**
+ * Reserves every block the file needs, placed contiguously from the parent's group when possible, takes an
+ * inode for it and maps the blocks into it. Nothing is taken if this fails.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+static int reserve_file(struct cp_file *file, unsigned int parent_inode_num) {
+  // Work out how many data blocks, plus the indirect blocks mapping them, the file needs.
+  // i_size is 32 bits, which also keeps the file well within the triple indirect range.
+  if(file->size > 0xFFFFFFFFL) {
+    fprintf(stderr, "File too large for an inode\n");
+    return -EFBIG;
+  }
+  file->data_blocks = (file->size + block_size - 1) / block_size;
+
+  // Blocks of zeros are left as holes, so only blocks holding data and their indirect blocks are needed
+  unsigned int *logical = malloc(sizeof(unsigned int) * (file->data_blocks + 1));
+  int present = find_data_blocks(file, logical);
+  if(present == -1) {
+    perror("read");
+    free(logical);
+    return -EIO;
+  }
+  file->num_blocks = present + indirect_blocks_needed_sparse(logical, present);
+  if(file->num_blocks > sb->s_free_blocks_count) {
+    fprintf(stderr, "File too large for filesystem\n");
+    free(logical);
+    return -ENOSPC;
+  }
+
+  // Reserve every block the file needs in one pass
+  file->blocks = malloc(sizeof(unsigned int) * (file->num_blocks + 1));
+  if(reserve_blocks(group_first_block(inode_group(parent_inode_num)), file->num_blocks, file->blocks) == -1) {
+    fprintf(stderr, "No more avaliable blocks\n");
+    free(logical);
+    return -ENOSPC;
+  }
+
+  // Find an available inode, throw if there aren't any more avaliable
+  if((file->inode_num = find_available_inode()) == 0) {
+    fprintf(stderr, "No more avaliable inodes\n");
+    release_blocks(file->num_blocks, file->blocks);
+    free(logical);
+    return -ENOSPC;
+  }
+
+  // allocate the found inode
+  allocate_inode(file->inode_num);
+  // Initialize the inode as a file
+  initialize_inode(file->inode_num, EXT2_S_IFREG);
+
+  struct ext2_inode *new_inode = get_inode(file->inode_num);
+  new_inode->i_size = file->size;
+
+  // Map the reserved blocks in the order they were reserved, so each indirect block sits right before the data it maps
+  file->data = calloc(file->data_blocks + 1, sizeof(unsigned int));
+  unsigned int used = 0;
+  for(int i = 0; i < present; i++) {
+    file->data[logical[i]] = map_inode_block(new_inode, logical[i], file->blocks, &used);
+  }
+  free(logical);
+  return 0;
+}
+
+/**
+ * Gives back the blocks and inode reserve_file took for the file.
+**/
+static void release_file(struct cp_file *file) {
+  release_blocks(file->num_blocks, file->blocks);
+  deallocate_inode(file->inode_num);
+}
+
+/**
+ * Copies the host file into its blocks in the image, one run of physically contiguous blocks at a time.
+ * Holes are skipped. Only the file's own blocks are written, so any number of files can be copied at once.
+ * Returns 0 on success, or -1 on error.
+**/
+static int import_file(struct cp_file *file) {
+  unsigned int i = 0;
+  while(i < file->data_blocks) {
+    if(file->data[i] == 0) {
+      i++;
+      continue;
+    }
+    unsigned int first = file->data[i];
+    unsigned int run = 1;
+    while(i + run < file->data_blocks && file->data[i + run] == first + run) {
+      run++;
+    }
+
+    off_t offset = (off_t)i * block_size;
+    size_t len = (size_t)run * block_size;
+    if(offset + (off_t)len > file->size) {
+      len = file->size - offset;
+    }
+    if(import_blocks(file->src_fd, offset, first, len) != (ssize_t)len) {
+      return -1;
+    }
+    i += run;
+  }
+  // Clear whatever the last block held beyond the end of the file
+  if(file->size % block_size && file->data[file->data_blocks - 1] != 0) {
+    memset(disk + block(file->data[file->data_blocks - 1]) + file->size % block_size, 0,
+           block_size - file->size % block_size);
+  }
+  return 0;
+}
+
+/**
+ * Copies the file at src_path on the host into the image at dest_path. A dest_path ending in '/'
+ * names the directory to copy into, keeping the source's file name.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_cp(const char *src_path, const char *dest_path) {
+  int ret = 0;
+  struct cp_file *file = calloc(1, sizeof(struct cp_file));
+  file->src_fd = -1;
+
+  size_t path_len = strlen(src_path) > strlen(dest_path) ? strlen(src_path) : strlen(dest_path);
+  char *path = malloc(sizeof(char) * (path_len + 1));
+  char *nf_name = malloc(sizeof(char) * (path_len + 1));
 
   // Does the destination directory use the same name as the source?
-  if(argv[3][strlen(argv[3]) - 1] == '/') {
+  if(dest_path[strlen(dest_path) - 1] == '/') {
     // Yes, get the name of the file from the source.
-    path = malloc(sizeof(char) *
-        (strlen(argv[2]) > strlen(argv[3]) ? strlen(argv[2]) : strlen(argv[3])));
-    nf_name = malloc(sizeof(char) * strlen(argv[2]));
-    strcpy(path, argv[2]);
+    strcpy(path, src_path);
     split_parent_path_and_target(path, nf_name);
-    strcpy(path, argv[3]);
+    strcpy(path, dest_path);
   } else {
     // No, get the name of the file from the destination.
-    path = malloc(sizeof(char) * strlen(argv[3]));
-    nf_name = malloc(sizeof(char) * strlen(argv[3]));
-    strcpy(path, argv[3]);
+    strcpy(path, dest_path);
     split_parent_path_and_target(path, nf_name);
   }
 
   // Try and open the src file on the main filesystem exit if unable to
-  FILE *src_file;
-  if((src_file = fopen (argv[2],"r")) == NULL) {
+  struct stat src_stat;
+  if((file->src_fd = open(src_path, O_RDONLY)) == -1 || fstat(file->src_fd, &src_stat) == -1 || !S_ISREG(src_stat.st_mode)) {
     fprintf(stderr, "Invalid Source File\n");
-    exit(ENOENT);
+    ret = ENOENT;
+    goto out;
   };
+  file->size = src_stat.st_size;
 
+  // Get the parent inode
+  int parent_inode_num = traverse_path(EXT2_ROOT_INO, path);
+  if(parent_inode_num== 0 || !(get_inode(parent_inode_num)->i_mode & EXT2_S_IFDIR)) {
+    fprintf(stderr, "Invalid path\n");
+    ret = -ENOENT;
+    goto out;
+  }
 
-  // Check that the file isn't too large
-  fseek(src_file, 0 , SEEK_END);
-  long fileSize = ftell(src_file);
-  fseek(src_file, 0 , SEEK_SET);// needed for next read from beginning of file
-  int num_blocks = fileSize / EXT2_BLOCK_SIZE;
-  if(num_blocks > 12) {
-    num_blocks++;
+  if((ret = reserve_file(file, parent_inode_num)) != 0) {
+    goto out;
   }
-  if(num_blocks > sb->s_free_blocks_count) {
-    fprintf(stderr, "File too large for filesystem\n");
-    exit(-ENOSPC);
+
+  if(import_file(file) == -1) {
+    perror("import");
+    release_file(file);
+    ret = 1;
+    goto out;
   }
 
-  // Get the parent inode
-  int parent_inode_num = traverse_path(EXT2_ROOT_INO, path);
-  if(parent_inode_num== 0 || !(inode_table[parent_inode_num - 1].i_mode & EXT2_S_IFDIR)) {
-    fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+  if(insert_dir_entry(parent_inode_num, file->inode_num, nf_name, EXT2_FT_REG_FILE) == NULL) {
+    fprintf(stderr, "Directory entry cannot be inserted\n");
+    release_file(file);
+    ret = -ENOSPC;
+    goto out;
   }
 
+out:
+  free_file(file);
+  free(path);
+  free(nf_name);
+  return ret;
+}
 
-  // Create Inode
-  unsigned int new_file_inode_idx;
+/**
+ * Copy thread of the pool: takes queued files and copies their data until the pool is closed and empty.
+**/
+static void *cp_worker(void *arg) {
+  struct cp_pool *pool = arg;
 
-  // Find an available inode, throw if there aren't any more avaliable
-  if((new_file_inode_idx = find_available_inode()) == 0) {
-    fprintf(stderr, "No more avaliable inodes\n");
-    exit(-ENOSPC);
+  while(1) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->head == NULL && !pool->closing) {
+      pthread_cond_wait(&pool->not_empty, &pool->lock);
+    }
+    struct cp_file *file = pool->head;
+    if(file == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pool->head = file->next;
+    if(pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pool->queued--;
+    pthread_cond_signal(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    if(import_file(file) == 0) {
+      free_file(file);
+      continue;
+    }
+    perror(file->image_path);
+    pthread_mutex_lock(&pool->lock);
+    file->next = pool->failed;
+    pool->failed = file;
+    pthread_mutex_unlock(&pool->lock);
   }
+}
 
-  // allocate the found inode
-  allocate_inode(new_file_inode_idx);
-  // Initialize the inode as a file
-  initialize_inode(new_file_inode_idx, EXT2_S_IFREG);
-
-  struct ext2_inode *new_inode = &inode_table[new_file_inode_idx - 1];
-
-  // Start reading, block by block, from the src file into blocks of the image
-  unsigned int new_block;
-  char buff[EXT2_BLOCK_SIZE];
-  int read;
-  while((read = fread(buff, sizeof(char), EXT2_BLOCK_SIZE, src_file)) > 0) {
-    if(new_inode->i_blocks/(2<<sb->s_log_block_size) == INDIRECT_BLOCK_IDX) {
-      unsigned int indirect_block;
-      if((indirect_block = find_available_block()) == 0) {
-        fprintf(stderr, "No more avaliable blocks\n");
-        exit(-ENOSPC);
-      }
-      allocate_block(indirect_block);
-      new_inode->i_block[new_inode->i_blocks/(2<<sb->s_log_block_size)] = indirect_block;
-      new_inode->i_blocks+= 2<<sb->s_log_block_size;
+/**
+ * Starts up to CP_WORKERS_MAX copy threads, one per online CPU.
+**/
+static void pool_start(struct cp_pool *pool) {
+  memset(pool, 0, sizeof(struct cp_pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->not_empty, NULL);
+  pthread_cond_init(&pool->not_full, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int wanted = cpus < 1 ? 1 : (cpus > CP_WORKERS_MAX ? CP_WORKERS_MAX : cpus);
+  while(pool->worker_count < wanted && pthread_create(&pool->workers[pool->worker_count], NULL, cp_worker, pool) == 0) {
+    pool->worker_count++;
+  }
+}
+
+/**
+ * Queues a file to have its data copied, waiting while the queue is full. The pool takes the file over.
+ * Without any copy threads the data is copied right away.
+**/
+static void pool_push(struct cp_pool *pool, struct cp_file *file) {
+  file->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if(pool->worker_count == 0) {
+    pthread_mutex_unlock(&pool->lock);
+    if(import_file(file) == 0) {
+      free_file(file);
+    } else {
+      perror(file->image_path);
+      file->next = pool->failed;
+      pool->failed = file;
+    }
+    return;
+  }
+
+  while(pool->queued == CP_QUEUE_MAX) {
+    pthread_cond_wait(&pool->not_full, &pool->lock);
+  }
+  if(pool->tail == NULL) {
+    pool->head = file;
+  } else {
+    pool->tail->next = file;
+  }
+  pool->tail = file;
+  pool->queued++;
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Waits for every queued file to be copied and stops the copy threads.
+ * Returns the files that could not be copied.
+**/
+static struct cp_file *pool_finish(struct cp_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->closing = 1;
+  pthread_cond_broadcast(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(int i = 0; i < pool->worker_count; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->not_empty);
+  pthread_cond_destroy(&pool->not_full);
+  return pool->failed;
+}
+
+/**
+ * Returns a newly allocated "<parent>/<name>".
+**/
+static char *join_path(const char *parent, const char *name) {
+  char *path = malloc(strlen(parent) + strlen(name) + 2);
+  sprintf(path, "%s/%s", parent, name);
+  return path;
+}
+
+/**
+ * Imports everything in the host directory host_path into the image directory image_path, whose inode is
+ * dir_inode_num. Directories and symbolic links are created and files are given their blocks and entries here,
+ * on the calling thread; the files' data is left to the pool. Anything else, like a device or a socket, can't be
+ * copied and fails the import.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+static int import_dir(struct cp_pool *pool, const char *host_path, const char *image_path, unsigned int dir_inode_num) {
+  DIR *dir = opendir(host_path);
+  if(dir == NULL) {
+    perror(host_path);
+    return ENOENT;
+  }
+
+  int ret = 0;
+  struct dirent *entry;
+  while(ret == 0 && (entry = readdir(dir)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
     }
+    if(strlen(entry->d_name) > EXT2_NAME_LEN) {
+      fprintf(stderr, "%s: Name too long\n", entry->d_name);
+      ret = -ENAMETOOLONG;
+      break;
+    }
+
+    char *host_child = join_path(host_path, entry->d_name);
+    char *image_child = join_path(image_path, entry->d_name);
+    struct stat child_stat;
+
+    if(lstat(host_child, &child_stat) == -1) {
+      perror(host_child);
+      ret = ENOENT;
+    } else if(S_ISDIR(child_stat.st_mode)) {
+      if((ret = ext2_mkdir(image_child)) == 0) {
+        ret = import_dir(pool, host_child, image_child, find_next_inode(dir_inode_num, entry->d_name));
+      }
+    } else if(S_ISREG(child_stat.st_mode)) {
+      struct cp_file *file = calloc(1, sizeof(struct cp_file));
+      file->size = child_stat.st_size;
+      file->image_path = image_child;
+      image_child = NULL;
 
-    if((new_block = find_available_block()) == 0) {
-      fprintf(stderr, "No more avaliable blocks\n");
-      exit(-ENOSPC);
+      if((file->src_fd = open(host_child, O_RDONLY)) == -1) {
+        perror(host_child);
+        ret = ENOENT;
+      } else if((ret = reserve_file(file, dir_inode_num)) == 0) {
+        if(insert_dir_entry(dir_inode_num, file->inode_num, entry->d_name, EXT2_FT_REG_FILE) == NULL) {
+          fprintf(stderr, "Directory entry cannot be inserted\n");
+          release_file(file);
+          ret = -ENOSPC;
+        }
+      }
+
+      if(ret == 0) {
+        pool_push(pool, file);
+      } else {
+        free_file(file);
+      }
+    } else if(S_ISLNK(child_stat.st_mode)) {
+      // The link is copied as it is, whether or not what it points at is copied too
+      char *target = malloc(child_stat.st_size + 1);
+      ssize_t len = readlink(host_child, target, child_stat.st_size + 1);
+      if(len == -1 || len > child_stat.st_size) {
+        fprintf(stderr, "%s: Link changed while being copied\n", host_child);
+        ret = -EIO;
+      } else {
+        target[len] = '\0';
+        ret = ext2_symlink(dir_inode_num, entry->d_name, target);
+      }
+      free(target);
+    } else {
+      fprintf(stderr, "%s: Not a regular file, directory or symbolic link\n", host_child);
+      ret = -EINVAL;
     }
 
-    allocate_block(new_block);
+    free(host_child);
+    free(image_child);
+  }
+
+  closedir(dir);
+  return ret;
+}
 
-    memcpy((char *)(disk + block(new_block)), buff, read);
-    if(new_inode->i_blocks/(2<<sb->s_log_block_size) < 12) {
-      new_inode->i_block[new_inode->i_blocks/(2<<sb->s_log_block_size)] = new_block;
-    } else if(((new_inode->i_blocks/2<<sb->s_log_block_size) - (INDIRECT_BLOCK_IDX+1)) < EXT2_BLOCK_SIZE) {
-      // Assign new block to the indirect block
-      ((int *)(disk + block(new_inode->i_block[INDIRECT_BLOCK_IDX])))[(new_inode->i_blocks/2<<sb->s_log_block_size) - (INDIRECT_BLOCK_IDX + 1)] = new_block;
+/**
+ * Copies the directory tree at src_path on the host into the image as the new directory dest_path. A dest_path
+ * ending in '/' names the directory to copy into, keeping the source's name. Files' data is copied by a pool of
+ * threads while this thread keeps creating directories and entries. Files whose data can't be copied are removed.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_cp_tree(const char *src_path, const char *dest_path) {
+  struct stat src_stat;
+  if(stat(src_path, &src_stat) == -1 || !S_ISDIR(src_stat.st_mode)) {
+    fprintf(stderr, "Invalid Source Directory\n");
+    return ENOENT;
+  }
+
+  // Work out the path of the new directory
+  char *root;
+  if(dest_path[strlen(dest_path) - 1] == '/') {
+    char *src_copy = malloc(strlen(src_path) + 1);
+    char *name = malloc(strlen(src_path) + 1);
+    strcpy(src_copy, src_path);
+    split_parent_path_and_target(src_copy, name);
+    root = join_path(dest_path, name);
+    free(src_copy);
+    free(name);
+  } else {
+    root = malloc(strlen(dest_path) + 1);
+    strcpy(root, dest_path);
+  }
+
+  int ret = ext2_mkdir(root);
+  if(ret == 0) {
+    char *root_copy = malloc(strlen(root) + 1);
+    strcpy(root_copy, root);
+
+    struct cp_pool pool;
+    pool_start(&pool);
+    ret = import_dir(&pool, src_path, root, traverse_path(EXT2_ROOT_INO, root_copy));
+
+    // Take out every file that was left without its data
+    struct cp_file *failed = pool_finish(&pool);
+    while(failed != NULL) {
+      struct cp_file *next = failed->next;
+      ext2_rm(0, failed->image_path);
+      free_file(failed);
+      failed = next;
+      if(ret == 0) {
+        ret = 1;
+      }
     }
-    new_inode->i_blocks+= 2<<sb->s_log_block_size;
-    new_inode->i_size += read;
+    free(root_copy);
   }
-  fclose(src_file);
 
-  insert_dir_entry(parent_inode_num, new_file_inode_idx, nf_name, EXT2_FT_REG_FILE);
+  free(root);
+  return ret;
+}
 
+#ifndef EXT2_BATCH
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int index = take_option(&argc, argv, "--index");
+  if (argc != 4 && (argc != 5 || strcmp(argv[2], "-r") != 0)) {
+    fprintf(stderr, "Usage: %s [--sync] [--index] <image file name> [-r] <path to source file> <path to dest>\n", argv[0]);
+    exit(1);
+  }
 
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+  index_growing_dirs(index);
+  if (argc == 5) {
+    return journal_finish(ext2_cp_tree(argv[3], argv[4]));
+  }
+  return journal_finish(ext2_cp(argv[2], argv[3]));
 }
+#endif
@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2.h"
+#include "ext2_util.h"
+#include "ext2_journal.h"
+
+/*
+ * A file found in the tree, and where it is.
+ */
+struct defrag_file {
+  unsigned int inode;
+  char *path;
+};
+
+/*
+ * Every file, directory and link under the starting directory, each inode once however many
+ * links lead to it.
+ */
+struct file_list {
+  struct defrag_file *files;
+  unsigned int count;
+  unsigned int capacity;
+  char *seen;                 // bitmap of the inodes already listed
+};
+
+/*
+ * How an inode's blocks lie on disk, walked in the order for_each_inode_block visits them, which puts each indirect
+ * block right before the blocks it maps. That is the order ext2_cp lays a file out in, so a file copied into
+ * free space is one extent.
+ */
+struct layout {
+  unsigned int blocks;
+  unsigned int extents;       // runs of blocks that follow each other on disk
+  unsigned int last;
+};
+
+/*
+ * What a run did, reported once at the end.
+ */
+struct defrag_stats {
+  unsigned int files;
+  unsigned int fragmented;
+  unsigned int moved;
+};
+
+static int layout_visitor(unsigned int block_num, void *arg) {
+  struct layout *layout = arg;
+  if (layout->blocks == 0 || block_num != layout->last + 1) {
+    layout->extents++;
+  }
+  layout->last = block_num;
+  layout->blocks++;
+  return 0;
+}
+
+/**
+ * Returns the fragmentation score of a layout in tenths of a percent: the share of the breaks a file of its size
+ * could have that it does have, from 0 for a single extent to 1000 for a file with no two blocks next to each
+ * other. Rounded up, so any file in more than one extent scores above 0.
+**/
+static unsigned int fragmentation_score(struct layout *layout) {
+  if (layout->blocks <= 1) {
+    return 0;
+  }
+  return ((unsigned long long)(layout->extents - 1) * 1000 + layout->blocks - 2) / (layout->blocks - 1);
+}
+
+/**
+ * Returns the number of breaks between extents per MiB of the file, in tenths, which unlike the score doesn't
+ * shrink as files grow: it is roughly how many extra seeks reading each MiB of the file takes. Rounded up like
+ * the score.
+**/
+static unsigned int breaks_per_mib(struct layout *layout) {
+  if (layout->blocks == 0) {
+    return 0;
+  }
+  unsigned long long blocks_per_mib = (1024 * 1024) / block_size;
+  return ((unsigned long long)(layout->extents - 1) * blocks_per_mib * 10 + layout->blocks - 1) / layout->blocks;
+}
+
+static int list_has(struct file_list *list, unsigned int inode_num) {
+  return (list->seen[(inode_num - 1) / 8] & (1 << ((inode_num - 1) % 8))) != 0;
+}
+
+// Takes ownership of path
+static void list_add(struct file_list *list, unsigned int inode_num, char *path) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->files = realloc(list->files, sizeof(struct defrag_file) * list->capacity);
+  }
+  list->files[list->count].inode = inode_num;
+  list->files[list->count].path = path;
+  list->count++;
+  list->seen[(inode_num - 1) / 8] |= 1 << ((inode_num - 1) % 8);
+}
+
+/**
+ * Lists every inode below the directory at dir_path, directories before what they hold.
+**/
+static void list_tree(struct file_list *list, unsigned int dir_inode_num, const char *dir_path) {
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  int n;
+
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n; i++) {
+      for (unsigned int offset = 0; blocks[i] != 0 && offset < block_size;) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(blocks[i]) + offset);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry)) {
+          break;
+        }
+        offset += entry->rec_len;
+
+        int is_dot = (entry->name_len == 1 && entry->name[0] == '.') ||
+          (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+        unsigned int inode_num = entry->inode;
+        if (inode_num == 0 || inode_num > sb->s_inodes_count || is_dot || list_has(list, inode_num)) {
+          continue;
+        }
+        struct ext2_inode *inode = get_inode(inode_num);
+        int dir_len = strcmp(dir_path, "/") == 0 ? 0 : strlen(dir_path);
+        char *path = malloc(dir_len + entry->name_len + 2);
+        sprintf(path, "%.*s/%.*s", dir_len, dir_path, entry->name_len, entry->name);
+        list_add(list, inode_num, path);
+        if ((inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+          list_tree(list, inode_num, path);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Moves the block at slot, and every block below it when it is an indirect block whose pointers each cover span
+ * logical blocks from first, to the next blocks of the run at *next. Mirrors for_each_inode_block, so the blocks
+ * land in the order it visits them. The old block's pointer in the copy is updated, the old block is left as is.
+**/
+static void relocate_slot(unsigned int *slot, unsigned int span, unsigned int first, unsigned int count, unsigned int *next) {
+  if (*slot == 0 || *slot >= sb->s_blocks_count || first >= count) {
+    return;
+  }
+  unsigned int new_block = (*next)++;
+  memcpy(disk + block(new_block), disk + block(*slot), block_size);
+  *slot = new_block;
+  if (span == 0) {
+    return;
+  }
+
+  unsigned int *pointers = (unsigned int *)(disk + block(new_block));
+  for (unsigned int i = 0; i < POINTERS_PER_BLOCK && first + i * span < count; i++) {
+    relocate_slot(&pointers[i], span == 1 ? 0 : span / POINTERS_PER_BLOCK, first + i * span, count, next);
+  }
+}
+
+static int collect_visitor(unsigned int block_num, void *arg) {
+  unsigned int **next = arg;
+  *(*next)++ = block_num;
+  return 0;
+}
+
+/**
+ * Moves all the blocks of the inode into one free run, preferably in its own block group, and frees the old ones.
+ * The new blocks are filled in and the inode pointed at them before anything old is let go of, so rolling back
+ * leaves the file where it was. The run may reuse blocks an earlier file was moved out of, which allocating them
+ * logs first. Returns 0 on success, or -1 if there is no free run big enough.
+**/
+static int defrag_inode(unsigned int inode_num, struct layout *layout) {
+  struct ext2_inode *inode = get_inode(inode_num);
+  unsigned int count = inode_logical_blocks(inode);
+  unsigned int ppb = POINTERS_PER_BLOCK;
+
+  unsigned int first_new = find_available_block_run(group_first_block(inode_group(inode_num)), layout->blocks);
+  if (first_new == 0) {
+    return -1;
+  }
+  unsigned int *old_blocks = malloc(sizeof(unsigned int) * layout->blocks);
+  unsigned int *collect = old_blocks;
+  for_each_inode_block(inode, collect_visitor, &collect);
+
+  allocate_block_run(first_new, layout->blocks);
+  journal_access(inode, sizeof(struct ext2_inode));
+  unsigned int next = first_new;
+  for (unsigned int i = 0; i < INDIRECT_BLOCK_IDX; i++) {
+    relocate_slot(&inode->i_block[i], 0, i, count, &next);
+  }
+  unsigned int first = INDIRECT_BLOCK_IDX;
+  relocate_slot(&inode->i_block[INDIRECT_BLOCK_IDX], 1, first, count, &next);
+  first += ppb;
+  relocate_slot(&inode->i_block[DOUBLE_INDIRECT_BLOCK_IDX], ppb, first, count, &next);
+  first += ppb * ppb;
+  relocate_slot(&inode->i_block[TRIPLE_INDIRECT_BLOCK_IDX], ppb * ppb, first, count, &next);
+
+  deallocate_blocks(old_blocks, layout->blocks);
+  free(old_blocks);
+  // Directories have their blocks tracked for inserts
+  dspace_forget(inode_num);
+  return 0;
+}
+
+/**
+ * Reports the fragmentation of every file, directory and link under the directory at dir_path, and unless
+ * report_only is set, moves each one in more than one piece into a single run of free blocks.
+**/
+static int ext2_defrag(const char *dir_path, int report_only) {
+  if (dir_path[0] != '/') {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
+  }
+  char *path = malloc(strlen(dir_path) + 1);
+  strcpy(path, dir_path);
+  int dir_inode_num = traverse_path(EXT2_ROOT_INO, path);
+  free(path);
+  if (dir_inode_num == 0 || (get_inode(dir_inode_num)->i_mode & 0xF000) != EXT2_S_IFDIR) {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
+  }
+
+  struct file_list list = {NULL, 0, 0, calloc(sb->s_inodes_count / 8 + 1, 1)};
+  struct defrag_stats stats = {0, 0, 0};
+  char *path_copy = malloc(strlen(dir_path) + 1);
+  strcpy(path_copy, dir_path);
+  list_add(&list, dir_inode_num, path_copy);
+  list_tree(&list, dir_inode_num, dir_path);
+
+  printf(" score  breaks/MiB  blocks  extents  path\n");
+  for (unsigned int i = 0; i < list.count; i++) {
+    struct defrag_file *file = &list.files[i];
+    struct layout layout = {0, 0, 0};
+    const char *result = "";
+
+    for_each_inode_block(get_inode(file->inode), layout_visitor, &layout);
+    stats.files++;
+    if (layout.extents > 1) {
+      stats.fragmented++;
+      if (!report_only && defrag_inode(file->inode, &layout) == 0) {
+        result = "  moved";
+        stats.moved++;
+      } else if (!report_only) {
+        result = "  no free run";
+      }
+    }
+    unsigned int score = fragmentation_score(&layout);
+    unsigned int breaks = breaks_per_mib(&layout);
+    printf("%4u.%u%% %9u.%u %7u %8u  %s%s\n", score / 10, score % 10, breaks / 10, breaks % 10, layout.blocks,
+           layout.extents, file->path, result);
+    free(file->path);
+  }
+  printf("%u files, %u fragmented", stats.files, stats.fragmented);
+  if (!report_only) {
+    printf(", %u moved into a single run", stats.moved);
+  }
+  printf("\n");
+
+  free(list.files);
+  free(list.seen);
+  return 0;
+}
+
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int report = take_option(&argc, argv, "--report");
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s [--sync] [--report] <image file name> [path to directory]\n", argv[0]);
+    exit(1);
+  }
+  // A report only reads, so it works on images in use or on read-only storage
+  if (report) {
+    init_disk_readonly(argv[1]);
+  } else {
+    init_disk(argv[1]);
+    journal_sync_commits(sync);
+  }
+  return journal_finish(ext2_defrag(argc == 3 ? argv[2] : "/", report));
+}
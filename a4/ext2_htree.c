@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2_util.h"
+#include "ext2_htree.h"
+#include "ext2_journal.h"
+
+// Offset of the index root in block 0, right after the '.' and '..' entries
+#define DX_ROOT_INFO_OFFSET 24
+#define DX_ROOT_ENTRIES_OFFSET (DX_ROOT_INFO_OFFSET + sizeof(struct dx_root_info))
+// Index nodes below the root start with an empty directory entry covering the whole block
+#define DX_NODE_ENTRIES_OFFSET 8
+
+#define DX_ROOT_LIMIT ((block_size - DX_ROOT_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((block_size - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+
+// Largest hash value, reserved to mark the end of a directory in readdir cookies
+#define DX_HASH_EOF 0x7fffffff
+
+#define DIR_ENTRY_SIZE(name_len) (((sizeof(struct ext2_dir_entry) + (name_len) + 3) / 4) * 4)
+
+// One level of the path from the index root to a leaf
+struct dx_frame {
+  struct dx_entry *entries;
+  unsigned int at;
+};
+
+// A live directory entry of a leaf being split, and the hash it sorts by
+struct dx_map_entry {
+  unsigned int hash;
+  unsigned int offset;
+};
+
+//--- Hash functions, matching the ones the kernel uses for dir_index ---
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = ROTATE_LEFT(a, s))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+/**
+ * The half MD4 transform used by the DX_HASH_HALF_MD4 hash.
+**/
+static void half_md4_transform(unsigned int buf[4], const unsigned int in[8]) {
+  unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  ROUND(F, a, b, c, d, in[0] + K1, 3);
+  ROUND(F, d, a, b, c, in[1] + K1, 7);
+  ROUND(F, c, d, a, b, in[2] + K1, 11);
+  ROUND(F, b, c, d, a, in[3] + K1, 19);
+  ROUND(F, a, b, c, d, in[4] + K1, 3);
+  ROUND(F, d, a, b, c, in[5] + K1, 7);
+  ROUND(F, c, d, a, b, in[6] + K1, 11);
+  ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+  ROUND(G, a, b, c, d, in[1] + K2, 3);
+  ROUND(G, d, a, b, c, in[3] + K2, 5);
+  ROUND(G, c, d, a, b, in[5] + K2, 9);
+  ROUND(G, b, c, d, a, in[7] + K2, 13);
+  ROUND(G, a, b, c, d, in[0] + K2, 3);
+  ROUND(G, d, a, b, c, in[2] + K2, 5);
+  ROUND(G, c, d, a, b, in[4] + K2, 9);
+  ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+  ROUND(H, a, b, c, d, in[3] + K3, 3);
+  ROUND(H, d, a, b, c, in[7] + K3, 9);
+  ROUND(H, c, d, a, b, in[2] + K3, 11);
+  ROUND(H, b, c, d, a, in[6] + K3, 15);
+  ROUND(H, a, b, c, d, in[1] + K3, 3);
+  ROUND(H, d, a, b, c, in[5] + K3, 9);
+  ROUND(H, c, d, a, b, in[0] + K3, 11);
+  ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+/**
+ * The TEA transform used by the DX_HASH_TEA hash.
+**/
+static void tea_transform(unsigned int buf[4], const unsigned int in[4]) {
+  unsigned int sum = 0;
+  unsigned int b0 = buf[0], b1 = buf[1];
+  unsigned int a = in[0], b = in[1], c = in[2], d = in[3];
+
+  for (int n = 0; n < 16; n++) {
+    sum += 0x9E3779B9;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  }
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/**
+ * The original dir_index hash. Characters are sign extended unless is_unsigned is set.
+**/
+static unsigned int legacy_hash(const char *name, int len, int is_unsigned) {
+  unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+  for (int i = 0; i < len; i++) {
+    int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000) {
+      hash -= 0x7fffffff;
+    }
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+/**
+ * Packs up to num words of the name into buf, padding with a value derived from the length.
+**/
+static void str2hashbuf(const char *msg, int len, unsigned int *buf, int num, int is_unsigned) {
+  unsigned int pad = (unsigned int)len | ((unsigned int)len << 8);
+  pad |= pad << 16;
+  unsigned int val = pad;
+
+  if (len > num * 4) {
+    len = num * 4;
+  }
+  for (int i = 0; i < len; i++) {
+    int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+    val = c + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0) {
+    *buf++ = val;
+  }
+  while (--num >= 0) {
+    *buf++ = pad;
+  }
+}
+
+/**
+ * Returns the hash of the given name with the given hash function, seeded from the superblock.
+ * The lowest bit is always clear, the index uses it to flag leaves continuing a run of equal hashes.
+**/
+unsigned int dx_hash(const char *name, int len, int hash_version) {
+  unsigned int buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  unsigned int in[8];
+  unsigned int hash = 0;
+  int is_unsigned = hash_version >= DX_HASH_LEGACY_UNSIGNED;
+
+  if (sb->s_hash_seed[0] || sb->s_hash_seed[1] || sb->s_hash_seed[2] || sb->s_hash_seed[3]) {
+    memcpy(buf, sb->s_hash_seed, sizeof(buf));
+  }
+
+  switch (hash_version) {
+    case DX_HASH_LEGACY:
+    case DX_HASH_LEGACY_UNSIGNED:
+      hash = legacy_hash(name, len, is_unsigned);
+      break;
+
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+      for (const char *p = name; len > 0; len -= 32, p += 32) {
+        str2hashbuf(p, len, in, 8, is_unsigned);
+        half_md4_transform(buf, in);
+      }
+      hash = buf[1];
+      break;
+
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+      for (const char *p = name; len > 0; len -= 16, p += 16) {
+        str2hashbuf(p, len, in, 4, is_unsigned);
+        tea_transform(buf, in);
+      }
+      hash = buf[0];
+      break;
+  }
+
+  hash = hash & ~1;
+  if (hash == (DX_HASH_EOF << 1)) {
+    hash = (DX_HASH_EOF - 1) << 1;
+  }
+  return hash;
+}
+
+//--- Walking the index ---
+
+static struct dx_root_info *get_root_info(struct ext2_inode *dir) {
+  return (struct dx_root_info *)(disk + block(get_inode_block(dir, 0)) + DX_ROOT_INFO_OFFSET);
+}
+
+static struct dx_countlimit *get_countlimit(struct dx_entry *entries) {
+  return (struct dx_countlimit *)entries;
+}
+
+/**
+ * Returns the hash function used by the directory's index, taking the superblock's signedness flag into account.
+**/
+static int get_hash_version(struct ext2_inode *dir) {
+  int hash_version = get_root_info(dir)->hash_version;
+  if (hash_version <= DX_HASH_TEA && (EXT2_SB_FLAGS(sb) & EXT2_FLAGS_UNSIGNED_HASH)) {
+    hash_version += DX_HASH_LEGACY_UNSIGNED;
+  }
+  return hash_version;
+}
+
+/**
+ * Returns the entries of the index block at the given logical block of the directory,
+ * or NULL if the block isn't a valid index node.
+**/
+static struct dx_entry *get_node_entries(struct ext2_inode *dir, unsigned int logical) {
+  unsigned int block_num = get_inode_block(dir, logical);
+  if (block_num == 0) {
+    return NULL;
+  }
+  struct dx_entry *entries = (struct dx_entry *)(disk + block(block_num) + DX_NODE_ENTRIES_OFFSET);
+  struct dx_countlimit *countlimit = get_countlimit(entries);
+  if (countlimit->limit != DX_NODE_LIMIT || countlimit->count == 0 || countlimit->count > countlimit->limit) {
+    return NULL;
+  }
+  return entries;
+}
+
+int dx_is_indexed(struct ext2_inode *dir) {
+  if (!(dir->i_flags & EXT2_INDEX_FL) || inode_logical_blocks(dir) < 2 || get_inode_block(dir, 0) == 0) {
+    return 0;
+  }
+  struct dx_root_info *info = get_root_info(dir);
+  struct dx_countlimit *countlimit = (struct dx_countlimit *)((unsigned char *)info + sizeof(struct dx_root_info));
+  return info->reserved_zero == 0 && info->info_length == sizeof(struct dx_root_info) &&
+    info->hash_version <= DX_HASH_TEA && info->indirect_levels <= DX_MAX_LEVELS &&
+    countlimit->limit == DX_ROOT_LIMIT && countlimit->count > 0 && countlimit->count <= countlimit->limit;
+}
+
+/**
+ * Returns the position of the last entry whose hash is not greater than hash. Entry 0 has no
+ * hash and covers everything below the hash of entry 1.
+**/
+static unsigned int dx_search(struct dx_entry *entries, unsigned int hash) {
+  unsigned int low = 1;
+  unsigned int high = get_countlimit(entries)->count;
+
+  while (low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    if (entries[mid].hash > hash) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low - 1;
+}
+
+/**
+ * Follows the index from the root down to the leaf covering hash, filling in frames for each level.
+ * Returns the number of levels below the root, or -1 if the index is damaged.
+**/
+static int dx_probe(struct ext2_inode *dir, unsigned int hash, struct dx_frame *frames) {
+  int levels = get_root_info(dir)->indirect_levels;
+
+  frames[0].entries = (struct dx_entry *)(disk + block(get_inode_block(dir, 0)) + DX_ROOT_ENTRIES_OFFSET);
+  frames[0].at = dx_search(frames[0].entries, hash);
+  for (int level = 1; level <= levels; level++) {
+    struct dx_frame *parent = &frames[level - 1];
+    if ((frames[level].entries = get_node_entries(dir, parent->entries[parent->at].block)) == NULL) {
+      return -1;
+    }
+    frames[level].at = dx_search(frames[level].entries, hash);
+  }
+  return levels;
+}
+
+/**
+ * Moves frames on to the next leaf. Returns 1 if that leaf continues the run of hash, so an entry
+ * with that hash might be in it, otherwise 0.
+**/
+static int dx_next_leaf(struct ext2_inode *dir, struct dx_frame *frames, int levels, unsigned int hash) {
+  int level = levels;
+  while (level >= 0 && frames[level].at + 1 >= get_countlimit(frames[level].entries)->count) {
+    level--;
+  }
+  if (level < 0) {
+    return 0;
+  }
+  frames[level].at++;
+  unsigned int next_hash = frames[level].entries[frames[level].at].hash;
+  for (level++; level <= levels; level++) {
+    struct dx_frame *parent = &frames[level - 1];
+    if ((frames[level].entries = get_node_entries(dir, parent->entries[parent->at].block)) == NULL) {
+      return 0;
+    }
+    frames[level].at = 0;
+  }
+  return (next_hash & ~1) == hash;
+}
+
+long dx_find_block(struct ext2_inode *dir, char *name) {
+  struct dx_frame frames[DX_MAX_LEVELS + 1];
+  int levels;
+
+  if (!dx_is_indexed(dir)) {
+    return -1;
+  }
+  unsigned int hash = dx_hash(name, strlen(name), get_hash_version(dir));
+  if ((levels = dx_probe(dir, hash, frames)) == -1) {
+    return -1;
+  }
+
+  do {
+    struct dx_frame *leaf = &frames[levels];
+    unsigned int block_num = get_inode_block(dir, leaf->entries[leaf->at].block);
+    if (block_num != 0 && find_dir_in_block(block_num, name) != 0) {
+      return block_num;
+    }
+  } while (dx_next_leaf(dir, frames, levels, hash));
+  return 0;
+}
+
+int dx_leaf_covers(struct ext2_inode *dir, char *name, unsigned int block_num) {
+  struct dx_frame frames[DX_MAX_LEVELS + 1];
+  int levels;
+
+  if (!dx_is_indexed(dir)) {
+    return 1;
+  }
+  unsigned int hash = dx_hash(name, strlen(name), get_hash_version(dir));
+  if ((levels = dx_probe(dir, hash, frames)) == -1) {
+    return 0;
+  }
+
+  do {
+    struct dx_frame *leaf = &frames[levels];
+    if (get_inode_block(dir, leaf->entries[leaf->at].block) == block_num) {
+      return 1;
+    }
+  } while (dx_next_leaf(dir, frames, levels, hash));
+  return 0;
+}
+
+int dx_is_index_block(struct ext2_inode *dir, unsigned int logical) {
+  if (!dx_is_indexed(dir)) {
+    return 0;
+  }
+  if (logical == 0) {
+    return 1;
+  }
+  if (get_root_info(dir)->indirect_levels == 0) {
+    return 0;
+  }
+  struct dx_entry *entries = (struct dx_entry *)(disk + block(get_inode_block(dir, 0)) + DX_ROOT_ENTRIES_OFFSET);
+  for (unsigned int i = 0; i < get_countlimit(entries)->count; i++) {
+    if (entries[i].block == logical) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//--- Growing the index ---
+
+/**
+ * Inserts a new entry pointing at the given logical block into an index block, right after position at.
+**/
+static void dx_insert_block(struct dx_entry *entries, unsigned int at, unsigned int hash, unsigned int logical) {
+  struct dx_countlimit *countlimit = get_countlimit(entries);
+  journal_access(countlimit, sizeof(struct dx_entry) * (countlimit->count + 1));
+  memmove(&entries[at + 2], &entries[at + 1], (countlimit->count - at - 1) * sizeof(struct dx_entry));
+  entries[at + 1].hash = hash;
+  entries[at + 1].block = logical;
+  countlimit->count++;
+}
+
+/**
+ * Adds a new index node to the directory, holding no entries yet. Returns its entries, or NULL if there is no space.
+**/
+static struct dx_entry *dx_new_node(struct ext2_inode *dir, unsigned int *logical) {
+  *logical = inode_logical_blocks(dir);
+  unsigned int block_num = add_dir_block(dir);
+  if (block_num == 0) {
+    return NULL;
+  }
+  // An empty directory entry covering the whole block, so linear scans skip the node
+  struct ext2_dir_entry *fake = (struct ext2_dir_entry *)(disk + block(block_num));
+  fake->inode = 0;
+  fake->rec_len = block_size;
+  fake->name_len = 0;
+  fake->file_type = EXT2_FT_UNKNOWN;
+
+  struct dx_entry *entries = (struct dx_entry *)(disk + block(block_num) + DX_NODE_ENTRIES_OFFSET);
+  get_countlimit(entries)->limit = DX_NODE_LIMIT;
+  get_countlimit(entries)->count = 0;
+  return entries;
+}
+
+/**
+ * Makes room in the index block the leaf frame points into, so another leaf can be added under it.
+ * A full root is pushed down into a new index node, and a full index node is split in two.
+ * Returns the number of levels below the root afterwards, or -1 if the index can't grow any further.
+**/
+static int dx_make_room(struct ext2_inode *dir, struct dx_frame *frames, int levels) {
+  unsigned int logical;
+
+  if (get_countlimit(frames[levels].entries)->count < get_countlimit(frames[levels].entries)->limit) {
+    return levels;
+  }
+
+  if (levels == 0) {
+    // Move every root entry down into a new node and point the root at it
+    struct dx_entry *node = dx_new_node(dir, &logical);
+    if (node == NULL) {
+      return -1;
+    }
+    unsigned int count = get_countlimit(frames[0].entries)->count;
+    journal_access(frames[0].entries, sizeof(struct dx_entry) * count);
+    journal_access(get_root_info(dir), sizeof(struct dx_root_info));
+    memcpy(&node[1], &frames[0].entries[1], (count - 1) * sizeof(struct dx_entry));
+    node[0].block = frames[0].entries[0].block;
+    get_countlimit(node)->count = count;
+    get_countlimit(frames[0].entries)->count = 1;
+    frames[0].entries[0].block = logical;
+
+    frames[1].entries = node;
+    frames[1].at = frames[0].at;
+    frames[0].at = 0;
+    get_root_info(dir)->indirect_levels = 1;
+    levels = 1;
+    if (get_countlimit(node)->count < get_countlimit(node)->limit) {
+      return levels;
+    }
+  }
+
+  // Split the full node in two, the upper half moving to a new node listed in the root
+  if (get_countlimit(frames[0].entries)->count >= get_countlimit(frames[0].entries)->limit) {
+    return -1;
+  }
+  struct dx_entry *node = frames[1].entries;
+  struct dx_entry *new_node = dx_new_node(dir, &logical);
+  if (new_node == NULL) {
+    return -1;
+  }
+  unsigned int count = get_countlimit(node)->count;
+  unsigned int half = count / 2;
+  unsigned int split_hash = node[half].hash;
+
+  journal_access(node, sizeof(struct dx_entry));
+  new_node[0].block = node[half].block;
+  memcpy(&new_node[1], &node[half + 1], (count - half - 1) * sizeof(struct dx_entry));
+  get_countlimit(new_node)->count = count - half;
+  get_countlimit(node)->count = half;
+  dx_insert_block(frames[0].entries, frames[0].at, split_hash, logical);
+
+  if (frames[1].at >= half) {
+    frames[0].at++;
+    frames[1].entries = new_node;
+    frames[1].at -= half;
+  }
+  return levels;
+}
+
+static int compare_map_entries(const void *a, const void *b) {
+  unsigned int hash_a = ((const struct dx_map_entry *)a)->hash;
+  unsigned int hash_b = ((const struct dx_map_entry *)b)->hash;
+  return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+/**
+ * Writes the given entries of src densely into the block, the last one taking up the rest of the block.
+**/
+static void pack_entries(unsigned char *dest, unsigned char *src, struct dx_map_entry *map, int count) {
+  int offset = 0;
+  struct ext2_dir_entry *entry = NULL;
+
+  for (int i = 0; i < count; i++) {
+    struct ext2_dir_entry *src_entry = (struct ext2_dir_entry *)(src + map[i].offset);
+    entry = (struct ext2_dir_entry *)(dest + offset);
+    memcpy(entry, src_entry, sizeof(struct ext2_dir_entry) + src_entry->name_len);
+    entry->rec_len = DIR_ENTRY_SIZE(src_entry->name_len);
+    offset += entry->rec_len;
+  }
+  if (entry == NULL) {
+    entry = (struct ext2_dir_entry *)dest;
+    entry->inode = 0;
+    entry->name_len = 0;
+    entry->file_type = EXT2_FT_UNKNOWN;
+  }
+  entry->rec_len = block_size - ((unsigned char *)entry - dest);
+}
+
+/**
+ * Splits the full leaf the frames point at, moving the entries with the upper half of the hashes to a
+ * new leaf. Returns the leaf an entry with the given hash now belongs in, or 0 if the leaf can't be split.
+**/
+static unsigned int dx_split_leaf(struct ext2_inode *dir, struct dx_frame *frames, int levels, unsigned int hash) {
+  struct dx_frame *frame = &frames[levels];
+  unsigned int leaf_block = get_inode_block(dir, frame->entries[frame->at].block);
+  unsigned char buf[EXT2_MAX_BLOCK_SIZE];
+  struct dx_map_entry map[EXT2_MAX_BLOCK_SIZE / DIR_ENTRY_SIZE(1)];
+  int hash_version = get_hash_version(dir);
+  int count = 0;
+
+  // Gather the live entries of the leaf sorted by hash
+  memcpy(buf, disk + block(leaf_block), block_size);
+  for (int offset = 0; offset < block_size;) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(buf + offset);
+    if (entry->rec_len == 0) {
+      break;
+    }
+    if (entry->inode != 0) {
+      map[count].hash = dx_hash(entry->name, entry->name_len, hash_version);
+      map[count].offset = offset;
+      count++;
+    }
+    offset += entry->rec_len;
+  }
+  if (count < 2) {
+    return 0;
+  }
+  qsort(map, count, sizeof(struct dx_map_entry), compare_map_entries);
+
+  // Entries sharing a hash across the split are found by flagging the new leaf as a continuation
+  int split = count / 2;
+  unsigned int split_hash = map[split].hash;
+  int continued = split_hash == map[split - 1].hash;
+
+  unsigned int new_logical = inode_logical_blocks(dir);
+  unsigned int new_block = add_dir_block(dir);
+  if (new_block == 0) {
+    return 0;
+  }
+  journal_block(leaf_block);
+  pack_entries(disk + block(new_block), buf, &map[split], count - split);
+  pack_entries(disk + block(leaf_block), buf, map, split);
+  dx_insert_block(frame->entries, frame->at, split_hash + continued, new_logical);
+
+  return hash >= split_hash + continued ? new_block : leaf_block;
+}
+
+struct ext2_dir_entry *dx_insert_entry(struct ext2_inode *dir, unsigned int inode_num, char *name, int type) {
+  struct dx_frame frames[DX_MAX_LEVELS + 1];
+  struct ext2_dir_entry *new_dir;
+  int levels;
+
+  if (!dx_is_indexed(dir)) {
+    return NULL;
+  }
+  unsigned int hash = dx_hash(name, strlen(name), get_hash_version(dir));
+  if ((levels = dx_probe(dir, hash, frames)) == -1) {
+    return NULL;
+  }
+
+  struct dx_frame *leaf = &frames[levels];
+  unsigned int leaf_block = get_inode_block(dir, leaf->entries[leaf->at].block);
+  if (leaf_block == 0) {
+    return NULL;
+  }
+  if ((new_dir = insert_dir_entry_into_block(dir, inode_num, leaf_block, name, type)) != NULL) {
+    return new_dir;
+  }
+
+  // The leaf is full, split it and add the entry to whichever half its hash falls in
+  if ((levels = dx_make_room(dir, frames, levels)) == -1 || (leaf_block = dx_split_leaf(dir, frames, levels, hash)) == 0) {
+    return NULL;
+  }
+  return insert_dir_entry_into_block(dir, inode_num, leaf_block, name, type);
+}
+
+int dx_index_dir(struct ext2_inode *dir) {
+  if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || inode_logical_blocks(dir) != 1) {
+    return -1;
+  }
+  unsigned int root_block = get_inode_block(dir, 0);
+  if (root_block == 0) {
+    return -1;
+  }
+
+  // Block 0 has to start with '.' and '..', which stay there in front of the index root
+  unsigned char *root = disk + block(root_block);
+  struct ext2_dir_entry *self = (struct ext2_dir_entry *)root;
+  if (self->name_len != 1 || self->name[0] != '.' || self->rec_len != DIR_ENTRY_SIZE(1)) {
+    return -1;
+  }
+  struct ext2_dir_entry *parent = (struct ext2_dir_entry *)(root + self->rec_len);
+  if (parent->name_len != 2 || strncmp(parent->name, "..", 2) != 0 || parent->rec_len < DIR_ENTRY_SIZE(2)) {
+    return -1;
+  }
+
+  // Move every other entry into the first leaf
+  unsigned int leaf_block = add_dir_block(dir);
+  if (leaf_block == 0) {
+    return -1;
+  }
+  struct dx_map_entry map[EXT2_MAX_BLOCK_SIZE / DIR_ENTRY_SIZE(1)];
+  int count = 0;
+  for (int offset = DIR_ENTRY_SIZE(1) + parent->rec_len; offset < block_size;) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(root + offset);
+    if (entry->rec_len == 0) {
+      break;
+    }
+    if (entry->inode != 0) {
+      map[count++].offset = offset;
+    }
+    offset += entry->rec_len;
+  }
+  pack_entries(disk + block(leaf_block), root, map, count);
+
+  // Lay the index root out behind '..', with a single entry covering every hash
+  journal_block(root_block);
+  parent->rec_len = block_size - self->rec_len;
+  struct dx_root_info *info = (struct dx_root_info *)(root + DX_ROOT_INFO_OFFSET);
+  info->reserved_zero = 0;
+  info->hash_version = sb->s_def_hash_version <= DX_HASH_TEA ? sb->s_def_hash_version : DX_HASH_HALF_MD4;
+  info->info_length = sizeof(struct dx_root_info);
+  info->indirect_levels = 0;
+  info->unused_flags = 0;
+  struct dx_entry *entries = (struct dx_entry *)(root + DX_ROOT_ENTRIES_OFFSET);
+  get_countlimit(entries)->limit = DX_ROOT_LIMIT;
+  get_countlimit(entries)->count = 1;
+  entries[0].block = 1;
+
+  journal_access(dir, sizeof(struct ext2_inode));
+  dir->i_flags |= EXT2_INDEX_FL;
+  return 0;
+}
+
+void dx_drop_index(struct ext2_inode *dir) {
+  journal_access(dir, sizeof(struct ext2_inode));
+  dir->i_flags &= ~EXT2_INDEX_FL;
+}
@@ -0,0 +1,80 @@
+#ifndef CSC369_EXT2_HTREE_H
+#define CSC369_EXT2_HTREE_H
+
+#include "ext2.h"
+
+/*
+ * Hashed directory index, laid out the same way as the ext3 dir_index (htree) feature so
+ * images stay readable by the kernel and e2fsck. Block 0 of an indexed directory holds the
+ * '.' and '..' entries followed by the index root, and the index points at leaf blocks that
+ * are ordinary directory blocks. Block numbers in the index are logical block numbers within
+ * the directory.
+ */
+
+// Superblock compatible feature flag for hashed directory indexes
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+// Inode flag set on directories that have a hash index
+#define EXT2_INDEX_FL 0x00001000
+
+// s_flags is not part of struct ext2_super_block, it lives in the reserved area at byte 0x160
+#define EXT2_SB_FLAGS(sb) ((sb)->s_reserved[22])
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+// Hash functions
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+
+// Deepest index supported: the root plus one level of index nodes
+#define DX_MAX_LEVELS 1
+
+struct dx_root_info {
+	unsigned int   reserved_zero;
+	unsigned char  hash_version;
+	unsigned char  info_length;     /* 8 */
+	unsigned char  indirect_levels;
+	unsigned char  unused_flags;
+};
+
+// Overlays the hash of the first dx_entry of every index block
+struct dx_countlimit {
+	unsigned short limit;
+	unsigned short count;
+};
+
+struct dx_entry {
+	unsigned int   hash;
+	unsigned int   block;
+};
+
+// Returns the hash the index uses for the given name
+extern unsigned int dx_hash(const char *name, int len, int hash_version);
+
+// Returns 1 if the given directory inode has a usable hash index, otherwise 0
+extern int dx_is_indexed(struct ext2_inode *dir);
+
+// Looks name up through the directory's index. Returns the block holding its entry, 0 if there is no such entry,
+// or -1 if the directory has no usable index and has to be scanned linearly.
+extern long dx_find_block(struct ext2_inode *dir, char *name);
+
+// Returns 1 if an entry for name held in the given block would be found through the directory's index, which is always
+// the case for a directory without one, otherwise 0
+extern int dx_leaf_covers(struct ext2_inode *dir, char *name, unsigned int block_num);
+
+// Returns 1 if the given logical block of the directory is part of its index, the root or an index node, rather than a leaf
+extern int dx_is_index_block(struct ext2_inode *dir, unsigned int logical);
+
+// Inserts an entry into the leaf its hash belongs to, splitting the leaf if it is full. Returns NULL if the index can't take it
+extern struct ext2_dir_entry *dx_insert_entry(struct ext2_inode *dir, unsigned int inode_num, char *name, int type);
+
+// Builds an index for a single block directory. Returns 0 on success, -1 if the directory can't be indexed
+extern int dx_index_dir(struct ext2_inode *dir);
+
+// Turns an indexed directory back into a linear one. The index blocks already read as empty directory blocks
+extern void dx_drop_index(struct ext2_inode *dir);
+
+#endif
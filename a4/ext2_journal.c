@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include <errno.h>
+#include "ext2_util.h"
+#include "ext2_journal.h"
+
+// What the current transaction has done to a block
+#define BLOCK_UNTOUCHED 0
+#define BLOCK_LOGGED 1
+#define BLOCK_NEW 2
+// Freed by the transaction while still holding data it must not lose, so it is logged even if allocated again
+#define BLOCK_FREED 3
+
+static char *log_path;
+static int log_fd = -1;
+static off_t log_end;
+// Identifies the records of the current transaction
+static unsigned int transaction;
+// Whether a commit waits for the emptied log to reach the disk too, and records are synced before their blocks change
+static int sync_commits;
+// Records log_block built that write_records hasn't written to the log yet
+static unsigned char *pending;
+static size_t pending_len;
+static size_t pending_capacity;
+// Set while the log holds records that haven't been synced
+static int log_unsynced;
+
+// State of every block of the image in the current transaction, and the blocks that aren't BLOCK_UNTOUCHED
+static unsigned char *block_state;
+static unsigned int *touched;
+static unsigned int touched_count;
+static unsigned int touched_capacity;
+
+/**
+ * Returns the FNV-1a hash of the block number and contents, used to spot records torn by a crash.
+**/
+static unsigned int record_checksum(unsigned int block_num, const unsigned char *data) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < 4; i++) {
+    hash = (hash ^ ((block_num >> (i * 8)) & 0xFF)) * 16777619u;
+  }
+  for (int i = 0; i < block_size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Syncs the directory holding the log, so a newly created log is found after a crash.
+**/
+static void sync_log_dir() {
+  char *path = strdup(log_path);
+  int dir_fd = open(dirname(path), O_RDONLY);
+  if (dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  free(path);
+}
+
+/**
+ * Writes the old contents of every record in the log back into the image and syncs it, then empties the log.
+ * Reading stops at the first record that is torn or missing, which was never followed by a change to its block,
+ * or that belongs to another transaction, left behind when emptying the log never reached the disk.
+ * what names the operation undone in the message. Returns 0 on success, or -1 with the log left as it was.
+**/
+static int rollback(int fd, const char *what) {
+  struct journal_record record;
+  unsigned char data[EXT2_MAX_BLOCK_SIZE];
+  off_t offset = 0;
+  unsigned int restored = 0;
+
+  unsigned int first_transaction = 0;
+
+  while (pread(fd, &record, sizeof(record), offset) == sizeof(record) &&
+         pread(fd, data, block_size, offset + sizeof(record)) == block_size) {
+    if (offset == 0) {
+      first_transaction = record.transaction;
+    }
+    if (record.magic != JOURNAL_MAGIC || record.checksum != record_checksum(record.block_num, data) ||
+        record.transaction != first_transaction || block(record.block_num) + block_size > disk_size) {
+      break;
+    }
+    memcpy(disk + block(record.block_num), data, block_size);
+    mark_blocks_dirty(record.block_num, 1);
+    offset += sizeof(record) + block_size;
+    restored++;
+  }
+
+  if (restored > 0) {
+    fprintf(stderr, "Rolled back %s (%u blocks)\n", what, restored);
+    if (flush_disk() == -1) {
+      return -1;
+    }
+  }
+  if (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1) {
+    perror("journal");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Rolls back whatever the tool left uncommitted when it exits, as only an operation that finished is committed,
+ * and removes the empty log. If the rollback fails the log is kept for the next open to finish it.
+**/
+static void journal_close() {
+  if (log_fd == -1) {
+    return;
+  }
+  int ret = log_end > 0 ? rollback(log_fd, "the failed operation") : 0;
+  close(log_fd);
+  log_fd = -1;
+  if (ret == 0) {
+    unlink(log_path);
+    if (sync_commits) {
+      sync_log_dir();
+    }
+  }
+}
+
+void journal_recover(const char *image_file) {
+  log_path = malloc(strlen(image_file) + strlen(".journal") + 1);
+  sprintf(log_path, "%s.journal", image_file);
+
+  int fd = open(log_path, O_RDWR);
+  if (fd != -1) {
+    if (rollback(fd, "an unfinished operation") == -1) {
+      exit(1);
+    }
+    close(fd);
+    unlink(log_path);
+  }
+
+  block_state = calloc(disk_size / block_size + 1, 1);
+  transaction = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+  atexit(journal_close);
+}
+
+/**
+ * Remembers that the block's state is no longer BLOCK_UNTOUCHED, so it can be reset when the transaction ends.
+**/
+static void touch_block(unsigned int block_num, unsigned char state) {
+  if (block_state[block_num] != BLOCK_UNTOUCHED) {
+    block_state[block_num] = state;
+    return;
+  }
+  if (touched_count == touched_capacity) {
+    touched_capacity = touched_capacity ? touched_capacity * 2 : 64;
+    touched = realloc(touched, sizeof(unsigned int) * touched_capacity);
+  }
+  touched[touched_count++] = block_num;
+  block_state[block_num] = state;
+}
+
+/**
+ * Adds a record of the block's current contents to the ones write_records writes next, creating the log if needed.
+ * Does nothing if the block was already logged or is new in this transaction.
+**/
+static void log_block(unsigned int block_num) {
+  if ((size_t)block_num > disk_size / block_size ||
+      block_state[block_num] == BLOCK_LOGGED || block_state[block_num] == BLOCK_NEW) {
+    return;
+  }
+
+  if (log_fd == -1) {
+    if ((log_fd = open(log_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror(log_path);
+      exit(1);
+    }
+    sync_log_dir();
+    log_end = 0;
+  }
+
+  size_t record_len = sizeof(struct journal_record) + block_size;
+  if (pending_len + record_len > pending_capacity) {
+    pending_capacity = pending_capacity * 2 > pending_len + record_len ? pending_capacity * 2 : pending_len + record_len;
+    pending = realloc(pending, pending_capacity);
+  }
+  struct journal_record record = {JOURNAL_MAGIC, block_num, record_checksum(block_num, disk + block(block_num)), transaction};
+  memcpy(pending + pending_len, &record, sizeof(record));
+  memcpy(pending + pending_len + sizeof(record), disk + block(block_num), block_size);
+  pending_len += record_len;
+  touch_block(block_num, BLOCK_LOGGED);
+}
+
+/**
+ * Writes the records built since the last call to the log in one go. They reach the page cache before their
+ * blocks change, which is all undoing a tool that dies needs. Surviving a power failure needs them on disk
+ * too: with synced commits they are synced right away, as the kernel may write the mapping back at any time,
+ * otherwise journal_commit syncs them once for the whole transaction. Exits if the log can't be written, as
+ * the blocks would then be changed with no way to undo it.
+**/
+static void write_records() {
+  if (pending_len == 0) {
+    return;
+  }
+  if (pwrite(log_fd, pending, pending_len, log_end) != (ssize_t)pending_len) {
+    perror(log_path);
+    exit(1);
+  }
+  log_end += pending_len;
+  pending_len = 0;
+  log_unsynced = 1;
+  if (sync_commits) {
+    if (fdatasync(log_fd) == -1) {
+      perror(log_path);
+      exit(1);
+    }
+    log_unsynced = 0;
+  }
+}
+
+/**
+ * Logs every block covering the given range of the mapping.
+**/
+static void log_range(const void *ptr, size_t len) {
+  size_t offset = (const unsigned char *)ptr - disk;
+  for (size_t block_num = offset / block_size; block_num <= (offset + len - 1) / block_size; block_num++) {
+    log_block(block_num);
+  }
+}
+
+void journal_access(const void *ptr, size_t len) {
+  // Images opened read-only are never written, so there is nothing to undo
+  if (block_state == NULL) {
+    return;
+  }
+
+  // The superblock and group descriptors change in almost every operation, log them along with the first block
+  log_range(sb, sizeof(struct ext2_super_block));
+  log_range(bgdt, group_count * sizeof(struct ext2_group_desc));
+  log_range(ptr, len);
+  write_records();
+  mark_dirty(sb, sizeof(struct ext2_super_block));
+  mark_dirty(bgdt, group_count * sizeof(struct ext2_group_desc));
+  mark_dirty(ptr, len);
+}
+
+void journal_block(unsigned int block_num) {
+  journal_access(disk + block(block_num), block_size);
+}
+
+void journal_new_blocks(unsigned int first, unsigned int count) {
+  if (block_state == NULL) {
+    return;
+  }
+  // New blocks are about to be filled in
+  mark_blocks_dirty(first, count);
+  for (unsigned int block_num = first; block_num < first + count; block_num++) {
+    if (block_state[block_num] == BLOCK_UNTOUCHED) {
+      touch_block(block_num, BLOCK_NEW);
+    } else if (block_state[block_num] == BLOCK_FREED) {
+      // Rolling back hands the block back to whoever freed it, so what it holds now has to be kept
+      log_block(block_num);
+    }
+  }
+  write_records();
+}
+
+void journal_freed_blocks(unsigned int first, unsigned int count) {
+  if (block_state == NULL) {
+    return;
+  }
+  for (unsigned int block_num = first; block_num < first + count; block_num++) {
+    if (block_state[block_num] == BLOCK_UNTOUCHED) {
+      touch_block(block_num, BLOCK_FREED);
+    }
+  }
+}
+
+void journal_sync_commits(int enabled) {
+  sync_commits = enabled;
+}
+
+/**
+ * Syncs the log, then the blocks the transaction changed, and only then empties the log, so a crash at any point
+ * leaves either the whole transaction or none of it. Unless commits are synced, a crash right after the log is
+ * emptied may still find the old log and roll back a transaction that had already completed, and a power failure
+ * before the commit can't undo blocks the kernel wrote back ahead of their records.
+**/
+int journal_commit() {
+  if (touched_count == 0) {
+    return 0;
+  }
+  if (log_unsynced && fdatasync(log_fd) == -1) {
+    perror(log_path);
+    return -1;
+  }
+  log_unsynced = 0;
+  if (flush_disk() == -1) {
+    return -1;
+  }
+  if (log_fd != -1 && log_end > 0) {
+    if (ftruncate(log_fd, 0) == -1 || (sync_commits && fdatasync(log_fd) == -1)) {
+      perror(log_path);
+      return -1;
+    }
+    log_end = 0;
+  }
+
+  for (unsigned int i = 0; i < touched_count; i++) {
+    block_state[touched[i]] = BLOCK_UNTOUCHED;
+  }
+  touched_count = 0;
+  transaction++;
+  return 0;
+}
+
+int journal_finish(int ret) {
+  if (ret == 0 && journal_commit() == -1) {
+    return -EIO;
+  }
+  return ret;
+}
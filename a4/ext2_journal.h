@@ -0,0 +1,58 @@
+#ifndef CSC369_EXT2_JOURNAL_H
+#define CSC369_EXT2_JOURNAL_H
+
+#include <sys/types.h>
+
+/*
+ * Undo log kept next to the image as "<image>.journal". The tools change the shared mapping in place,
+ * so before a block is first changed in a transaction its old contents are appended to the log. The log
+ * is synced once per transaction as it commits, or before every change with journal_sync_commits.
+ * Committing syncs the log, then the image, and then empties the log. If a tool dies mid-transaction the
+ * log still holds the old contents of every block it changed, and the next init_disk puts them back.
+ * Only an operation that succeeded is committed: whatever is left uncommitted when a tool exits, because
+ * it failed part way or gave up on an error, is put back from the log there and then.
+ *
+ * Blocks allocated during the transaction don't need logging: undoing the transaction frees them again.
+ */
+
+// Magic number starting every log record
+#define JOURNAL_MAGIC 0x4A524E4C
+
+// Header of a log record, followed by the old contents of the block
+struct journal_record {
+	unsigned int   magic;
+	unsigned int   block_num;
+	unsigned int   checksum;   /* over block_num and the block's contents */
+	unsigned int   transaction; /* records left over from earlier transactions are ignored */
+};
+
+// Rolls back any transaction an earlier run left unfinished, and sets the log up for image_file.
+// Called by init_disk once the image is mapped
+extern void journal_recover(const char *image_file);
+
+// Logs the blocks of the mapping covering [ptr, ptr + len), unless they are already logged or new in this transaction.
+// Must be called before they are changed
+extern void journal_access(const void *ptr, size_t len);
+
+// Logs the given block as above
+extern void journal_block(unsigned int block_num);
+
+// Records that count blocks starting at first were just allocated, so changing them needs no logging. Any of them freed
+// earlier in this transaction are logged instead, as a rollback gives them back their old contents
+extern void journal_new_blocks(unsigned int first, unsigned int count);
+
+// Records that count blocks starting at first were just freed, so they are logged if this transaction allocates them again
+extern void journal_freed_blocks(unsigned int first, unsigned int count);
+
+// Makes the changes of the current transaction durable and empties the log. Returns 0 on success, -1 on error
+extern int journal_commit();
+
+// Ends a tool's operation, which returned ret: commits it if ret is 0, otherwise leaves it to be rolled back when
+// the tool exits. Returns ret, or -EIO if committing failed
+extern int journal_finish(int ret);
+
+// Makes every commit wait until the emptied log is on disk too, so a finished operation can't be rolled back, and
+// syncs log records before their blocks change, so even a power failure part way through an operation is undone
+extern void journal_sync_commits(int enabled);
+
+#endif
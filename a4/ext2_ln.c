@@ -9,146 +9,177 @@
 #include <errno.h>
 #include "ext2.h"
 #include "ext2_util.h"
-
-int main(int argc, char const *argv[]) {
-  if (argc != 4 && (argc != 5 || (argc == 5 && strcmp(argv[2], "-s") != 0))) {
-    fprintf(stderr, "%d\n", argc);
-    fprintf(stderr, "Usage: %s <image file name> [-s] <source path> <dest path>\n", argv[0]);
-    exit(1);
+#include "ext2_tools.h"
+#include "ext2_journal.h"
+
+/**
+ * Creates the symbolic link name in the directory with the given inode, pointing at target, which is stored as
+ * given and needn't exist. A target that fits in i_block is kept there as a fast symlink, as e2fsck expects of
+ * any target that short, and longer ones get a block of their own.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_symlink(unsigned int parent_inode_num, char *name, const char *target) {
+  // Symbolic link path cannot be longer than a block (as stated in Piazza post)
+  if (strlen(target) > block_size) {
+    fprintf(stderr, "Path length too long\n");
+    return -ENAMETOOLONG;
   }
-  init_disk(argv[1]);
 
-  char *source_path;
-  char *dest_path;
+  // find a new inode, and unless the path fits in the inode, a new block to put it in
+  int fast = strlen(target) < sizeof(((struct ext2_inode *)0)->i_block);
+  unsigned int new_inode_num = find_available_inode(sb->s_first_ino);
+  if (new_inode_num == 0) {
+    fprintf(stderr, "No available inode\n");
+    return -ENOSPC;
+  }
+  int block_num = 0;
+  if (!fast && (block_num = find_available_block()) == 0) {
+    fprintf(stderr, "No available block\n");
+    return -ENOSPC;
+  }
+  // Taken right away, so a block added to the parent for the new entry can't be this one
+  if (!fast) {
+    allocate_block(block_num);
+  }
+  initialize_inode(new_inode_num, EXT2_S_IFLNK);
 
-  int type;
+  if (insert_dir_entry(parent_inode_num, new_inode_num, name, EXT2_FT_SYMLINK) == NULL) {
+    fprintf(stderr, "Dir entry not inserted\n");
+    if (!fast) {
+      deallocate_block(block_num);
+    }
+    return 1;
+  }
 
-  // Check if this is a symbolic link or hard link
+  struct ext2_inode *new_inode = get_inode(new_inode_num);
+  new_inode->i_size = sizeof(char) * strlen(target);
+  if (fast) {
+    memcpy(new_inode->i_block, target, strlen(target));
+  } else {
+    new_inode->i_block[0] = block_num;
+    new_inode->i_blocks = 2 << sb->s_log_block_size;
 
-  // A Hard Link
-  if (argc == 4) {
-    if (argv[2][0] != '/' || argv[3][0] != '/') {
-      fprintf(stderr, "Invalid path\n");
-      exit(-ENOENT);
-    }
-    source_path = malloc(sizeof(char) * strlen(argv[2]));
-    dest_path = malloc(sizeof(char) * strlen(argv[3]));
-    strcpy(source_path, argv[2]);
-    strcpy(dest_path, argv[3]);
-    type = EXT2_FT_REG_FILE;
+    // Clear the block and put the source path in it
+    char *new_block = (char *)(disk + block(block_num));
+    memset(new_block, '\0', block_size);
+    memcpy(new_block, target, strlen(target));
   }
-  // A Symbolic Link
-  else {
-    if (argv[3][0] != '/' || argv[4][0] != '/') {
-      fprintf(stderr, "Invalid path\n");
-      exit(-ENOENT);
-    }
-    source_path = malloc(sizeof(char) * strlen(argv[3]));
-    dest_path = malloc(sizeof(char) * strlen(argv[4]));
-    strcpy(source_path, argv[3]);
-    strcpy(dest_path, argv[4]);
-    type = EXT2_FT_SYMLINK;
+
+  allocate_inode(new_inode_num);
+  return 0;
+}
+
+/**
+ * Links dest to src inside the image, with a symbolic link when symbolic is set and a hard link otherwise.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_ln(int symbolic, const char *src, const char *dest) {
+  if (src[0] != '/' || dest[0] != '/') {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
   }
 
+  int ret = 0;
+  int type = symbolic ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+  char *source_path = malloc(sizeof(char) * (strlen(src) + 1));
+  char *dest_path = malloc(sizeof(char) * (strlen(dest) + 1));
+  strcpy(source_path, src);
+  strcpy(dest_path, dest);
+
   // find the name of the new link. If the given destination end in a '/', use the
   // same name as the source file
   char *new_link_name;
   if (strlen(dest_path) > strlen(source_path)) {
-    new_link_name = malloc(sizeof(char) * strlen(dest_path));
+    new_link_name = malloc(sizeof(char) * (strlen(dest_path) + 1));
   }
   else {
-    new_link_name = malloc(sizeof(char) * strlen(source_path));
+    new_link_name = malloc(sizeof(char) * (strlen(source_path) + 1));
   }
 
+  // Make a copy of the source path because traverse_path and split_parent_path_and_target alter
+  // the given path, and the source path is needed when it gets copied into the block
+  char *source_path_cp = malloc(sizeof(char) * (strlen(source_path) + 1));
+  strcpy(source_path_cp, source_path);
+
   if (dest_path[strlen(dest_path) - 1] != '/') {
     split_parent_path_and_target(dest_path, new_link_name);
   }
   else {
-    char *source_path_copy = malloc(sizeof(char) * strlen(source_path));
-    strcpy(source_path_copy, source_path);
-    split_parent_path_and_target(source_path_copy, new_link_name);
+    split_parent_path_and_target(source_path_cp, new_link_name);
+    strcpy(source_path_cp, source_path);
   }
 
   // Get the parent inode
   int parent_inode_num = traverse_path(EXT2_ROOT_INO, dest_path);
-  if(parent_inode_num== 0 || !(inode_table[parent_inode_num - 1].i_mode & EXT2_S_IFDIR)) {
+  if(parent_inode_num== 0 || !(get_inode(parent_inode_num)->i_mode & EXT2_S_IFDIR)) {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    ret = -ENOENT;
+    goto out;
   }
   // Check if entry already exists
   if(find_next_inode(parent_inode_num, new_link_name) != 0) {
     fprintf(stderr, "File already exists\n");
-    exit(-EEXIST);
+    ret = -EEXIST;
+    goto out;
   }
 
-  // Make a copy of the source path because traverse_path alters the given path, and
-  // the source path is needed when it gets copied into the block
-  char *source_path_cp = malloc(sizeof(char) * strlen(source_path));
-  strcpy(source_path_cp, source_path);
-  
   int source_inode_num = traverse_path(EXT2_ROOT_INO, source_path_cp);
   if (source_inode_num == 0) {
     fprintf(stderr, "File does not exist\n");
-    exit(-ENOENT);
+    ret = -ENOENT;
+    goto out;
   }
 
-  struct ext2_inode *source_inode = &inode_table[source_inode_num - 1];
+  struct ext2_inode *source_inode = get_inode(source_inode_num);
 
   // hard link is pointing to a directory
   if (type == EXT2_FT_REG_FILE && (source_inode->i_mode & EXT2_S_IFDIR)) {
     fprintf(stderr, "Cannot create a hard link to a directory\n");
-    exit(-EISDIR);
+    ret = -EISDIR;
+    goto out;
   }
 
-  struct ext2_dir_entry *new_link;
-
   // A hard link
   if (type == EXT2_FT_REG_FILE) {
-    new_link = insert_dir_entry(parent_inode_num, source_inode_num, new_link_name, type);
-    if (new_link == NULL) {
+    if (insert_dir_entry(parent_inode_num, source_inode_num, new_link_name, type) == NULL) {
       fprintf(stderr, "Dir entry not inserted\n");
-      exit(1);
+      ret = 1;
+      goto out;
     }
+    journal_access(source_inode, sizeof(struct ext2_inode));
     source_inode->i_links_count += 1;
   }
 
   // A symbolic link
-  else if (type == EXT2_FT_SYMLINK) {
-    // Symbolic link path cannot be longer than EXT2_BLOCK_SIZE (as stated in Piazza post) 
-    if (strlen(source_path) > EXT2_BLOCK_SIZE) {
-      fprintf(stderr, "Path length too long\n");
-      exit(-ENAMETOOLONG);
-    }
-
-    // find and initialize a new inode
-    unsigned int new_inode_num = find_available_inode(sb->s_first_ino);
-    if (new_inode_num == 0) {
-      fprintf(stderr, "No available inode\n");
-      exit(-ENOSPC);
-    }
-    initialize_inode(new_inode_num, EXT2_S_IFLNK);
+  else {
+    ret = ext2_symlink(parent_inode_num, new_link_name, source_path);
+  }
 
-    new_link = insert_dir_entry(parent_inode_num, new_inode_num, new_link_name, type);
+out:
+  free(source_path);
+  free(dest_path);
+  free(new_link_name);
+  free(source_path_cp);
+  return ret;
+}
 
-    // find a new block to put the source path
-    int block_num = find_available_block();
-    if (block_num == 0) {
-      fprintf(stderr, "No available block\n");
-      exit(-ENOSPC);
-    }
+#ifndef EXT2_BATCH
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int index = take_option(&argc, argv, "--index");
+  if (argc != 4 && (argc != 5 || (argc == 5 && strcmp(argv[2], "-s") != 0))) {
+    fprintf(stderr, "%d\n", argc);
+    fprintf(stderr, "Usage: %s [--sync] [--index] <image file name> [-s] <source path> <dest path>\n", argv[0]);
+    exit(1);
+  }
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+  index_growing_dirs(index);
 
-    struct ext2_inode *new_inode = &inode_table[new_inode_num - 1];
-    new_inode->i_block[0] = block_num;
-    new_inode->i_blocks = 2 << sb->s_log_block_size;
-    new_inode->i_size = sizeof(char) * strlen(source_path);
-   
-    // Clear the block and put the source path in it
-    char *new_block = (char *)(disk + block(block_num));
-    memset(new_block, '\0', EXT2_BLOCK_SIZE);
-    strcpy(new_block, source_path);
-    
-    allocate_block(block_num);
-    allocate_inode(new_inode_num);
+  // Check if this is a symbolic link or hard link
+  if (argc == 4) {
+    return journal_finish(ext2_ln(0, argv[2], argv[3]));
   }
-  return 0;
+  return journal_finish(ext2_ln(1, argv[3], argv[4]));
 }
+#endif
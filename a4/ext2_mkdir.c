@@ -9,98 +9,127 @@
 #include <string.h>
 #include "ext2.h"
 #include "ext2_util.h"
-
+#include "ext2_tools.h"
+#include "ext2_journal.h"
 
 /**
- * Initialize the '.' and '..' directory entries in the given block.
+ * Initialize the '.' and '..' directory entries in the given block. The block may have been freed by an earlier
+ * removal, so it is cleared first and the names are left zero padded.
 **/
-void initialize_dir_block(unsigned int self_inode, unsigned int par_inode, unsigned int block_num) {
-  struct ext2_inode *self = &inode_table[self_inode - 1];
-  struct ext2_inode *parent = &inode_table[par_inode - 1];
+static void initialize_dir_block(unsigned int self_inode, unsigned int par_inode, unsigned int block_num) {
+  struct ext2_inode *self = get_inode(self_inode);
+  struct ext2_inode *parent = get_inode(par_inode);
+  memset(disk + block(block_num), 0, block_size);
   struct ext2_dir_entry *self_entry = (struct ext2_dir_entry *)(disk + block(block_num));
   self_entry->inode = self_inode;
   self_entry->name_len = 1;
   self_entry->rec_len = ((sizeof(struct ext2_dir_entry) + 1 + 3) / 4) * 4;
   self_entry->file_type = EXT2_FT_DIR;
   strncpy(self_entry->name, ".", 1);
-  self->i_size = EXT2_BLOCK_SIZE;
+  self->i_size = block_size;
 
   self->i_links_count = self->i_links_count + 1;
   struct ext2_dir_entry *par_entry = (struct ext2_dir_entry *)(disk + block(block_num) + self_entry->rec_len);
   par_entry->name_len = 2;
   par_entry->inode = par_inode;
-  par_entry->rec_len = EXT2_BLOCK_SIZE - self_entry->rec_len;
+  par_entry->rec_len = block_size - self_entry->rec_len;
   par_entry->file_type = EXT2_FT_DIR;
   strncpy(par_entry->name, "..", 2);
 
+  journal_access(parent, sizeof(struct ext2_inode));
   parent->i_links_count = parent->i_links_count + 1;
 }
 
-int main(int argc, char const *argv[]) {
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <image file name> <path>\n", argv[0]);
-		exit(1);
-	}
-  init_disk(argv[1]);
-
+/**
+ * Creates the directory at the given absolute path in the image.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_mkdir(const char *dir_path) {
   // Check that the given path is absolute
-  if(argv[2][0] != '/') {
+  if(dir_path[0] != '/') {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    return -ENOENT;
   }
 
+  int ret = 0;
   // create a copy of the given path
-  char *path = malloc(sizeof(char) * strlen(argv[2]));
-  char *new_dir_name = malloc(sizeof(char) * strlen(argv[2]));
-  strcpy(path, argv[2]);
+  char *path = malloc(sizeof(char) * (strlen(dir_path) + 1));
+  char *new_dir_name = malloc(sizeof(char) * (strlen(dir_path) + 1));
+  strcpy(path, dir_path);
 
   split_parent_path_and_target(path, new_dir_name);
 
   // Get the parent inode
   int parent_inode_num = traverse_path(EXT2_ROOT_INO, path);
-  if(parent_inode_num== 0 || !(inode_table[parent_inode_num - 1].i_mode & EXT2_S_IFDIR)) {
+  if(parent_inode_num== 0 || !(get_inode(parent_inode_num)->i_mode & EXT2_S_IFDIR)) {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    ret = -ENOENT;
+    goto out;
   }
 
   // Check if entry already exists
   if(find_next_inode(parent_inode_num, new_dir_name) != 0) {
     fprintf(stderr, "File already exists\n");
-    exit(-EEXIST);
+    ret = -EEXIST;
+    goto out;
   }
 
   // find and initialize a new inode
   unsigned int new_inode_num = find_available_inode(sb->s_first_ino);
   if (new_inode_num == 0) {
     fprintf(stderr, "No available inode\n");
-    exit(-ENOSPC);
+    ret = -ENOSPC;
+    goto out;
   }
+
+  // Find a free block for the new dir entry, in the parent's group if possible
+  int block_num = find_available_block_near(group_first_block(inode_group(parent_inode_num)));
+  if (block_num == 0) {
+    fprintf(stderr, "No available block\n");
+    ret = -ENOSPC;
+    goto out;
+  }
+  // Taken right away, so a block added to the parent for the new entry can't be this one
+  allocate_block(block_num);
   initialize_inode(new_inode_num, EXT2_S_IFDIR);
 
   // insert the directory entry
   struct ext2_dir_entry *new_entry = insert_dir_entry(parent_inode_num, new_inode_num, new_dir_name, EXT2_FT_DIR);
   if (new_entry == NULL) {
     fprintf(stderr, "Directory cannot be inserted\n");
-    exit(-ENOSPC);
+    deallocate_block(block_num);
+    ret = -ENOSPC;
+    goto out;
   }
 
-  // Find a free block for the new dir entry
-  int block_num = find_available_block();
-  if (block_num == 0) {
-    fprintf(stderr, "No available block\n");
-    exit(-ENOSPC);
-  }
-
-  struct ext2_inode *new_inode = &inode_table[new_inode_num - 1];
+  struct ext2_inode *new_inode = get_inode(new_inode_num);
   new_inode->i_block[0] = block_num;
   new_inode->i_blocks = 2 << sb->s_log_block_size;
 
   // Add the '.' and '..' directory entries to the new directory
   initialize_dir_block(new_inode_num, parent_inode_num, block_num);
 
-  allocate_block(block_num);
   allocate_inode(new_inode_num);
-  bgdt->bg_used_dirs_count += 1;
+  bgdt[inode_group(new_inode_num)].bg_used_dirs_count += 1;
+
+out:
+  free(path);
+  free(new_dir_name);
+  return ret;
+}
+
+#ifndef EXT2_BATCH
+int main(int argc, char const *argv[]) {
+	int sync = take_option(&argc, argv, "--sync");
+	int index = take_option(&argc, argv, "--index");
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s [--sync] [--index] <image file name> <path>\n", argv[0]);
+		exit(1);
+	}
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+  index_growing_dirs(index);
 
-	return 0;
+	return journal_finish(ext2_mkdir(argv[2]));
 }
+#endif
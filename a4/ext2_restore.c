@@ -9,176 +9,458 @@
 #include <string.h>
 #include "ext2.h"
 #include "ext2_util.h"
+#include "ext2_htree.h"
+#include "ext2_tools.h"
+#include "ext2_journal.h"
+
+// Space taken by a directory entry with a name of the given length
+#define DIR_ENTRY_SIZE(name_len) (((sizeof(struct ext2_dir_entry) + (name_len) + 3) / 4) * 4)
+
+// What stands in the way of restoring a deleted entry
+#define RESTORE_OK 0
+#define RESTORE_GONE 1            // no longer in the slack of its block, restored already or written over
+#define RESTORE_EXISTS 2          // the name is in use in the directory again
+#define RESTORE_INODE_IN_USE 3
+#define RESTORE_BLOCK_IN_USE 4
+
+static const char *restore_status_names[] = {"restorable", "gone", "exists", "inode-in-use", "block-in-use"};
+
+/*
+ * A removed file or link found in the slack of a directory block: the space past the end of a live entry that
+ * its rec_len still covers, which is where ext2_rm leaves removed entries.
+ */
+struct deleted_entry {
+  unsigned int parent;      // inode of the directory it was removed from
+  unsigned int block_num;   // directory block holding it
+  unsigned int offset;      // offset of the entry in the block
+  unsigned int inode;
+  char *path;               // absolute path it is restored to
+  char *name;               // last component of path
+};
+
+/*
+ * Every deleted entry found by scanning the slack of a tree of directories once.
+ */
+struct restore_index {
+  struct deleted_entry *entries;
+  unsigned int count;
+  unsigned int capacity;
+};
 
 /**
- * Find a deleted directory entry with the given name in the given block.
- * Return a pointer to the oversized dir entry that contains the deleted entry if it is found,
- * otherwise, return NULL
+ * Returns 1 if the bytes at offset in the given directory block read as the entry of a removed file or link
+ * that fits before end, otherwise 0. Slack also holds the leftovers of entries that were moved or written
+ * over, so every field has to make sense, down to the inode still having the type the entry claims.
 **/
-struct ext2_dir_entry *find_deleted_dir_entry_in_block(unsigned int block_num, char *name) {
-  int size = sizeof(struct ext2_dir_entry) + strlen(name);
-  struct ext2_dir_entry *start_dir = (struct ext2_dir_entry *)(disk + block(block_num));
-  struct ext2_dir_entry *oversized_entry = find_oversized_entry(size, block_num, start_dir);
-  int oversized_entry_size = ((sizeof(struct ext2_dir_entry) + oversized_entry->name_len + 3) / 4) * 4;
-  struct ext2_dir_entry *deleted_entry;
-
-  while (oversized_entry != NULL) {
-    oversized_entry_size = ((sizeof(struct ext2_dir_entry) + oversized_entry->name_len + 3) / 4) * 4;
-
-    int cur_len = oversized_entry_size;
-    deleted_entry = (struct ext2_dir_entry *)((unsigned char *)oversized_entry + cur_len);
-
-    while (deleted_entry->rec_len > 0 && cur_len < oversized_entry->rec_len) {
-      if (strncmp(deleted_entry->name, name, strlen(name)) == 0) {
-        return oversized_entry;
+static int is_deleted_entry(unsigned char *block_start, unsigned int offset, unsigned int end) {
+  struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block_start + offset);
+  if (offset + sizeof(struct ext2_dir_entry) > end) {
+    return 0;
+  }
+  if (entry->inode < sb->s_first_ino || entry->inode > sb->s_inodes_count || entry->name_len == 0 ||
+      offset + DIR_ENTRY_SIZE(entry->name_len) > end || entry->rec_len % 4 != 0 ||
+      entry->rec_len < DIR_ENTRY_SIZE(entry->name_len) || offset + entry->rec_len > block_size) {
+    return 0;
+  }
+  if (memchr(entry->name, '/', entry->name_len) != NULL || memchr(entry->name, '\0', entry->name_len) != NULL) {
+    return 0;
+  }
+  unsigned short mode = get_inode(entry->inode)->i_mode & 0xF000;
+  return (entry->file_type == EXT2_FT_REG_FILE && mode == EXT2_S_IFREG) ||
+    (entry->file_type == EXT2_FT_SYMLINK && mode == EXT2_S_IFLNK);
+}
+
+/**
+ * Adds the deleted entry at offset in the block of directory parent, found under dir_path, to the index.
+**/
+static void index_add(struct restore_index *index, unsigned int parent, const char *dir_path, unsigned int block_num, unsigned int offset) {
+  struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(block_num) + offset);
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? index->capacity * 2 : 64;
+    index->entries = realloc(index->entries, sizeof(struct deleted_entry) * index->capacity);
+  }
+
+  struct deleted_entry *deleted = &index->entries[index->count++];
+  int dir_len = strcmp(dir_path, "/") == 0 ? 0 : strlen(dir_path);
+  deleted->parent = parent;
+  deleted->block_num = block_num;
+  deleted->offset = offset;
+  deleted->inode = entry->inode;
+  deleted->path = malloc(dir_len + entry->name_len + 2);
+  sprintf(deleted->path, "%.*s/%.*s", dir_len, dir_path, entry->name_len, entry->name);
+  deleted->name = deleted->path + dir_len + 1;
+}
+
+/**
+ * Adds every deleted entry in the slack of the given block of directory parent to the index. The block is
+ * walked once along the rec_len chain of its live entries, and the slack after each is searched a 4-byte
+ * step at a time, so entries are found even where a later entry was written over the start of the slack.
+**/
+static void index_dir_block(struct restore_index *index, unsigned int parent, const char *dir_path, unsigned int block_num) {
+  unsigned char *block_start = disk + block(block_num);
+  unsigned int offset = 0;
+
+  while (offset < block_size) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block_start + offset);
+    if (entry->rec_len < sizeof(struct ext2_dir_entry) || offset + entry->rec_len > block_size) {
+      return;
+    }
+    unsigned int end = offset + entry->rec_len;
+    unsigned int slack = offset + DIR_ENTRY_SIZE(entry->name_len);
+    while (slack < end) {
+      if (is_deleted_entry(block_start, slack, end)) {
+        index_add(index, parent, dir_path, block_num, slack);
+        // Splitting a leaf of an indexed directory leaves copies of the entries it moved out behind in its slack
+        if (!dx_leaf_covers(get_inode(parent), index->entries[index->count - 1].name, block_num)) {
+          free(index->entries[--index->count].path);
+        }
+        slack += DIR_ENTRY_SIZE(((struct ext2_dir_entry *)(block_start + slack))->name_len);
+      } else {
+        slack += 4;
       }
-      cur_len += deleted_entry->rec_len;
-      deleted_entry = (struct ext2_dir_entry *)((unsigned char *)oversized_entry + cur_len);
     }
-    start_dir = (struct ext2_dir_entry *)((unsigned char *)oversized_entry + oversized_entry->rec_len);
-    oversized_entry = find_oversized_entry(size, block_num, start_dir);
+    offset = end;
   }
-  return NULL;
 }
 
 /**
- * Find a deleted directory entry with the given name in all the blocks of the inode with inode_num.
- * Return a pointer to the oversized dir entry that contains the deleted entry if it is found,
- * otherwise, return NULL
+ * Adds the deleted entries of the directory dir_inode_num at dir_path to the index, and those of every
+ * directory below it when recursive is set. The index blocks of an indexed directory are skipped, as they
+ * hold hashes rather than entries.
 **/
-struct ext2_dir_entry *find_deleted_dir_entry(int inode_num, char *name) {
-  struct ext2_inode *inode = &inode_table[inode_num - 1];
-  struct ext2_dir_entry *oversized_entry;
-
-  for(int i = 0; i < (int)inode->i_blocks/(2 << sb->s_log_block_size) && i < 15; i++) {
-    if(i < INDIRECT_BLOCK_IDX) {
-      oversized_entry = find_deleted_dir_entry_in_block(inode->i_block[i], name);
-      if (oversized_entry != NULL) {
-        return oversized_entry;
+static void index_dir(struct restore_index *index, unsigned int dir_inode_num, const char *dir_path, int recursive) {
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  unsigned int logical = 0;
+  int n;
+
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n; i++, logical++) {
+      if (blocks[i] == 0 || dx_is_index_block(dir, logical)) {
+        continue;
       }
-    } else {
-      for(int j = 0; j < (int)(EXT2_BLOCK_SIZE/sizeof(int)); j++) {
-        oversized_entry = find_deleted_dir_entry_in_block((disk + block(inode->i_block[i]))[j], name);
-        if (oversized_entry != NULL) {
-          return oversized_entry;
+      index_dir_block(index, dir_inode_num, dir_path, blocks[i]);
+      if (!recursive) {
+        continue;
+      }
+
+      // Go down into the live subdirectories held by this block
+      for (unsigned int offset = 0; offset < block_size;) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(blocks[i]) + offset);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry)) {
+          break;
         }
+        int is_dot = (entry->name_len == 1 && entry->name[0] == '.') ||
+          (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+        if (entry->inode != 0 && entry->file_type == EXT2_FT_DIR && !is_dot &&
+            (get_inode(entry->inode)->i_mode & 0xF000) == EXT2_S_IFDIR) {
+          int dir_len = strcmp(dir_path, "/") == 0 ? 0 : strlen(dir_path);
+          char *sub_path = malloc(dir_len + entry->name_len + 2);
+          sprintf(sub_path, "%.*s/%.*s", dir_len, dir_path, entry->name_len, entry->name);
+          index_dir(index, entry->inode, sub_path, recursive);
+          free(sub_path);
+        }
+        offset += entry->rec_len;
       }
     }
   }
+}
+
+static int compare_deleted_entries(const void *a, const void *b) {
+  const struct deleted_entry *entry_a = a;
+  const struct deleted_entry *entry_b = b;
+  if (entry_a->parent != entry_b->parent) {
+    return entry_a->parent < entry_b->parent ? -1 : 1;
+  }
+  if (entry_a->inode != entry_b->inode) {
+    return entry_a->inode < entry_b->inode ? -1 : 1;
+  }
+  return strcmp(entry_a->name, entry_b->name);
+}
+
+/**
+ * Sorts the index by directory and inode, and drops the repeats of an entry. The slack of an indexed directory's
+ * leaf still holds a copy of every entry that was in it when it was split, next to the entry itself once removed.
+**/
+static void index_dedupe(struct restore_index *index) {
+  unsigned int kept = 0;
+  qsort(index->entries, index->count, sizeof(struct deleted_entry), compare_deleted_entries);
+  for (unsigned int i = 0; i < index->count; i++) {
+    if (kept > 0 && compare_deleted_entries(&index->entries[kept - 1], &index->entries[i]) == 0) {
+      free(index->entries[i].path);
+      continue;
+    }
+    index->entries[kept++] = index->entries[i];
+  }
+  index->count = kept;
+}
+
+static void index_free(struct restore_index *index) {
+  for (unsigned int i = 0; i < index->count; i++) {
+    free(index->entries[i].path);
+  }
+  free(index->entries);
+}
+
+/**
+ * Returns the live entry of the block whose rec_len covers the deleted entry at offset, past the end of its own
+ * name, or NULL if the deleted entry is not in any entry's slack.
+**/
+static struct ext2_dir_entry *find_holder(unsigned int block_num, unsigned int offset) {
+  for (unsigned int cur = 0; cur < block_size;) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(block_num) + cur);
+    if (entry->rec_len < sizeof(struct ext2_dir_entry)) {
+      return NULL;
+    }
+    if (offset < cur + entry->rec_len) {
+      return offset >= cur + DIR_ENTRY_SIZE(entry->name_len) ? entry : NULL;
+    }
+    cur += entry->rec_len;
+  }
   return NULL;
 }
 
-int main(int argc, char const *argv[]) {
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <image file name> <path to file>\n", argv[0]);
-		exit(1);
-	}
+/*
+ * A run of consecutive blocks of the deleted inode, so the bitmaps are checked and updated a run at a time.
+ */
+struct block_run {
+  unsigned int first;
+  unsigned int count;
+  // Mark the run as used when set, otherwise check that none of it is in use
+  int allocate;
+};
+
+/**
+ * Checks or allocates the blocks gathered in run, and empties it.
+ * Returns 1 if the run is being checked and some of its blocks are already in use, otherwise 0.
+**/
+static int flush_block_run(struct block_run *run) {
+  int ret = 0;
+  if (run->count > 0) {
+    if (run->allocate) {
+      allocate_block_run(run->first, run->count);
+    } else {
+      ret = blocks_in_use(run->first, run->count) != 0;
+    }
+  }
+  run->count = 0;
+  return ret;
+}
 
+/**
+ * Block visitor that gathers consecutive blocks into the block_run pointed to by arg, flushing it whenever
+ * the run breaks. Returns 1 once a block checked is in use, stopping the walk.
+**/
+static int block_run_visitor(unsigned int block_num, void *arg) {
+  struct block_run *run = arg;
+  if (run->count > 0 && block_num == run->first + run->count) {
+    run->count++;
+    return 0;
+  }
+  int ret = flush_block_run(run);
+  run->first = block_num;
+  run->count = 1;
+  return ret;
+}
+
+/**
+ * Works out whether the deleted entry can be restored right now. Returns one of the RESTORE_ codes, and
+ * stores the entry whose slack holds it in holder.
+**/
+static int check_deleted_entry(struct deleted_entry *deleted, struct ext2_dir_entry **holder) {
+  struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(deleted->block_num) + deleted->offset);
+  *holder = find_holder(deleted->block_num, deleted->offset);
+  if (*holder == NULL || entry->inode != deleted->inode ||
+      !dx_leaf_covers(get_inode(deleted->parent), deleted->name, deleted->block_num)) {
+    return RESTORE_GONE;
+  }
+  // A leftover copy of the live entry, or an entry restored already
+  int live_inode = find_next_inode(deleted->parent, deleted->name);
+  if (live_inode == deleted->inode) {
+    return RESTORE_GONE;
+  }
+  if (live_inode != 0) {
+    return RESTORE_EXISTS;
+  }
+  if (inode_in_use(deleted->inode)) {
+    return RESTORE_INODE_IN_USE;
+  }
+  // check that the blocks of the deleted entry, indirect blocks included, are not used
+  struct block_run run = {0, 0, 0};
+  if (for_each_inode_block(get_inode(deleted->inode), block_run_visitor, &run) || flush_block_run(&run)) {
+    return RESTORE_BLOCK_IN_USE;
+  }
+  return RESTORE_OK;
+}
+
+/**
+ * Puts the deleted entry back into its directory, which check_deleted_entry found it can be with the given holder.
+ * The holder is cut short right before the entry, and the entry takes the rest of the space the holder covered, so
+ * any other deleted entries on either side stay in some entry's slack.
+**/
+static void restore_deleted_entry(struct deleted_entry *deleted, struct ext2_dir_entry *holder) {
+  struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(deleted->block_num) + deleted->offset);
+  struct ext2_inode *deleted_inode = get_inode(deleted->inode);
+  unsigned int holder_offset = (unsigned char *)holder - (disk + block(deleted->block_num));
+
+  // Inode and blocks of the deleted entry are not used, reallocate them
+  allocate_inode(deleted->inode);
+  struct block_run run = {0, 0, 1};
+  for_each_inode_block(deleted_inode, block_run_visitor, &run);
+  flush_block_run(&run);
+
+  dcache_insert(deleted->parent, deleted->name, deleted->inode);
+  journal_access(deleted_inode, sizeof(struct ext2_inode));
+  journal_block(deleted->block_num);
+  deleted_inode->i_links_count += 1;
+  deleted_inode->i_dtime = 0;
+  entry->rec_len = holder_offset + holder->rec_len - deleted->offset;
+  holder->rec_len = deleted->offset - holder_offset;
+  dspace_block_changed(deleted->parent, deleted->block_num);
+}
+
+/**
+ * Restores the removed file or link at the given absolute path in the image.
+ * Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_restore(const char *file_path) {
   // Check that the given path is absolute
-  if(argv[2][0] != '/') {
+  if(file_path[0] != '/') {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    return -ENOENT;
   }
 
-  init_disk(argv[1]);
-
+  int ret = 0;
+  struct restore_index index = {NULL, 0, 0};
   // create a copy of the given path
-  char *path = malloc(sizeof(char) * strlen(argv[2]));
-  char *dir_name = malloc(sizeof(char) * strlen(argv[2]));
-  strcpy(path, argv[2]);
+  char *path = malloc(sizeof(char) * (strlen(file_path) + 1));
+  char *dir_name = malloc(sizeof(char) * (strlen(file_path) + 1));
+  strcpy(path, file_path);
 
   split_parent_path_and_target(path, dir_name);
 
   // Get the parent inode
   int parent_inode_num = traverse_path(EXT2_ROOT_INO, path);
-  if(parent_inode_num== 0 || !(inode_table[parent_inode_num - 1].i_mode & EXT2_S_IFDIR)) {
+  if(parent_inode_num== 0 || !(get_inode(parent_inode_num)->i_mode & EXT2_S_IFDIR)) {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    ret = -ENOENT;
+    goto out;
   }
 
-  if (find_next_inode(EXT2_ROOT_INO, dir_name) != 0) {
+  if (find_next_inode(parent_inode_num, dir_name) != 0) {
     fprintf(stderr, "File already exists in directory\n");
-    exit(-EEXIST);
+    ret = -EEXIST;
+    goto out;
   }
 
-  // find the oversized directory entry containing the deleted directory entry
-  struct ext2_dir_entry *oversized_entry = find_deleted_dir_entry(parent_inode_num, dir_name);
-  // If oversized_entry is null, the directory entry could not be found
-  // Note that a deleted directory entry at the start of a block has inode 0. In this case, file cannot be restored and
-  // oversized_entry will be NULL.
-  if (oversized_entry == NULL) {
-    fprintf(stderr, "File cannot be restored because it cannot be found\n");
-    exit(-ENOENT);
+  // The parent may hold several old entries by that name, restore the first one that still can be.
+  // Note that a deleted directory entry at the start of a block has inode 0, so it is never found.
+  index_dir(&index, parent_inode_num, path, 0);
+  int status = RESTORE_GONE;
+  for (unsigned int i = 0; i < index.count && status != RESTORE_OK; i++) {
+    struct deleted_entry *deleted = &index.entries[i];
+    struct ext2_dir_entry *holder;
+    if (strcmp(deleted->name, dir_name) != 0) {
+      continue;
+    }
+    int entry_status = check_deleted_entry(deleted, &holder);
+    if (entry_status == RESTORE_OK) {
+      restore_deleted_entry(deleted, holder);
+    }
+    // Report the first reason found if none can be restored
+    if (entry_status == RESTORE_OK || status == RESTORE_GONE) {
+      status = entry_status;
+    }
   }
 
-  // Now we know that the deleted entry we are looking for exists
-  int oversized_entry_size = ((sizeof(struct ext2_dir_entry) + oversized_entry->name_len + 3) / 4) * 4;
+  if (status == RESTORE_GONE) {
+    fprintf(stderr, "File cannot be restored because it cannot be found\n");
+    ret = -ENOENT;
+  } else if (status == RESTORE_EXISTS) {
+    fprintf(stderr, "File already exists in directory\n");
+    ret = -EEXIST;
+  } else if (status == RESTORE_INODE_IN_USE) {
+    fprintf(stderr, "Inode is in use\n");
+    ret = -EBUSY;
+  } else if (status == RESTORE_BLOCK_IN_USE) {
+    fprintf(stderr, "Block is in use\n");
+    ret = -EBUSY;
+  }
 
-  int cur_len = oversized_entry_size;
-  struct ext2_dir_entry *deleted_entry = (struct ext2_dir_entry *)((unsigned char *)oversized_entry + oversized_entry_size);
+out:
+  index_free(&index);
+  free(path);
+  free(dir_name);
+  return ret;
+}
 
-  // find the deleted entry
-  while (cur_len < oversized_entry->rec_len && strncmp(deleted_entry->name, dir_name, strlen(dir_name)) != 0) {
-    cur_len += deleted_entry->rec_len;
-    deleted_entry = (struct ext2_dir_entry *)((unsigned char *)oversized_entry + cur_len);
+/**
+ * Restores every removed file and link under the directory at dir_path that still can be, or just lists them
+ * with list_only set. Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_restore_all(const char *dir_path, int list_only) {
+  if(dir_path[0] != '/') {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
   }
 
-  // Check that the inode of the deleted entry is not being used
-  int byte = (deleted_entry->inode - 1)/ 8;
-  int bit = (deleted_entry->inode - 1) % 8;
-  if (inode_bitmap[byte] & (1 << bit)) {
-    fprintf(stderr, "Inode is in use\n");
-    exit(-EBUSY);
+  char *path = malloc(strlen(dir_path) + 1);
+  strcpy(path, dir_path);
+  int dir_inode_num = traverse_path(EXT2_ROOT_INO, path);
+  free(path);
+  if(dir_inode_num == 0 || (get_inode(dir_inode_num)->i_mode & 0xF000) != EXT2_S_IFDIR) {
+    fprintf(stderr, "Invalid path\n");
+    return -ENOENT;
   }
 
-  struct ext2_inode *deleted_inode = &inode_table[deleted_entry->inode - 1];
-
-  // check that the blocks of the deleted entry are not used
-  for (int i = 0; i < 15; i++) {
-    if (deleted_inode->i_block[i] > 0) {
-      // if any of the blocks are used, return an error
-      int byte = (deleted_inode->i_block[i] - 1) / 8;
-      int bit = (deleted_inode->i_block[i] - 1) % 8;
-      if (block_bitmap[byte] & (1 << bit)) {
-        fprintf(stderr, "Block is in use\n");
-        exit(-EBUSY);
-      }
-      if (i >= INDIRECT_BLOCK_IDX) {
-        int j = 0;
-        while (j < (int)(EXT2_BLOCK_SIZE/sizeof(int)) && (disk + block(deleted_inode->i_block[i]))[j] != 0) {
-          int byte = ((disk + block(deleted_inode->i_block[i]))[j] - 1) / 8;
-          int bit = ((disk + block(deleted_inode->i_block[i]))[j] - 1) % 8;
-          if (block_bitmap[byte] & (1 << bit)) {
-            fprintf(stderr, "Block is in use\n");
-            exit(-EBUSY);
-          }
-          j += 1;
-        }
-      }
+  // Scan the whole tree once, then work through what was found
+  struct restore_index index = {NULL, 0, 0};
+  unsigned int restored = 0;
+  index_dir(&index, dir_inode_num, dir_path, 1);
+  index_dedupe(&index);
+  for (unsigned int i = 0; i < index.count; i++) {
+    struct deleted_entry *deleted = &index.entries[i];
+    struct ext2_dir_entry *holder;
+    int status = check_deleted_entry(deleted, &holder);
+    if (list_only && status != RESTORE_GONE) {
+      printf("%-12s %8u  %s\n", restore_status_names[status], deleted->inode, deleted->path);
+    } else if (status == RESTORE_OK) {
+      restore_deleted_entry(deleted, holder);
+      printf("%s\n", deleted->path);
+      restored++;
     }
   }
-
-  // Inode and blocks of the deleted entry are not used, reallocate them
-  allocate_inode(deleted_entry->inode);
-
-  for (int i = 0; i < 15; i++) {
-    if (deleted_inode->i_block[i] > 0) {
-      allocate_block(deleted_inode->i_block[i]);
-      if (i >= INDIRECT_BLOCK_IDX) {
-        int j = 0;
-        while (j < (int)(EXT2_BLOCK_SIZE/sizeof(int))) {
-          if ((disk + block(deleted_inode->i_block[i]))[j] != 0) {
-            allocate_block((disk + block(deleted_inode->i_block[i]))[j]);
-          }
-          j += 1;
-        }
-      }
-    }
+  if (!list_only) {
+    fprintf(stderr, "%u of %u removed entries restored\n", restored, index.count);
   }
+  index_free(&index);
+  return 0;
+}
 
-  deleted_inode->i_links_count += 1;
-  deleted_inode->i_dtime = 0;
-  oversized_entry->rec_len -= deleted_entry->rec_len;
+#ifndef EXT2_BATCH
+int main(int argc, char const *argv[]) {
+	int sync = take_option(&argc, argv, "--sync");
+	int list = take_option(&argc, argv, "--list");
+	int all = take_option(&argc, argv, "--all");
+	if ((list || all) ? (argc != 2 && argc != 3) || (list && all) : argc != 3) {
+		fprintf(stderr, "Usage: %s [--sync] <image file name> <path to file>\n", argv[0]);
+		fprintf(stderr, "       %s --list <image file name> [directory]\n", argv[0]);
+		fprintf(stderr, "       %s [--sync] --all <image file name> [directory]\n", argv[0]);
+		exit(1);
+	}
 
-	return 0;
+	// Listing only looks, so it works on images in use or on read-only storage
+	if (list) {
+		init_disk_readonly(argv[1]);
+	} else {
+		init_disk(argv[1]);
+		journal_sync_commits(sync);
+	}
+	if (list || all) {
+		return journal_finish(ext2_restore_all(argc == 3 ? argv[2] : "/", list));
+	}
+	return journal_finish(ext2_restore(argv[2]));
 }
+#endif
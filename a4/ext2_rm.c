@@ -10,49 +10,155 @@
 #include <time.h>
 #include "ext2.h"
 #include "ext2_util.h"
+#include "ext2_htree.h"
+#include "ext2_tools.h"
+#include "ext2_journal.h"
 
 /**
  * Searches for the directory entry with the given name. Return the block number of the block containing the
  * directory entry if the entry is found, or return 0 otherwise. 
 **/
-unsigned int get_dir_entry_block(unsigned int inode_num, char *name) {
-  struct ext2_inode *inode = &inode_table[inode_num - 1];
-  int dir_inode_num;
-
-  // Iterations the for loop runs is the minimum of 15 and the number of blocks allocated for the inode
-  for(int i = 0; i < (int)inode->i_blocks/(2 << sb->s_log_block_size) && i < 15; i++) {
-    if(i < INDIRECT_BLOCK_IDX) {
-      dir_inode_num = find_dir_in_block(inode->i_block[i], name);
-      if (dir_inode_num != 0) {
-        return inode->i_block[i];
+static unsigned int get_dir_entry_block(unsigned int inode_num, char *name) {
+  struct ext2_inode *inode = get_inode(inode_num);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  int n;
+
+  // Use the hash index to go straight to the right block when the directory has one
+  long dx_block = dx_find_block(inode, name);
+  if (dx_block != -1) {
+    return dx_block;
+  }
+
+  block_iter_init(&iter, inode);
+  while((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for(int i = 0; i < n; i++) {
+      if (blocks[i] != 0 && find_dir_in_block(blocks[i], name) != 0) {
+        return blocks[i];
       }
-    } else {
-      for(int j = 0; j < (int)(EXT2_BLOCK_SIZE/sizeof(int)); j++) {
-        dir_inode_num = find_dir_in_block(((int *)&inode->i_block[i])[j], name);
-        if (dir_inode_num != 0) {
-          return ((int *)&inode->i_block[i])[j];
+    }
+  }
+  return 0;
+}
+
+/*
+ * The blocks and inodes a removal frees, gathered as it goes so the bitmaps and free counters are updated
+ * in one pass at the end.
+ */
+struct removal {
+  unsigned int *blocks;
+  unsigned int block_count;
+  unsigned int block_capacity;
+  unsigned int *inodes;
+  unsigned int inode_count;
+  unsigned int inode_capacity;
+  unsigned int dtime;
+};
+
+/**
+ * Appends num to the list, growing it as needed.
+**/
+static void append_number(unsigned int **list, unsigned int *count, unsigned int *capacity, unsigned int num) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 256;
+    *list = realloc(*list, sizeof(unsigned int) * *capacity);
+  }
+  (*list)[(*count)++] = num;
+}
+
+/**
+ * Block visitor that gathers every block of an inode being removed into the struct removal pointed to by arg.
+**/
+static int collect_block_visitor(unsigned int block_num, void *arg) {
+  struct removal *removal = arg;
+  append_number(&removal->blocks, &removal->block_count, &removal->block_capacity, block_num);
+  return 0;
+}
+
+/**
+ * Marks the inode as deleted and gathers it and its blocks, indirect blocks included, to be freed.
+**/
+static void free_inode(struct removal *removal, unsigned int inode_num) {
+  struct ext2_inode *inode = get_inode(inode_num);
+  journal_access(inode, sizeof(struct ext2_inode));
+  inode->i_links_count = 0;
+  inode->i_dtime = removal->dtime;
+  for_each_inode_block(inode, collect_block_visitor, removal);
+  append_number(&removal->inodes, &removal->inode_count, &removal->inode_capacity, inode_num);
+}
+
+/**
+ * Drops the link an entry gave to a file or link, freeing it once no links are left. Files hard linked from
+ * outside a removed tree stay.
+**/
+static void unlink_inode(struct removal *removal, unsigned int inode_num) {
+  struct ext2_inode *inode = get_inode(inode_num);
+  if (inode->i_links_count > 1) {
+    journal_access(inode, sizeof(struct ext2_inode));
+    inode->i_links_count--;
+    return;
+  }
+  if (inode->i_links_count == 1) {
+    free_inode(removal, inode_num);
+  }
+}
+
+/**
+ * Removes everything below the directory and then the directory itself, walking the tree in post-order.
+ * Only the inodes are changed: the directory blocks are freed as they are, so they are read the once.
+**/
+static void remove_tree(struct removal *removal, unsigned int dir_inode_num) {
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
+  int n;
+
+  // A directory with no links left is already being removed, which only a damaged tree leads back to
+  if (dir->i_links_count == 0) {
+    return;
+  }
+  journal_access(dir, sizeof(struct ext2_inode));
+  dir->i_links_count = 0;
+
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for (int i = 0; i < n; i++) {
+      for (unsigned int offset = 0; blocks[i] != 0 && offset < block_size;) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(blocks[i]) + offset);
+        if (entry->rec_len < sizeof(struct ext2_dir_entry)) {
+          break;
+        }
+        int is_dot = (entry->name_len == 1 && entry->name[0] == '.') ||
+          (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+        if (entry->inode != 0 && !is_dot && entry->inode <= sb->s_inodes_count) {
+          if ((get_inode(entry->inode)->i_mode & 0xF000) == EXT2_S_IFDIR) {
+            remove_tree(removal, entry->inode);
+          } else {
+            unlink_inode(removal, entry->inode);
+          }
         }
+        offset += entry->rec_len;
       }
     }
   }
-  return 0;
+  free_inode(removal, dir_inode_num);
 }
 
 /**
  * Searches the given block for the directory entry with the given name, and return the directory entry right before
  * if found. If the directory entry is the first entry, return NULL.
 **/
-struct ext2_dir_entry *find_prev_dir_in_block(int block, char *name) {
+static struct ext2_dir_entry *find_prev_dir_in_block(int block, char *name) {
   struct ext2_dir_entry *cur_dir = (struct ext2_dir_entry *)(disk + block(block));
   struct ext2_dir_entry *prev_dir = NULL;
   int i = 0;
-  while(i < EXT2_BLOCK_SIZE) {
+  while(i < block_size) {
     if(cur_dir->inode != 0 && cur_dir->name_len == strlen(name) && strncmp(name, cur_dir->name, cur_dir->name_len) == 0) {
       return prev_dir;
     }
 
     i += cur_dir->rec_len;
-    if (i < EXT2_BLOCK_SIZE) {
+    if (i < block_size) {
       prev_dir = cur_dir;
       cur_dir = (struct ext2_dir_entry *)(disk + block(block) + i);
     }
@@ -60,32 +166,43 @@ struct ext2_dir_entry *find_prev_dir_in_block(int block, char *name) {
   return NULL;
 }
 
-int main(int argc, char const *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <image file name> <path to file or link>\n", argv[0]);
-    exit(1);
-  }
-
-  init_disk(argv[1]);
-
+/**
+ * Removes the file or link at the given absolute path from the image, or with recursive set, the directory
+ * there and everything below it. Returns 0 on success, otherwise the error code the tool exits with.
+**/
+int ext2_rm(int recursive, const char *file_path) {
   // Check that the given path is absolute
-  if(argv[2][0] != '/') {
+  if(file_path[0] != '/') {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    return -ENOENT;
+  }
+  // Nothing but '/'s names the root, which has no parent to be removed from
+  if(file_path[strspn(file_path, "/")] == '\0') {
+    fprintf(stderr, "Cannot remove '%s'\n", file_path);
+    return -EINVAL;
   }
 
-  char *path = malloc(sizeof(char) * strlen(argv[2]));
-  strcpy(path, argv[2]);
+  int ret = 0;
+  struct removal removal = {NULL, 0, 0, NULL, 0, 0, (unsigned int)time(NULL)};
+  char *path = malloc(sizeof(char) * (strlen(file_path) + 1));
+  strcpy(path, file_path);
 
   // get the file name of the file to remove
-  char *to_remove = malloc(sizeof(char) * strlen(argv[2]));
+  char *to_remove = malloc(sizeof(char) * (strlen(file_path) + 1));
   split_parent_path_and_target(path, to_remove);
 
   // get parent inode
   int parent_inode_num = traverse_path(EXT2_ROOT_INO, path);
-  if(parent_inode_num == 0 || !(inode_table[parent_inode_num - 1].i_mode & EXT2_S_IFDIR)) {
+  if(parent_inode_num == 0 || !(get_inode(parent_inode_num)->i_mode & EXT2_S_IFDIR)) {
     fprintf(stderr, "Invalid path\n");
-    exit(-ENOENT);
+    ret = -ENOENT;
+    goto out;
+  }
+
+  if (strcmp(to_remove, ".") == 0 || strcmp(to_remove, "..") == 0) {
+    fprintf(stderr, "Cannot remove '%s'\n", file_path);
+    ret = -EINVAL;
+    goto out;
   }
 
   // get the block that the directory entry is in
@@ -93,7 +210,8 @@ int main(int argc, char const *argv[]) {
   // Check if directory entry exists
   if (dir_entry_blk == 0) {
     fprintf(stderr, "File does not exist\n");
-    exit(-EEXIST);
+    ret = -EEXIST;
+    goto out;
   }
 
   struct ext2_dir_entry *dir_to_remove;
@@ -106,59 +224,78 @@ int main(int argc, char const *argv[]) {
   // if prev_dir is null, then the directory is the first in the block
   if (prev_dir == NULL) {
     dir_to_remove = (struct ext2_dir_entry *)(disk + block(dir_entry_blk));
-    // Check that we are not removing a directory
-    if (dir_to_remove->file_type == EXT2_FT_DIR) {
-      fprintf(stderr, "Cannot remove a directory\n");
-      exit(-EISDIR);
-    }
-
-    inode_num = dir_to_remove->inode;
-    inode_to_remove = &inode_table[inode_num - 1];
-    if (inode_to_remove->i_links_count > 1) {
-      fprintf(stderr, "Cannot remove a file with more than 1 hardlink\n");
-      exit(-EMLINK);
-    }
-    // Set the inode to 0
-    dir_to_remove->inode = 0;
   }
-
   // The prev_dir is not null, the directory entry is not the first in the block
   else {
-    // Check that we are not removing a directory
-    struct ext2_dir_entry *dir_to_remove = (struct ext2_dir_entry *)((unsigned char *)prev_dir + prev_dir->rec_len);
-    if (dir_to_remove->file_type == EXT2_FT_DIR) {
-      fprintf(stderr, "Cannot remove a directory\n");
-      exit(-EISDIR);
-    }
+    dir_to_remove = (struct ext2_dir_entry *)((unsigned char *)prev_dir + prev_dir->rec_len);
+  }
 
-    inode_num = dir_to_remove->inode;
+  // Directories only go with everything in them
+  int is_dir = dir_to_remove->file_type == EXT2_FT_DIR;
+  if (is_dir && !recursive) {
+    fprintf(stderr, "Cannot remove a directory\n");
+    ret = -EISDIR;
+    goto out;
+  }
 
-    // Check that there are no other hard links to this file other than the directory it is in
-    inode_to_remove = &inode_table[inode_num - 1];
-    if (inode_to_remove->i_links_count > 1) {
-      fprintf(stderr, "Cannot remove a file with more than 1 hardlink\n");
-      exit(-EMLINK);
-    }
+  inode_num = dir_to_remove->inode;
+
+  // Check that there are no other hard links to this file other than the directory it is in
+  inode_to_remove = get_inode(inode_num);
+  if (!is_dir && inode_to_remove->i_links_count > 1) {
+    fprintf(stderr, "Cannot remove a file with more than 1 hardlink\n");
+    ret = -EMLINK;
+    goto out;
+  }
+
+  journal_block(dir_entry_blk);
+  if (prev_dir == NULL) {
+    // Set the inode to 0
+    dir_to_remove->inode = 0;
+  } else {
     prev_dir->rec_len = prev_dir->rec_len + dir_to_remove->rec_len;
   }
 
-  // Set the deletion time
-  inode_to_remove->i_dtime = (unsigned int)time(NULL);
+  // The entry is gone, remember that for later lookups and inserts
+  dcache_insert(parent_inode_num, to_remove, 0);
+  dspace_block_changed(parent_inode_num, dir_entry_blk);
 
-  // Deallocate the blocks
-  for(int i = 0; i < inode_to_remove->i_blocks / (2 << sb->s_log_block_size); i++) {
-    if (i < 12) {
-      deallocate_block(inode_to_remove->i_block[i]);
-    } else if( i > 11 && i < (inode_to_remove->i_blocks/(2 << sb->s_log_block_size) - 1)){
-      deallocate_block(((int *)(disk + block(inode_to_remove->i_block[INDIRECT_BLOCK_IDX])))[i - (INDIRECT_BLOCK_IDX)]);
-    } else {
-      deallocate_block(inode_to_remove->i_block[INDIRECT_BLOCK_IDX]);
-    }
+  if (is_dir) {
+    // The parent loses the link from the directory's '..'
+    struct ext2_inode *parent = get_inode(parent_inode_num);
+    journal_access(parent, sizeof(struct ext2_inode));
+    parent->i_links_count--;
+    remove_tree(&removal, inode_num);
+    // Lookups cached and space tracked under the removed directories would be wrong once their inodes are reused
+    dcache_clear();
+    dspace_clear();
+  } else {
+    free_inode(&removal, inode_num);
   }
 
-// deallocate inode
-inode_to_remove->i_links_count = inode_to_remove->i_links_count - 1;
-deallocate_inode(inode_num);
+  // Free the blocks, indirect blocks included, and the inodes with each bitmap and counter updated once
+  deallocate_blocks(removal.blocks, removal.block_count);
+  deallocate_inodes(removal.inodes, removal.inode_count);
+
+out:
+  free(removal.blocks);
+  free(removal.inodes);
+  free(path);
+  free(to_remove);
+  return ret;
+}
 
-return 0;
+#ifndef EXT2_BATCH
+int main(int argc, char const *argv[]) {
+  int sync = take_option(&argc, argv, "--sync");
+  int recursive = take_option(&argc, argv, "-r");
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s [--sync] [-r] <image file name> <path to file or link>\n", argv[0]);
+    exit(1);
+  }
+
+  init_disk(argv[1]);
+  journal_sync_commits(sync);
+  return journal_finish(ext2_rm(recursive, argv[2]));
 }
+#endif
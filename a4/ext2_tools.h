@@ -0,0 +1,34 @@
+#ifndef CSC369_EXT2_TOOLS_H
+#define CSC369_EXT2_TOOLS_H
+
+/*
+ * The operations behind each of the command line tools, for running them against an image that is
+ * already mapped with init_disk. Each returns 0 on success, otherwise the code the matching tool exits with.
+ */
+
+// Copies the host file src_path into the image at dest_path
+extern int ext2_cp(const char *src_path, const char *dest_path);
+
+// Copies the host directory tree src_path into the image as the new directory dest_path
+extern int ext2_cp_tree(const char *src_path, const char *dest_path);
+
+// Creates the directory at dir_path
+extern int ext2_mkdir(const char *dir_path);
+
+// Links dest to src, with a symbolic link when symbolic is set and a hard link otherwise
+extern int ext2_ln(int symbolic, const char *src, const char *dest);
+
+// Creates the symbolic link name in the directory with the given inode, storing target as it is
+extern int ext2_symlink(unsigned int parent_inode_num, char *name, const char *target);
+
+// Removes the file or link at file_path, or with recursive set, the directory there and everything below it
+extern int ext2_rm(int recursive, const char *file_path);
+
+// Restores the removed file or link at file_path
+extern int ext2_restore(const char *file_path);
+
+// Restores every removed file and link that still can be in the tree under dir_path, scanning it only once.
+// With list_only set, prints each one found and whether it can be restored instead
+extern int ext2_restore_all(const char *dir_path, int list_only);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,19 +10,29 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include "ext2_util.h"
+#include "ext2_htree.h"
+#include "ext2_journal.h"
 
 unsigned char *disk;
+size_t disk_size;
+int disk_fd;
 struct ext2_super_block *sb;
 struct ext2_group_desc *bgdt;
-char *block_bitmap;
-char *inode_bitmap;
-struct ext2_inode *inode_table;
+unsigned int group_count;
+unsigned int block_size;
+static unsigned int inode_size;
+// The block right after the last one allocated, where the next search for a free block starts
+static unsigned int block_cursor;
+// One bit for every block of the mapping changed since the last flush_disk, and how many blocks the mapping covers
+static char *dirty_blocks;
+static unsigned int mapped_blocks;
 
 void split_parent_path_and_target(char *path, char *target) {
   char *last_slash;
-  // handle the case with '/'s at the end
-  while(path[strlen(path) - 1] == '/') {
+  // handle the case with '/'s at the end, stopping at an empty path for one that is all '/'s
+  while(path[0] != '\0' && path[strlen(path) - 1] == '/') {
     path[strlen(path) - 1] = '\0';
   }
   if((last_slash = strrchr(path,  '/')) != NULL) {
@@ -34,21 +45,253 @@ void split_parent_path_and_target(char *path, char *target) {
 
 /**
  * Initializes the disk structure reading in from the file at the
- * given path. Fails if unable read in disk file to memory.
+ * given path. The whole image is mapped, so images of any size and
+ * with any number of block groups can be used. A shared mapping writes
+ * changes through to the file, a private one keeps them in this process.
+ * Fails if unable read in disk file to memory.
 **/
-void init_disk(const char *image_file) {
-  int fd = open(image_file, O_RDWR);
-  disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+static void map_disk(const char *image_file, int shared) {
+  int fd = open(image_file, shared ? O_RDWR : O_RDONLY);
+  if(fd == -1) {
+    perror("open");
+    exit(1);
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    perror("fstat");
+    exit(1);
+  }
+  disk_size = st.st_size;
+  if(disk_size < EXT2_SUPERBLOCK_OFFSET + sizeof(struct ext2_super_block)) {
+    fprintf(stderr, "Image too small to hold a superblock\n");
+    exit(1);
+  }
+
+  disk = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
   if(disk == MAP_FAILED) {
     perror("mmap");
     exit(1);
   }
+  // Read-only users go through the metadata front to back, so read ahead aggressively
+  if(!shared) {
+    madvise(disk, disk_size, MADV_SEQUENTIAL);
+  }
+  // Kept open so data can be moved into the image without going through user space
+  disk_fd = fd;
+
+  sb = (struct ext2_super_block *)(disk + EXT2_SUPERBLOCK_OFFSET);
+  if(sb->s_log_block_size > 2) {
+    fprintf(stderr, "Unsupported block size\n");
+    exit(1);
+  }
+  block_size = EXT2_BLOCK_SIZE(sb);
+  if(sb->s_blocks_per_group == 0 || sb->s_inodes_per_group == 0 || block(sb->s_blocks_count) > disk_size) {
+    fprintf(stderr, "Image does not match its superblock\n");
+    exit(1);
+  }
+
+  // The group descriptor table starts in the block right after the superblock
+  bgdt = (struct ext2_group_desc *)(disk + block(sb->s_first_data_block + 1));
+  group_count = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+  inode_size = sb->s_rev_level == 0 ? sizeof(struct ext2_inode) : sb->s_inode_size;
+  block_cursor = sb->s_first_data_block;
+  mapped_blocks = (disk_size + block_size - 1) / block_size;
+  // Rounded up to whole 64-bit words for the bitmap functions
+  if((dirty_blocks = calloc((mapped_blocks + 63) / 64, sizeof(uint64_t))) == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+}
+
+void init_disk(const char *image_file) {
+  map_disk(image_file, 1);
+  // Undo whatever a tool that died part way through left behind before anything reads the image
+  journal_recover(image_file);
+}
+
+/**
+ * Initializes the disk structure without ever writing to the image, so read-only images and images in use
+ * by other tools can be inspected. The file is opened read-only and mapped privately: anything changed
+ * through disk is copied into this process on first write and never reaches the file, and no undo log is
+ * kept or replayed.
+**/
+void init_disk_readonly(const char *image_file) {
+  map_disk(image_file, 0);
+}
+
+/**
+ * Writes every change made through the mapping back to the image file and waits for it to land.
+ * Only the runs of blocks marked dirty are msynced, each widened to whole pages, so the cost follows
+ * the size of the change rather than the size of the image. On Linux msync also writes back data
+ * put into those blocks through disk_fd, so blocks filled by import_blocks only need marking too.
+ * Returns 0 on success, or -1 on error.
+**/
+int flush_disk() {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  int first = bitmap_find_one(dirty_blocks, 0, mapped_blocks);
+
+  while(first != -1) {
+    int end = bitmap_find_zero(dirty_blocks, first, mapped_blocks);
+    if(end == -1) {
+      end = mapped_blocks;
+    }
+    size_t start = block(first) / page_size * page_size;
+    size_t stop = block(end) < disk_size ? block(end) : disk_size;
+    if(msync(disk + start, stop - start, MS_SYNC) == -1) {
+      perror("msync");
+      return -1;
+    }
+    bitmap_clear_range(dirty_blocks, first, end - first);
+    first = bitmap_find_one(dirty_blocks, end, mapped_blocks);
+  }
+  return 0;
+}
+
+void mark_dirty(const void *ptr, size_t len) {
+  size_t offset = (const unsigned char *)ptr - disk;
+  if(len == 0 || offset >= disk_size) {
+    return;
+  }
+  unsigned int first = offset / block_size;
+  unsigned int last = (offset + len - 1) / block_size;
+  bitmap_set_range(dirty_blocks, first, (last < mapped_blocks ? last : mapped_blocks - 1) - first + 1);
+}
+
+void mark_blocks_dirty(unsigned int first, unsigned int count) {
+  mark_dirty(disk + block(first), (size_t)count * block_size);
+}
+
+/**
+ * Removes every occurrence of option from argv, shifting the arguments after it down, so tools can
+ * take options such as --sync anywhere on the command line. Returns 1 if the option was given, otherwise 0.
+**/
+int take_option(int *argc, char const *argv[], const char *option) {
+  int found = 0;
+  int kept = 1;
+  for(int i = 1; i < *argc; i++) {
+    if(strcmp(argv[i], option) == 0) {
+      found = 1;
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+  return found;
+}
+
+const char *take_option_value(int *argc, char const *argv[], const char *option) {
+  const char *value = NULL;
+  int kept = 1;
+  for(int i = 1; i < *argc; i++) {
+    if(strcmp(argv[i], option) == 0 && i + 1 < *argc) {
+      value = argv[++i];
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+  return value;
+}
+
+/**
+ * Copies len bytes starting at src_offset of the host file src_fd into the image, starting at the given block.
+ * The kernel moves the data straight into the image file with copy_file_range. The image is mapped shared, so
+ * the copied data is visible through disk right away. When the two files can't be used with copy_file_range the
+ * data is read straight into the mapping with pread instead, which still avoids an intermediate buffer.
+ * Returns the number of bytes copied, which is short only at the end of the source file, or -1 on error.
+**/
+ssize_t import_blocks(int src_fd, off_t src_offset, unsigned int block_num, size_t len) {
+  size_t copied = 0;
+  loff_t in_offset = src_offset;
+  loff_t out_offset = block(block_num);
+
+  while(copied < len) {
+    ssize_t ret = copy_file_range(src_fd, &in_offset, disk_fd, &out_offset, len - copied, 0);
+    if(ret == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      break;
+    }
+    if(ret == -1) {
+      return -1;
+    }
+    if(ret == 0) {
+      return copied;
+    }
+    copied += ret;
+  }
 
-  sb = (struct ext2_super_block *)(disk + 1024);
-  bgdt = (struct ext2_group_desc *)(disk + 1024 + EXT2_BLOCK_SIZE);
-  block_bitmap = (char *)(disk + block(bgdt->bg_block_bitmap));
-  inode_bitmap = (char *)(disk + block(bgdt->bg_inode_bitmap));
-  inode_table = (struct ext2_inode *)(disk + block(bgdt->bg_inode_table));
+  while(copied < len) {
+    ssize_t ret = pread(src_fd, disk + block(block_num) + copied, len - copied, src_offset + copied);
+    if(ret == -1 && errno != EINTR) {
+      return -1;
+    }
+    if(ret == 0) {
+      break;
+    }
+    if(ret > 0) {
+      copied += ret;
+    }
+  }
+  return copied;
+}
+
+/**
+ * Returns the block group that holds the given block.
+**/
+unsigned int block_group(unsigned int block_num) {
+  return (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+/**
+ * Returns the block group that holds the given inode.
+**/
+unsigned int inode_group(unsigned int inode_num) {
+  return (inode_num - 1) / sb->s_inodes_per_group;
+}
+
+unsigned int group_first_block(unsigned int group) {
+  return sb->s_first_data_block + group * sb->s_blocks_per_group;
+}
+
+/**
+ * Returns the number of blocks covered by the given group. Every group but the last holds
+ * s_blocks_per_group blocks, the last one holds whatever is left over.
+**/
+unsigned int group_blocks_count(unsigned int group) {
+  unsigned int first = group_first_block(group);
+  if(sb->s_blocks_count - first < sb->s_blocks_per_group) {
+    return sb->s_blocks_count - first;
+  }
+  return sb->s_blocks_per_group;
+}
+
+char *get_block_bitmap(unsigned int group) {
+  return (char *)(disk + block(bgdt[group].bg_block_bitmap));
+}
+
+char *get_inode_bitmap(unsigned int group) {
+  return (char *)(disk + block(bgdt[group].bg_inode_bitmap));
+}
+
+/**
+ * Returns a pointer to the inode with the given number, looked up in the inode table of its group.
+**/
+struct ext2_inode *get_inode(unsigned int inode_num) {
+  unsigned int group = inode_group(inode_num);
+  unsigned int index = (inode_num - 1) % sb->s_inodes_per_group;
+  return (struct ext2_inode *)(disk + block(bgdt[group].bg_inode_table) + (size_t)index * inode_size);
+}
+
+int block_in_use(unsigned int block_num) {
+  unsigned int bit = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+  return (get_block_bitmap(block_group(block_num))[bit / 8] >> (bit % 8)) & 1;
+}
+
+int inode_in_use(unsigned int inode_num) {
+  unsigned int bit = (inode_num - 1) % sb->s_inodes_per_group;
+  return (get_inode_bitmap(inode_group(inode_num))[bit / 8] >> (bit % 8)) & 1;
 }
 
 /**
@@ -64,205 +307,896 @@ struct ext2_dir_entry *find_oversized_entry(int size, unsigned int block_num, st
 
   int cur_len = start_cur;
 
-  while (cur_len < EXT2_BLOCK_SIZE) {
+  while (cur_len < block_size) {
     dir_entry = (struct ext2_dir_entry *)(disk + block(block_num) + cur_len);
 
-    // align it to the next size that is a multiple 4
-    int size = ((sizeof(struct ext2_dir_entry) + dir_entry->name_len + 3) / 4) * 4;
-    int leftover_size = dir_entry->rec_len - size;
+    // align it to the next size that is a multiple 4, an unused entry is free space as a whole
+    int entry_size = dir_entry->inode != 0 ? ((sizeof(struct ext2_dir_entry) + dir_entry->name_len + 3) / 4) * 4 : 0;
+    int leftover_size = dir_entry->rec_len - entry_size;
 
     if (leftover_size >= size) {
       return dir_entry;
     }
-    cur_len = cur_len + size;
+    if (dir_entry->rec_len == 0) {
+      break;
+    }
+    cur_len = cur_len + dir_entry->rec_len;
   }
   return NULL;
 }
 
 /**
- * Initialize and insert a directory entry into the given block.
+ * Initialize and insert a directory entry into the given block, in the first space big enough for it: the slack
+ * after an entry, or an unused entry.
  * Return a pointer to the directory entry if it succeeds, or NULL if there is no space for the directory entry.
 **/
 struct ext2_dir_entry *insert_dir_entry_into_block(struct ext2_inode *inode, unsigned int new_inode_id, unsigned int block_num, char *filename, int type) {
-  // find the last entry
-  int cur_len = 0;
-  struct ext2_dir_entry *cur_dir;
+  int required_size = ((sizeof(struct ext2_dir_entry) + strlen(filename) + 3) / 4) * 4;
+  struct ext2_dir_entry *cur_dir = find_oversized_entry(required_size, block_num, (struct ext2_dir_entry *)(disk + block(block_num)));
   struct ext2_dir_entry *new_dir;
 
-  while (cur_len < EXT2_BLOCK_SIZE) {
-    cur_dir = (struct ext2_dir_entry *)(disk + block(block_num) + cur_len);
-    cur_len += cur_dir->rec_len;
+  if (cur_dir == NULL) {
+    return NULL;
+  }
+  journal_block(block_num);
+  if (cur_dir->inode == 0) {
+    initialize_dir_entry(cur_dir, filename, type, new_inode_id, cur_dir->rec_len);
+    return cur_dir;
   }
   int cur_dir_size = ((sizeof(struct ext2_dir_entry) + cur_dir->name_len + 3) / 4) * 4;
   new_dir = (struct ext2_dir_entry *)((unsigned char *)cur_dir + cur_dir_size);
-  int leftover_size = cur_dir->rec_len - cur_dir_size;
-  int required_size = ((sizeof(struct ext2_dir_entry) + strlen(filename) + 3) / 4) * 4;
-  if (required_size <= leftover_size) {
-    initialize_dir_entry(new_dir, filename, type, new_inode_id, leftover_size);
-    cur_dir->rec_len = cur_dir_size;
-    return new_dir;
+  initialize_dir_entry(new_dir, filename, type, new_inode_id, cur_dir->rec_len - cur_dir_size);
+  cur_dir->rec_len = cur_dir_size;
+  return new_dir;
+}
+
+/**
+ * Appends a new, uninitialized block to the directory with the given inode, along with any indirect blocks
+ * needed to map it, placing it right after the current last block when possible.
+ * Returns the new block, or 0 if there is no space for it.
+**/
+unsigned int add_dir_block(struct ext2_inode *inode) {
+  unsigned int count = inode_logical_blocks(inode);
+  unsigned int last_block_num = count > 0 ? get_inode_block(inode, count - 1) : 0;
+  unsigned int blocks[TRIPLE_INDIRECT_BLOCK_IDX - INDIRECT_BLOCK_IDX + 2];
+  unsigned int needed = indirect_blocks_needed(count + 1) - indirect_blocks_needed(count) + 1;
+
+  if (reserve_blocks(last_block_num + 1, needed, blocks) == -1) {
+    return 0;
   }
-  return NULL;
+  unsigned int used = 0;
+  unsigned int new_block = map_inode_block(inode, count, blocks, &used);
+  if (new_block == 0) {
+    release_blocks(needed, blocks);
+    return 0;
+  }
+  journal_access(inode, sizeof(struct ext2_inode));
+  inode->i_size = inode->i_size + block_size;
+  return new_block;
 }
 
-struct ext2_dir_entry *insert_dir_entry(unsigned int inode_id, unsigned int new_inode_id, char *filename, int type) {
-  struct ext2_inode *inode = &inode_table[inode_id-1];
+static void dspace_append(unsigned int dir_inode_num, unsigned int block_num);
+
+// Whether a full single block directory gets a hash index instead of a second block, see index_growing_dirs
+static int index_dirs;
+
+void index_growing_dirs(int enabled) {
+  index_dirs = enabled;
+}
+
+/**
+ * Insert a directory entry into the directory with the given inode. Directories with a hash index get the entry
+ * in the leaf its hash belongs to. Otherwise the entry goes into the first block the free space tracker finds
+ * room in, and the directory grows by a block if there is none. A directory is only given an index of its own
+ * when the tool was asked to with index_growing_dirs.
+ * Return a pointer to the new directory entry, or NULL if there is no space for it.
+**/
+static struct ext2_dir_entry *insert_dir_entry_uncached(unsigned int inode_id, unsigned int new_inode_id, char *filename, int type) {
+  struct ext2_inode *inode = get_inode(inode_id);
   struct ext2_dir_entry *new_dir;
 
-  unsigned int last_block_num = inode->i_block[(inode->i_blocks / (2 << sb->s_log_block_size)) -1];
-  // The last block is a direct block
-  if ((inode->i_blocks / (2 << sb->s_log_block_size)) < 13) {
-    new_dir = insert_dir_entry_into_block(inode, new_inode_id, last_block_num, filename, type);
-    if (new_dir != NULL) {
+  if (dx_is_indexed(inode)) {
+    if ((new_dir = dx_insert_entry(inode, new_inode_id, filename, type)) != NULL) {
       return new_dir;
     }
+    // The index couldn't take the entry, fall back to treating the directory as a linear one
+    dx_drop_index(inode);
   }
 
-  // The last block is an indirect block
-  else {
-    unsigned int *indirect_block = (unsigned int *)(disk + block(last_block_num));
+  // Reuse space left by removed entries anywhere in the directory before growing it
+  if ((new_dir = dspace_insert(inode_id, new_inode_id, filename, type)) != NULL) {
+    return new_dir;
+  }
 
-    int count = 0;
-    while (count < (int)(EXT2_BLOCK_SIZE/sizeof(int))) {
-      if (indirect_block[count] > 0) {
-        new_dir = insert_dir_entry_into_block(inode, new_inode_id, indirect_block[count], filename, type);
-        if (new_dir != NULL) {
-          return new_dir;
-        }
-      }
-      count += 1;
-    }
+  unsigned int count = inode_logical_blocks(inode);
+
+  // A full single block directory gets a hash index instead of a second linear block, if the tool asked for one
+  if (index_dirs && count == 1 && dx_index_dir(inode) == 0) {
+    return dx_insert_entry(inode, new_inode_id, filename, type);
   }
 
-  // Failed to insert into the existing last block, need to allocate a new block
-  unsigned int new_block = find_available_block();
-  // Check if a free block exists
+  // Failed to insert into the existing last block, need to allocate a new block, preferably right after it
+  unsigned int new_block = add_dir_block(inode);
   if (new_block == 0) {
     return NULL;
   }
+  new_dir = (struct ext2_dir_entry *)(disk + block(new_block));
+  initialize_dir_entry(new_dir, filename, type, new_inode_id, block_size);
+  dspace_append(inode_id, new_block);
+  return new_dir;
+}
 
-  //currently have less than 12 blocks, the new one will be a direct block
-  else if (inode->i_blocks / (2 << sb->s_log_block_size) < 12) {
-    new_dir = (struct ext2_dir_entry *)(disk + block(new_block));
-    initialize_dir_entry(new_dir, filename, type, new_inode_id, EXT2_BLOCK_SIZE);
+/**
+ * Insert a directory entry as above, keeping the dentry cache up to date.
+**/
+struct ext2_dir_entry *insert_dir_entry(unsigned int inode_id, unsigned int new_inode_id, char *filename, int type) {
+  struct ext2_dir_entry *new_dir = insert_dir_entry_uncached(inode_id, new_inode_id, filename, type);
+  if (new_dir != NULL) {
+    dcache_insert(inode_id, filename, new_inode_id);
+  }
+  return new_dir;
+}
 
-    allocate_block(new_block);
-    inode->i_blocks = inode->i_blocks + (2 << sb->s_log_block_size);
-    inode->i_block[inode->i_blocks / (2 << sb->s_log_block_size)] = new_block;
-    inode->i_size = inode->i_size + EXT2_BLOCK_SIZE;
-    return new_dir;
+/**
+ * Returns the number of logical blocks in the given inode's data, holes included.
+ * Fast symlinks keep their target in i_block and have no blocks at all.
+**/
+unsigned int inode_logical_blocks(struct ext2_inode *inode) {
+  if ((inode->i_mode & 0xF000) == EXT2_S_IFLNK && inode->i_blocks == 0) {
+    return 0;
+  }
+  return (inode->i_size + block_size - 1) / block_size;
+}
+
+/**
+ * Splits a logical block number into the index in i_block to start from and the index to follow in each level
+ * of indirect blocks below it. Returns the number of levels of indirection, or -1 if the block can't be mapped.
+**/
+static int block_path(unsigned int logical, unsigned int *path) {
+  unsigned int ppb = POINTERS_PER_BLOCK;
+
+  if (logical < INDIRECT_BLOCK_IDX) {
+    path[0] = logical;
+    return 0;
+  }
+  logical -= INDIRECT_BLOCK_IDX;
+  if (logical < ppb) {
+    path[0] = INDIRECT_BLOCK_IDX;
+    path[1] = logical;
+    return 1;
+  }
+  logical -= ppb;
+  if (logical < ppb * ppb) {
+    path[0] = DOUBLE_INDIRECT_BLOCK_IDX;
+    path[1] = logical / ppb;
+    path[2] = logical % ppb;
+    return 2;
   }
-  // currently have 12 or more blocks, new one will be a indirect block
-  else {
-    unsigned int new_inner_block = find_available_block();
-    if (new_inner_block == 0) {
+  logical -= ppb * ppb;
+  if (logical / ppb / ppb < ppb) {
+    path[0] = TRIPLE_INDIRECT_BLOCK_IDX;
+    path[1] = logical / ppb / ppb;
+    path[2] = (logical / ppb) % ppb;
+    path[3] = logical % ppb;
+    return 3;
+  }
+  return -1;
+}
+
+/**
+ * Follows the path of the given logical block down to the indirect block holding its pointer.
+ * Returns the pointers of that indirect block, or NULL if it is a hole or the block is mapped directly.
+**/
+static unsigned int *get_leaf_block(struct ext2_inode *inode, unsigned int *path, int depth) {
+  unsigned int block_num = inode->i_block[path[0]];
+  for (int level = 1; level <= depth; level++) {
+    if (block_num == 0 || block_num >= sb->s_blocks_count) {
       return NULL;
     }
-    unsigned int *indirect_block = (unsigned int *)(disk + block(new_block));
-    memset(indirect_block, 0, EXT2_BLOCK_SIZE);
-    indirect_block[0] = new_inner_block;
+    if (level == depth) {
+      return (unsigned int *)(disk + block(block_num));
+    }
+    block_num = ((unsigned int *)(disk + block(block_num)))[path[level]];
+  }
+  return NULL;
+}
+
+/**
+ * Returns the physical block holding the given logical block of the inode, or 0 if it is a hole.
+**/
+unsigned int get_inode_block(struct ext2_inode *inode, unsigned int logical) {
+  unsigned int path[4];
+  unsigned int block_num;
+  int depth = block_path(logical, path);
 
-    new_dir = (struct ext2_dir_entry *)(disk + block(new_inner_block));
-    initialize_dir_entry(new_dir, filename, type, new_inode_id, EXT2_BLOCK_SIZE);
+  if (depth == -1) {
+    return 0;
+  } else if (depth == 0) {
+    block_num = inode->i_block[path[0]];
+  } else {
+    unsigned int *leaf = get_leaf_block(inode, path, depth);
+    block_num = leaf != NULL ? leaf[path[depth]] : 0;
+  }
+  return block_num < sb->s_blocks_count ? block_num : 0;
+}
 
-    allocate_block(new_block);
-    allocate_block(new_inner_block);
-    inode->i_blocks = inode->i_blocks + (2 << sb->s_log_block_size) * 2;
-    inode->i_block[inode->i_blocks / (2 << sb->s_log_block_size)] = new_block;
-    inode->i_size = inode->i_size + EXT2_BLOCK_SIZE * 2;
+/**
+ * Returns the number of indirect blocks needed to map the first count logical blocks of a file.
+**/
+unsigned int indirect_blocks_needed(unsigned int count) {
+  unsigned int ppb = POINTERS_PER_BLOCK;
+  unsigned int needed = 0;
 
-    return new_dir;
+  if (count <= INDIRECT_BLOCK_IDX) {
+    return 0;
   }
-  return NULL;
+  count -= INDIRECT_BLOCK_IDX;
+  needed += 1;
+  if (count <= ppb) {
+    return needed;
+  }
+  count -= ppb;
+  if (count <= ppb * ppb) {
+    return needed + 1 + (count + ppb - 1) / ppb;
+  }
+  needed += 1 + ppb;
+  count -= ppb * ppb;
+  return needed + 1 + (count + ppb * ppb - 1) / (ppb * ppb) + (count + ppb - 1) / ppb;
+}
+
+/**
+ * Returns the number of indirect blocks needed to map the count given logical blocks, listed in increasing order.
+ * An indirect block is needed for every distinct path prefix, so holes between the blocks need none of their own.
+**/
+unsigned int indirect_blocks_needed_sparse(const unsigned int *logical, unsigned int count) {
+  unsigned int path[4];
+  unsigned int prev_path[4];
+  int prev_depth = -1;
+  unsigned int needed = 0;
+
+  for (unsigned int i = 0; i < count; i++) {
+    int depth = block_path(logical[i], path);
+    // The indirect blocks on the way are shared with the previous block as long as the path agrees with its path
+    int shared = 0;
+    if (depth == prev_depth) {
+      while (shared < depth && path[shared] == prev_path[shared]) {
+        shared++;
+      }
+    }
+    if (depth > 0) {
+      needed += depth - shared;
+    }
+    memcpy(prev_path, path, sizeof(path));
+    prev_depth = depth;
+  }
+  return needed;
 }
 
+/**
+ * Maps the given logical block of the inode to a new block taken from blocks[*used]. Any indirect block missing
+ * on the way is taken from blocks first, cleared and linked in, so blocks laid out in the order they are consumed
+ * keep each indirect block right before the data it maps. *used is advanced past every block consumed and
+ * i_blocks accounts for them. Returns the new data block, or 0 if the logical block is beyond the triple indirect range.
+**/
+unsigned int map_inode_block(struct ext2_inode *inode, unsigned int logical, unsigned int *blocks, unsigned int *used) {
+  unsigned int path[4];
+  int depth = block_path(logical, path);
+  if (depth == -1) {
+    return 0;
+  }
+
+  journal_access(inode, sizeof(struct ext2_inode));
+  unsigned int *slot = &inode->i_block[path[0]];
+  for (int level = 1; level <= depth; level++) {
+    if (*slot == 0) {
+      journal_access(slot, sizeof(*slot));
+      *slot = blocks[(*used)++];
+      memset(disk + block(*slot), 0, block_size);
+      inode->i_blocks += 2 << sb->s_log_block_size;
+    }
+    slot = &((unsigned int *)(disk + block(*slot)))[path[level]];
+  }
+  journal_access(slot, sizeof(*slot));
+  *slot = blocks[(*used)++];
+  inode->i_blocks += 2 << sb->s_log_block_size;
+  return *slot;
+}
 
 /**
- * Find the first available inode in the inode bitmap and return its number.
+ * Prepares iter to walk the data blocks of the given inode in logical order.
 **/
-unsigned int find_available_inode() {
-  for(int byte = 0; byte < (int)sb->s_inodes_count/8; byte++) {
-    for(int bit = 0; bit < 8; bit++) {
-      unsigned char inode_index = inode_bitmap[byte] & (1 << bit);
-      inode_index >>= bit;
-      if (!inode_index) {
-        return byte * 8 + bit + 1;
+void block_iter_init(struct block_iter *iter, struct ext2_inode *inode) {
+  iter->inode = inode;
+  iter->next = 0;
+  iter->count = inode_logical_blocks(inode);
+  iter->leaf = NULL;
+  iter->leaf_first = 0;
+  iter->leaf_end = 0;
+}
+
+/**
+ * Stores the physical blocks of up to n of the inode's next logical blocks in blocks, 0 for holes.
+ * The indirect block last used is remembered, so walking a whole file only follows each path once.
+ * Returns the number of blocks stored, 0 once the end of the file is reached.
+**/
+int block_iter_next(struct block_iter *iter, unsigned int *blocks, int n) {
+  int stored = 0;
+  unsigned int path[4];
+
+  while (stored < n && iter->next < iter->count) {
+    unsigned int logical = iter->next++;
+    unsigned int block_num;
+
+    if (logical < INDIRECT_BLOCK_IDX) {
+      block_num = iter->inode->i_block[logical];
+    } else {
+      if (logical < iter->leaf_first || logical >= iter->leaf_end) {
+        int depth = block_path(logical, path);
+        if (depth == -1) {
+          iter->count = logical;
+          break;
+        }
+        iter->leaf = get_leaf_block(iter->inode, path, depth);
+        iter->leaf_first = logical - path[depth];
+        iter->leaf_end = iter->leaf_first + POINTERS_PER_BLOCK;
+      }
+      block_num = iter->leaf != NULL ? iter->leaf[logical - iter->leaf_first] : 0;
+    }
+    blocks[stored++] = block_num < sb->s_blocks_count ? block_num : 0;
+  }
+  return stored;
+}
+
+/**
+ * Visits the given indirect block and every block below it. The block maps the logical blocks from first onwards,
+ * each of its pointers covering span of them, and anything at or beyond count is outside the file.
+**/
+static int visit_indirect_block(unsigned int block_num, unsigned int span, unsigned int first, unsigned int count,
+    int (*visit)(unsigned int block_num, void *arg), void *arg) {
+  int ret;
+  if (block_num == 0 || block_num >= sb->s_blocks_count || first >= count) {
+    return 0;
+  }
+  if ((ret = visit(block_num, arg)) != 0) {
+    return ret;
+  }
+
+  unsigned int *pointers = (unsigned int *)(disk + block(block_num));
+  for (unsigned int i = 0; i < POINTERS_PER_BLOCK && first + i * span < count; i++) {
+    if (span == 1) {
+      if (pointers[i] != 0 && pointers[i] < sb->s_blocks_count && (ret = visit(pointers[i], arg)) != 0) {
+        return ret;
       }
+    } else if ((ret = visit_indirect_block(pointers[i], span / POINTERS_PER_BLOCK, first + i * span, count, visit, arg)) != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Calls visit on every block owned by the inode, indirect blocks included, skipping holes.
+ * Each indirect block is visited before the blocks it points to. Stops as soon as visit returns
+ * non-zero and returns that value, otherwise returns 0.
+**/
+int for_each_inode_block(struct ext2_inode *inode, int (*visit)(unsigned int block_num, void *arg), void *arg) {
+  unsigned int count = inode_logical_blocks(inode);
+  unsigned int ppb = POINTERS_PER_BLOCK;
+  int ret;
+
+  for (unsigned int i = 0; i < INDIRECT_BLOCK_IDX && i < count; i++) {
+    if (inode->i_block[i] != 0 && inode->i_block[i] < sb->s_blocks_count && (ret = visit(inode->i_block[i], arg)) != 0) {
+      return ret;
+    }
+  }
+  unsigned int first = INDIRECT_BLOCK_IDX;
+  if ((ret = visit_indirect_block(inode->i_block[INDIRECT_BLOCK_IDX], 1, first, count, visit, arg)) != 0) {
+    return ret;
+  }
+  first += ppb;
+  if ((ret = visit_indirect_block(inode->i_block[DOUBLE_INDIRECT_BLOCK_IDX], ppb, first, count, visit, arg)) != 0) {
+    return ret;
+  }
+  first += ppb * ppb;
+  return visit_indirect_block(inode->i_block[TRIPLE_INDIRECT_BLOCK_IDX], ppb * ppb, first, count, visit, arg);
+}
+
+/*
+ * The blocks truncate_inode_blocks lets go of, freed together once the walk is done.
+ */
+struct truncation {
+  unsigned int *blocks;
+  unsigned int count;
+  unsigned int capacity;
+};
+
+static int truncation_visitor(unsigned int block_num, void *arg) {
+  struct truncation *truncation = arg;
+  if (truncation->count == truncation->capacity) {
+    truncation->capacity = truncation->capacity ? truncation->capacity * 2 : 64;
+    truncation->blocks = realloc(truncation->blocks, sizeof(unsigned int) * truncation->capacity);
+  }
+  truncation->blocks[truncation->count++] = block_num;
+  return 0;
+}
+
+/**
+ * Cuts what the pointer at slot maps back to the logical blocks before keep. The pointer maps the logical blocks
+ * from first onwards, and is a data block when span is 0, otherwise an indirect block whose pointers each cover
+ * span of them. Anything at or beyond count is outside the file.
+**/
+static void truncate_slot(unsigned int *slot, unsigned int span, unsigned int first, unsigned int keep, unsigned int count,
+    struct truncation *truncation) {
+  if (*slot == 0 || *slot >= sb->s_blocks_count) {
+    return;
+  }
+  if (first >= keep) {
+    if (span == 0 || first >= count) {
+      truncation_visitor(*slot, truncation);
+    } else {
+      visit_indirect_block(*slot, span, first, count, truncation_visitor, truncation);
+    }
+    journal_access(slot, sizeof(unsigned int));
+    *slot = 0;
+    return;
+  }
+  if (span == 0) {
+    return;
+  }
+
+  unsigned int *pointers = (unsigned int *)(disk + block(*slot));
+  for (unsigned int i = 0; i < POINTERS_PER_BLOCK && first + i * span < count; i++) {
+    if (first + (i + 1) * span > keep) {
+      truncate_slot(&pointers[i], span == 1 ? 0 : span / POINTERS_PER_BLOCK, first + i * span, keep, count, truncation);
+    }
+  }
+}
+
+void truncate_inode_blocks(struct ext2_inode *inode, unsigned int keep) {
+  struct truncation truncation = {NULL, 0, 0};
+  unsigned int count = inode_logical_blocks(inode);
+  unsigned int ppb = POINTERS_PER_BLOCK;
+
+  for (unsigned int i = keep; i < INDIRECT_BLOCK_IDX && i < count; i++) {
+    truncate_slot(&inode->i_block[i], 0, i, keep, count, &truncation);
+  }
+  unsigned int first = INDIRECT_BLOCK_IDX;
+  truncate_slot(&inode->i_block[INDIRECT_BLOCK_IDX], 1, first, keep, count, &truncation);
+  first += ppb;
+  truncate_slot(&inode->i_block[DOUBLE_INDIRECT_BLOCK_IDX], ppb, first, keep, count, &truncation);
+  first += ppb * ppb;
+  truncate_slot(&inode->i_block[TRIPLE_INDIRECT_BLOCK_IDX], ppb * ppb, first, keep, count, &truncation);
+
+  if (truncation.count > 0) {
+    journal_access(inode, sizeof(struct ext2_inode));
+    inode->i_blocks = inode->i_blocks - truncation.count * (2 << sb->s_log_block_size);
+    deallocate_blocks(truncation.blocks, truncation.count);
+  }
+  free(truncation.blocks);
+}
+
+/**
+ * Loads the given 64-bit word of a bitmap. Bitmaps are little endian, so bit i of the
+ * word is bit i % 8 of byte i / 8, the same order the byte-wise code uses.
+**/
+static inline uint64_t bitmap_word(const char *bitmap, unsigned int word) {
+  uint64_t bits;
+  memcpy(&bits, bitmap + (size_t)word * sizeof(bits), sizeof(bits));
+  return bits;
+}
+
+/**
+ * Returns the index of the first bit in [start, nbits) equal to value, or -1 if there is none.
+ * Whole words without a match are skipped with a single comparison.
+**/
+static int bitmap_find_bit(const char *bitmap, unsigned int start, unsigned int nbits, int value) {
+  uint64_t invert = value ? 0 : ~(uint64_t)0;
+
+  if (start >= nbits) {
+    return -1;
+  }
+  unsigned int word = start / 64;
+  // Ignore the bits before start in the first word
+  uint64_t bits = (bitmap_word(bitmap, word) ^ invert) & (~(uint64_t)0 << (start % 64));
+  while (bits == 0) {
+    word++;
+    if ((size_t)word * 64 >= nbits) {
+      return -1;
+    }
+    bits = bitmap_word(bitmap, word) ^ invert;
+  }
+
+  unsigned int bit = word * 64 + __builtin_ctzll(bits);
+  return bit < nbits ? (int)bit : -1;
+}
+
+int bitmap_find_zero(const char *bitmap, unsigned int start, unsigned int nbits) {
+  return bitmap_find_bit(bitmap, start, nbits, 0);
+}
+
+int bitmap_find_one(const char *bitmap, unsigned int start, unsigned int nbits) {
+  return bitmap_find_bit(bitmap, start, nbits, 1);
+}
+
+/**
+ * Returns the number of set bits in [start, nbits), a word at a time with popcount.
+**/
+unsigned int bitmap_count(const char *bitmap, unsigned int start, unsigned int nbits) {
+  if (start >= nbits) {
+    return 0;
+  }
+  unsigned int first = start / 64;
+  unsigned int last = (nbits - 1) / 64;
+  unsigned int count = 0;
+
+  for (unsigned int word = first; word <= last; word++) {
+    uint64_t bits = bitmap_word(bitmap, word);
+    if (word == first) {
+      bits &= ~(uint64_t)0 << (start % 64);
+    }
+    if (word == last && nbits % 64 != 0) {
+      bits &= ~(uint64_t)0 >> (64 - nbits % 64);
+    }
+    count += __builtin_popcountll(bits);
+  }
+  return count;
+}
+
+/**
+ * Sets or clears the len bits starting at start, a word at a time.
+ * Returns how many bits actually changed.
+**/
+static unsigned int bitmap_update_range(char *bitmap, unsigned int start, unsigned int len, int value) {
+  unsigned int end = start + len;
+  unsigned int changed = 0;
+
+  while (start < end) {
+    unsigned int word = start / 64;
+    unsigned int shift = start % 64;
+    unsigned int n = end - start < 64 - shift ? end - start : 64 - shift;
+    uint64_t mask = (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << shift;
+    uint64_t bits = bitmap_word(bitmap, word);
+
+    if (value) {
+      changed += __builtin_popcountll(mask & ~bits);
+      bits |= mask;
+    } else {
+      changed += __builtin_popcountll(mask & bits);
+      bits &= ~mask;
+    }
+    memcpy(bitmap + (size_t)word * sizeof(bits), &bits, sizeof(bits));
+    start += n;
+  }
+  return changed;
+}
+
+unsigned int bitmap_set_range(char *bitmap, unsigned int start, unsigned int len) {
+  return bitmap_update_range(bitmap, start, len, 1);
+}
+
+unsigned int bitmap_clear_range(char *bitmap, unsigned int start, unsigned int len) {
+  return bitmap_update_range(bitmap, start, len, 0);
+}
+
+/**
+ * Finds the first run of len clear bits in [start, nbits) by hopping between the first clear
+ * bit and the next set bit after it. Returns the index of the run's first bit, or -1.
+**/
+int bitmap_find_zero_run(const char *bitmap, unsigned int start, unsigned int nbits, unsigned int len) {
+  int run_start = bitmap_find_zero(bitmap, start, nbits);
+  while (run_start != -1 && (unsigned int)run_start + len <= nbits) {
+    int run_end = bitmap_find_one(bitmap, run_start, run_start + len);
+    if (run_end == -1) {
+      return run_start;
+    }
+    run_start = bitmap_find_zero(bitmap, run_end, nbits);
+  }
+  return -1;
+}
+
+/**
+ * Find the first available inode in the inode bitmaps, group by group, and return its number.
+**/
+unsigned int find_available_inode() {
+  for(unsigned int group = 0; group < group_count; group++) {
+    if(bgdt[group].bg_free_inodes_count == 0) {
+      continue;
+    }
+    int bit = bitmap_find_zero(get_inode_bitmap(group), 0, sb->s_inodes_per_group);
+    if(bit != -1) {
+      return group * sb->s_inodes_per_group + bit + 1;
     }
   }
   return 0;
 }
 
 /**
- * Find the first available block in the block bitmap and return its number.
+ * Find the first available block at or after the allocation cursor and return its number.
 **/
 unsigned int find_available_block() {
-  for(int byte = 0; byte < (int)sb->s_blocks_count/8; byte++) {
-    for(int bit = 0; bit < 8; bit++) {
-      unsigned char block_num = block_bitmap[byte] & (1 << bit);
-      block_num >>= bit;
-      if (!block_num) {
-        return byte * 8 + bit + 1;
+  return find_available_block_run(block_cursor, 1);
+}
+
+/**
+ * Find the first available block at or after goal and return its number. Passing the block
+ * after the previous one of the same file keeps files contiguous.
+**/
+unsigned int find_available_block_near(unsigned int goal) {
+  return find_available_block_run(goal, 1);
+}
+
+/**
+ * Find the first run of count free blocks that lies within a single block group, starting at goal
+ * and wrapping around to the start of the image, and return the number of its first block.
+ * An out of range goal searches from the allocation cursor instead.
+**/
+unsigned int find_available_block_run(unsigned int goal, unsigned int count) {
+  if(goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+    goal = block_cursor;
+  }
+  unsigned int goal_group = block_group(goal);
+
+  // The goal's group is searched from the goal first, and from its start again once every other group has been tried
+  for(unsigned int i = 0; i <= group_count; i++) {
+    unsigned int group = (goal_group + i) % group_count;
+    unsigned int start = i == 0 ? goal - group_first_block(group) : 0;
+    if(bgdt[group].bg_free_blocks_count < count) {
+      continue;
+    }
+    int bit = bitmap_find_zero_run(get_block_bitmap(group), start, group_blocks_count(group), count);
+    if(bit != -1) {
+      return group_first_block(group) + bit;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reserve count free blocks, searching from goal and wrapping around the image like find_available_block_near.
+ * Bits are set as they are found and each counter is updated once, instead of once per block.
+ * If the bitmaps hold fewer free blocks than the counters claim, the partial reservation is released again.
+ * Returns 0 on success, or -1 if count blocks cannot be reserved.
+**/
+int reserve_blocks(unsigned int goal, unsigned int count, unsigned int *blocks) {
+  if(count > sb->s_free_blocks_count) {
+    return -1;
+  }
+  if(goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+    goal = block_cursor;
+  }
+  unsigned int goal_group = block_group(goal);
+  unsigned int reserved = 0;
+
+  for(unsigned int i = 0; i <= group_count && reserved < count; i++) {
+    unsigned int group = (goal_group + i) % group_count;
+    unsigned int start = i == 0 ? goal - group_first_block(group) : 0;
+    unsigned int group_reserved = 0;
+    char *bitmap = get_block_bitmap(group);
+    int bit;
+
+    if(bgdt[group].bg_free_blocks_count == 0) {
+      continue;
+    }
+    // Take whole runs of free blocks at a time
+    while(reserved < count && (bit = bitmap_find_zero(bitmap, start, group_blocks_count(group))) != -1) {
+      int run_end = bitmap_find_one(bitmap, bit, group_blocks_count(group));
+      unsigned int run = (run_end == -1 ? group_blocks_count(group) : (unsigned int)run_end) - bit;
+      if(run > count - reserved) {
+        run = count - reserved;
+      }
+      journal_block(bgdt[group].bg_block_bitmap);
+      bitmap_set_range(bitmap, bit, run);
+      journal_new_blocks(group_first_block(group) + bit, run);
+      for(unsigned int j = 0; j < run; j++) {
+        blocks[reserved++] = group_first_block(group) + bit + j;
       }
+      group_reserved += run;
+      start = bit + run;
     }
+    bgdt[group].bg_free_blocks_count = bgdt[group].bg_free_blocks_count - group_reserved;
+  }
+  sb->s_free_blocks_count = sb->s_free_blocks_count - reserved;
+
+  if(reserved < count) {
+    release_blocks(reserved, blocks);
+    return -1;
+  }
+  if(count > 0) {
+    block_cursor = blocks[count - 1] + 1 < sb->s_blocks_count ? blocks[count - 1] + 1 : sb->s_first_data_block;
   }
   return 0;
 }
 
 /**
- * Allocate a block in the block bitmap and decrement the free blocks count in the block group and superblock.
+ * Release blocks previously reserved with reserve_blocks, clearing each run of consecutive blocks at once.
 **/
-void allocate_block(unsigned int block_num) {
-  //set corresponding bit in block bitmap to 1
-  char *block_index = block_bitmap + ((block_num - 1)/ 8);
-  *block_index |= (1 << ((block_num - 1) % 8));
+void release_blocks(unsigned int count, unsigned int *blocks) {
+  unsigned int i = 0;
+  while(i < count) {
+    unsigned int run = 1;
+    while(i + run < count && blocks[i + run] == blocks[i] + run) {
+      run++;
+    }
+    deallocate_block_run(blocks[i], run);
+    i += run;
+  }
+}
+
+/**
+ * Sets or clears count blocks starting at first, one block group at a time, and moves the free counters
+ * by the number of blocks whose bit actually changed.
+**/
+static void update_block_run(unsigned int first, unsigned int count, int used) {
+  while(count > 0) {
+    unsigned int group = block_group(first);
+    unsigned int bit = first - group_first_block(group);
+    unsigned int n = group_blocks_count(group) - bit < count ? group_blocks_count(group) - bit : count;
+
+    journal_block(bgdt[group].bg_block_bitmap);
+    if(used) {
+      unsigned int changed = bitmap_set_range(get_block_bitmap(group), bit, n);
+      sb->s_free_blocks_count = sb->s_free_blocks_count - changed;
+      bgdt[group].bg_free_blocks_count = bgdt[group].bg_free_blocks_count - changed;
+      // Blocks that were in use already may hold data that still has to be logged before it changes
+      if(changed == n) {
+        journal_new_blocks(first, n);
+      }
+    } else {
+      unsigned int changed = bitmap_clear_range(get_block_bitmap(group), bit, n);
+      journal_freed_blocks(first, n);
+      sb->s_free_blocks_count = sb->s_free_blocks_count + changed;
+      bgdt[group].bg_free_blocks_count = bgdt[group].bg_free_blocks_count + changed;
+    }
+    first += n;
+    count -= n;
+  }
+}
+
+void allocate_block_run(unsigned int first, unsigned int count) {
+  update_block_run(first, count, 1);
+}
 
-  sb->s_free_blocks_count = sb->s_free_blocks_count - 1;
-  bgdt->bg_free_blocks_count = bgdt->bg_free_blocks_count - 1;
+void deallocate_block_run(unsigned int first, unsigned int count) {
+  update_block_run(first, count, 0);
 }
 
 /**
- * Allocate a inode in the inode bitmap and decrement the free inodes count in the block descriptor group and superblock.
+ * Returns how many of the count blocks starting at first are marked as used, counting a block group at a time.
+**/
+unsigned int blocks_in_use(unsigned int first, unsigned int count) {
+  unsigned int used = 0;
+  while(count > 0) {
+    unsigned int group = block_group(first);
+    unsigned int bit = first - group_first_block(group);
+    unsigned int n = group_blocks_count(group) - bit < count ? group_blocks_count(group) - bit : count;
+
+    used += bitmap_count(get_block_bitmap(group), bit, bit + n);
+    first += n;
+    count -= n;
+  }
+  return used;
+}
+
+/**
+ * Allocate a block in its group's block bitmap and decrement the free blocks count in the block group and superblock.
+**/
+void allocate_block(unsigned int block_num) {
+  allocate_block_run(block_num, 1);
+  block_cursor = block_num + 1 < sb->s_blocks_count ? block_num + 1 : sb->s_first_data_block;
+}
+
+/**
+ * Allocate a inode in its group's inode bitmap and decrement the free inodes count in the block descriptor group and superblock.
 **/
 void allocate_inode(unsigned int inode_num) {
   // set corresponding bit in inode bitmap to 1
-  char *inode_index = inode_bitmap + ((inode_num - 1)/ 8);
-  *inode_index |= (1 << ((inode_num - 1) % 8));
+  unsigned int group = inode_group(inode_num);
+  unsigned int bit = (inode_num - 1) % sb->s_inodes_per_group;
+  journal_block(bgdt[group].bg_inode_bitmap);
+  get_inode_bitmap(group)[bit / 8] |= (1 << (bit % 8));
 
   sb->s_free_inodes_count = sb->s_free_inodes_count - 1;
-  bgdt->bg_free_inodes_count = bgdt->bg_free_inodes_count - 1;
+  bgdt[group].bg_free_inodes_count = bgdt[group].bg_free_inodes_count - 1;
 }
 
 /**
- * Deallocate a inode in the inode bitmap and increment the free inodes count in the block descriptor group and superblock.
+ * Deallocate a inode in its group's inode bitmap and increment the free inodes count in the block descriptor group and superblock.
 **/
 void deallocate_inode(unsigned int inode_num) {
-  char *inode_index = inode_bitmap + ((inode_num - 1)/ 8);
-  *inode_index &= ~(1 << ((inode_num - 1) % 8));
+  unsigned int group = inode_group(inode_num);
+  unsigned int bit = (inode_num - 1) % sb->s_inodes_per_group;
+  journal_block(bgdt[group].bg_inode_bitmap);
+  get_inode_bitmap(group)[bit / 8] &= ~(1 << (bit % 8));
 
   sb->s_free_inodes_count = sb->s_free_inodes_count + 1;
-  bgdt->bg_free_inodes_count = bgdt->bg_free_inodes_count + 1;
+  bgdt[group].bg_free_inodes_count = bgdt[group].bg_free_inodes_count + 1;
 }
 
 /**
- * Deallocate a block in the block bitmap and increment the free blocks count in the block descriptor group and superblock.
+ * Deallocate a block in its group's block bitmap and increment the free blocks count in the block descriptor group and superblock.
 **/
 void deallocate_block(unsigned int block_num) {
   if (block_num != 0) {
-     char *block_index = block_bitmap + ((block_num-1) / 8);
-    *block_index &= ~(1 << ((block_num-1) % 8));
+    deallocate_block_run(block_num, 1);
+  }
+}
+
+static int compare_numbers(const void *a, const void *b) {
+  unsigned int num_a = *(const unsigned int *)a;
+  unsigned int num_b = *(const unsigned int *)b;
+  return num_a < num_b ? -1 : num_a > num_b;
+}
+
+/**
+ * Sorts the blocks and clears them from the bitmaps a run of consecutive blocks at a time. The free counters of
+ * each group are moved once for all its blocks, and the superblock's once at the end.
+**/
+void deallocate_blocks(unsigned int *blocks, unsigned int count) {
+  unsigned int freed = 0;
+  unsigned int i = 0;
 
-    sb->s_free_blocks_count = sb->s_free_blocks_count + 1;
-    bgdt->bg_free_blocks_count = bgdt->bg_free_blocks_count + 1;
+  qsort(blocks, count, sizeof(unsigned int), compare_numbers);
+  while(i < count) {
+    unsigned int group = block_group(blocks[i]);
+    unsigned int group_end = group_first_block(group) + group_blocks_count(group);
+    unsigned int group_freed = 0;
+
+    journal_block(bgdt[group].bg_block_bitmap);
+    while(i < count && blocks[i] < group_end) {
+      // Extend the run over the blocks that carry on from it, skipping repeats
+      unsigned int first = blocks[i];
+      unsigned int end = first + 1;
+      for(i++; i < count && blocks[i] <= end && blocks[i] < group_end; i++) {
+        if(blocks[i] == end) {
+          end++;
+        }
+      }
+      group_freed += bitmap_clear_range(get_block_bitmap(group), first - group_first_block(group), end - first);
+      journal_freed_blocks(first, end - first);
+    }
+    bgdt[group].bg_free_blocks_count = bgdt[group].bg_free_blocks_count + group_freed;
+    freed += group_freed;
   }
+  sb->s_free_blocks_count = sb->s_free_blocks_count + freed;
+}
+
+/**
+ * Sorts the inodes and clears them from the inode bitmaps. The free inode and used directory counters of each
+ * group are moved once for all its inodes, and the superblock's once at the end.
+**/
+void deallocate_inodes(unsigned int *inodes, unsigned int count) {
+  unsigned int freed = 0;
+  unsigned int i = 0;
+
+  qsort(inodes, count, sizeof(unsigned int), compare_numbers);
+  while(i < count) {
+    unsigned int group = inode_group(inodes[i]);
+    unsigned int group_freed = 0;
+    unsigned int dirs = 0;
+
+    journal_block(bgdt[group].bg_inode_bitmap);
+    for(; i < count && inode_group(inodes[i]) == group; i++) {
+      if(i > 0 && inodes[i] == inodes[i - 1]) {
+        continue;
+      }
+      unsigned int bit = (inodes[i] - 1) % sb->s_inodes_per_group;
+      group_freed += bitmap_clear_range(get_inode_bitmap(group), bit, 1);
+      dirs += (get_inode(inodes[i])->i_mode & 0xF000) == EXT2_S_IFDIR;
+    }
+    bgdt[group].bg_free_inodes_count = bgdt[group].bg_free_inodes_count + group_freed;
+    bgdt[group].bg_used_dirs_count = bgdt[group].bg_used_dirs_count - dirs;
+    freed += group_freed;
+  }
+  sb->s_free_inodes_count = sb->s_free_inodes_count + freed;
 }
 
 /**
  * Initialize the inode at the given inode number.
 **/
 void initialize_inode(unsigned int inode_num, unsigned short type) {
-  struct ext2_inode *inode = &inode_table[inode_num - 1];
+  struct ext2_inode *inode = get_inode(inode_num);
 
+  journal_access(inode, sizeof(struct ext2_inode));
   inode->i_uid = 0;
   inode->i_size = 0;
   inode->i_blocks = 0;
@@ -308,63 +1242,370 @@ void initialize_dir_entry(struct ext2_dir_entry *dir_entry, char *filename, int
 int find_dir_in_block(int block, char *name) {
   struct ext2_dir_entry *directory = (struct ext2_dir_entry *)(disk + block(block));
   int i = 0;
-  while(i < EXT2_BLOCK_SIZE && directory->rec_len != 0) {
+  while(i < block_size && directory->rec_len != 0) {
     if(directory->inode != 0 && directory->name_len == strlen(name) && strncmp(name, directory->name, directory->name_len) == 0) {
       return directory->inode;
     }
 
     i += directory->rec_len;
-    if(i < EXT2_BLOCK_SIZE) {
+    if(i < block_size) {
       directory = (struct ext2_dir_entry *)(disk + block(block) + i);
     }
   }
   return 0;
 }
 
+/**
+ * A cached result of looking a name up in a directory. An inode of 0 records that the name is not there.
+**/
+struct dentry {
+  unsigned int parent;
+  unsigned int inode;
+  struct dentry *next;
+  char name[];
+};
+
+#define DCACHE_BUCKETS 4096
+// Past this many entries the cache is emptied instead of growing further
+#define DCACHE_MAX_ENTRIES 65536
+
+static struct dentry *dcache[DCACHE_BUCKETS];
+static unsigned int dcache_entries;
+
+static unsigned int dcache_bucket(unsigned int parent, const char *name) {
+  // FNV-1a over the parent inode and the name
+  unsigned int hash = 2166136261u ^ parent;
+  for (const char *c = name; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  return hash % DCACHE_BUCKETS;
+}
+
+static struct dentry *dcache_find(unsigned int parent, const char *name) {
+  for (struct dentry *entry = dcache[dcache_bucket(parent, name)]; entry != NULL; entry = entry->next) {
+    if (entry->parent == parent && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Returns the cached inode for name in the directory parent, 0 if the name is cached as missing,
+ * or -1 if nothing is cached for it.
+**/
+int dcache_lookup(unsigned int parent, const char *name) {
+  struct dentry *entry = dcache_find(parent, name);
+  return entry != NULL ? (int)entry->inode : -1;
+}
+
+/**
+ * Records that name in the directory parent refers to inode, or that it doesn't exist if inode is 0.
+**/
+void dcache_insert(unsigned int parent, const char *name, unsigned int inode) {
+  struct dentry *entry = dcache_find(parent, name);
+  if (entry != NULL) {
+    entry->inode = inode;
+    return;
+  }
+  if (dcache_entries >= DCACHE_MAX_ENTRIES) {
+    dcache_clear();
+  }
+  if ((entry = malloc(sizeof(struct dentry) + strlen(name) + 1)) == NULL) {
+    return;
+  }
+  unsigned int bucket = dcache_bucket(parent, name);
+  entry->parent = parent;
+  entry->inode = inode;
+  strcpy(entry->name, name);
+  entry->next = dcache[bucket];
+  dcache[bucket] = entry;
+  dcache_entries++;
+}
+
+/**
+ * Forgets whatever is cached for name in the directory parent.
+**/
+void dcache_remove(unsigned int parent, const char *name) {
+  struct dentry **link = &dcache[dcache_bucket(parent, name)];
+  while (*link != NULL) {
+    if ((*link)->parent == parent && strcmp((*link)->name, name) == 0) {
+      struct dentry *entry = *link;
+      *link = entry->next;
+      free(entry);
+      dcache_entries--;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+/**
+ * Empties the cache.
+**/
+void dcache_clear() {
+  for (int i = 0; i < DCACHE_BUCKETS; i++) {
+    while (dcache[i] != NULL) {
+      struct dentry *entry = dcache[i];
+      dcache[i] = entry->next;
+      free(entry);
+    }
+  }
+  dcache_entries = 0;
+}
+
+/**
+ * What a run knows about the free space in a linear directory: the largest space an entry could be put in, in
+ * each of its blocks. Holes only grow when an entry is removed, which has to be reported, so the sizes are never
+ * too small. They may be too large after changes made without telling the tracker, which inserts put right.
+**/
+struct dir_space {
+  unsigned int dir;
+  unsigned int count;            // logical blocks tracked, the directory's size when it was scanned
+  unsigned int capacity;
+  unsigned int *blocks;          // physical block of each logical block
+  unsigned short *largest;       // largest hole in each block
+  unsigned int max_largest;      // no block has a hole bigger than this
+  struct dir_space *next;
+};
+
+#define DSPACE_BUCKETS 256
+// Past this many directories the tracker is emptied instead of growing further
+#define DSPACE_MAX_DIRS 4096
+
+static struct dir_space *dspace[DSPACE_BUCKETS];
+static unsigned int dspace_dirs;
+
+/**
+ * Returns the size of the largest entry that fits in the given directory block.
+**/
+static unsigned int block_largest_hole(unsigned int block_num) {
+  unsigned int largest = 0;
+  for (unsigned int offset = 0; offset < block_size;) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + block(block_num) + offset);
+    if (entry->rec_len == 0) {
+      break;
+    }
+    unsigned int used = entry->inode != 0 ? ((sizeof(struct ext2_dir_entry) + entry->name_len + 3) / 4) * 4 : 0;
+    if (entry->rec_len > used && entry->rec_len - used > largest) {
+      largest = entry->rec_len - used;
+    }
+    offset += entry->rec_len;
+  }
+  return largest;
+}
+
+static struct dir_space *dspace_find(unsigned int dir) {
+  for (struct dir_space *space = dspace[dir % DSPACE_BUCKETS]; space != NULL; space = space->next) {
+    if (space->dir == dir) {
+      return space;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Sets the largest hole of the given logical block from the block itself.
+**/
+static void dspace_measure(struct dir_space *space, unsigned int logical) {
+  space->largest[logical] = space->blocks[logical] != 0 ? block_largest_hole(space->blocks[logical]) : 0;
+  if (space->largest[logical] > space->max_largest) {
+    space->max_largest = space->largest[logical];
+  }
+}
+
+/**
+ * Returns the tracker for the linear directory, scanning its blocks if it isn't tracked or has changed size
+ * since it was. Returns NULL if it can't be tracked.
+**/
+static struct dir_space *dspace_get(unsigned int dir_inode_num) {
+  struct ext2_inode *dir = get_inode(dir_inode_num);
+  unsigned int count = inode_logical_blocks(dir);
+  struct dir_space *space = dspace_find(dir_inode_num);
+
+  if (space != NULL && space->count == count) {
+    return space;
+  }
+  if (space == NULL) {
+    if (dspace_dirs >= DSPACE_MAX_DIRS) {
+      dspace_clear();
+    }
+    if ((space = calloc(1, sizeof(struct dir_space))) == NULL) {
+      return NULL;
+    }
+    space->dir = dir_inode_num;
+    space->next = dspace[dir_inode_num % DSPACE_BUCKETS];
+    dspace[dir_inode_num % DSPACE_BUCKETS] = space;
+    dspace_dirs++;
+  }
+  if (count > space->capacity) {
+    space->capacity = count + 16;
+    space->blocks = realloc(space->blocks, sizeof(unsigned int) * space->capacity);
+    space->largest = realloc(space->largest, sizeof(unsigned short) * space->capacity);
+  }
+
+  struct block_iter iter;
+  unsigned int logical = 0;
+  int n;
+  space->count = count;
+  space->max_largest = 0;
+  block_iter_init(&iter, dir);
+  while ((n = block_iter_next(&iter, space->blocks + logical, count - logical)) > 0) {
+    logical += n;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    dspace_measure(space, i);
+  }
+  return space;
+}
+
+struct ext2_dir_entry *dspace_insert(unsigned int dir_inode_num, unsigned int new_inode_id, char *filename, int type) {
+  unsigned int required_size = ((sizeof(struct ext2_dir_entry) + strlen(filename) + 3) / 4) * 4;
+  struct dir_space *space = dspace_get(dir_inode_num);
+  struct ext2_dir_entry *new_dir;
+
+  // The common case of a directory without room anywhere is answered without looking at any block
+  if (space == NULL || space->max_largest < required_size) {
+    return NULL;
+  }
+
+  unsigned int max_largest = 0;
+  for (unsigned int i = 0; i < space->count; i++) {
+    if (space->largest[i] >= required_size) {
+      new_dir = insert_dir_entry_into_block(get_inode(dir_inode_num), new_inode_id, space->blocks[i], filename, type);
+      dspace_measure(space, i);
+      if (new_dir != NULL) {
+        return new_dir;
+      }
+    }
+    if (space->largest[i] > max_largest) {
+      max_largest = space->largest[i];
+    }
+  }
+  // Every block was looked at, so the bound is exact now
+  space->max_largest = max_largest;
+  return NULL;
+}
+
+/**
+ * Tracks the block just added to the end of the directory, so growing it doesn't take a rescan.
+**/
+static void dspace_append(unsigned int dir_inode_num, unsigned int block_num) {
+  struct dir_space *space = dspace_find(dir_inode_num);
+  if (space == NULL || space->count + 1 != inode_logical_blocks(get_inode(dir_inode_num))) {
+    return;
+  }
+  if (space->count == space->capacity) {
+    space->capacity = space->capacity * 2 + 16;
+    space->blocks = realloc(space->blocks, sizeof(unsigned int) * space->capacity);
+    space->largest = realloc(space->largest, sizeof(unsigned short) * space->capacity);
+  }
+  space->blocks[space->count] = block_num;
+  dspace_measure(space, space->count++);
+}
+
+void dspace_block_changed(unsigned int dir_inode_num, unsigned int block_num) {
+  struct dir_space *space = dspace_find(dir_inode_num);
+  if (space == NULL) {
+    return;
+  }
+  // A directory that grew is rescanned the next time it is used
+  for (unsigned int i = 0; i < space->count; i++) {
+    if (space->blocks[i] == block_num) {
+      dspace_measure(space, i);
+      return;
+    }
+  }
+}
+
+void dspace_forget(unsigned int dir_inode_num) {
+  struct dir_space **link = &dspace[dir_inode_num % DSPACE_BUCKETS];
+  while (*link != NULL) {
+    if ((*link)->dir == dir_inode_num) {
+      struct dir_space *space = *link;
+      *link = space->next;
+      free(space->blocks);
+      free(space->largest);
+      free(space);
+      dspace_dirs--;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+void dspace_clear() {
+  for (int i = 0; i < DSPACE_BUCKETS; i++) {
+    while (dspace[i] != NULL) {
+      struct dir_space *space = dspace[i];
+      dspace[i] = space->next;
+      free(space->blocks);
+      free(space->largest);
+      free(space);
+    }
+  }
+  dspace_dirs = 0;
+}
+
 /**
  * Takes in the inode_index to search and name of directory_entry to search for.
  * Returns the index of the found inode if one is found, otherwise returns 0.
 **/
 int find_next_inode(int inode_index, char *name) {
-  struct ext2_inode *inode = &inode_table[inode_index - 1];
+  struct ext2_inode *inode = get_inode(inode_index);
+  struct block_iter iter;
+  unsigned int blocks[BLOCK_ITER_BATCH];
   int ret;
+  int n;
   if(name == NULL) {
      return inode_index;
   }
-  for(int i = 0; i < (int)inode->i_blocks/(2 << sb->s_log_block_size); i++) {
-    if(i < INDIRECT_BLOCK_IDX) {
-      ret = find_dir_in_block(inode->i_block[i], name);
-    } else {
-      for(int j = 0; j < (int)(EXT2_BLOCK_SIZE/sizeof(int)) && ret == 0; j++) {
-        ret = find_dir_in_block(((int *)&inode->i_block[i])[j], name);
+  if((ret = dcache_lookup(inode_index, name)) != -1) {
+    return ret;
+  }
+
+  // Use the hash index to go straight to the right block when the directory has one
+  long dx_block = dx_find_block(inode, name);
+  if(dx_block != -1) {
+    ret = dx_block != 0 ? find_dir_in_block(dx_block, name) : 0;
+    dcache_insert(inode_index, name, ret);
+    return ret;
+  }
+
+  block_iter_init(&iter, inode);
+  while((n = block_iter_next(&iter, blocks, BLOCK_ITER_BATCH)) > 0) {
+    for(int i = 0; i < n; i++) {
+      if(blocks[i] != 0 && (ret = find_dir_in_block(blocks[i], name))) {
+        dcache_insert(inode_index, name, ret);
+        return ret;
       }
     }
-    if(ret) {
-      return ret;
-    }
   }
+  dcache_insert(inode_index, name, 0);
   return 0;
 }
 
 /**
  * traverses from the given node down the given path as long as it's a directory. DO NOT PASS A PATH THAT POINTS TO A FILE, use the split_parent_path_and_target function to separate the potential file from it's directory.
+ * Each component is looked up with find_next_inode, so prefixes walked before come from the dentry cache.
  * Returns the inode index of the last entry, 0 if it fails in anyway
 **/
 int traverse_path(int inode_index, char *path) {
-  int next_inode;
+  char *saveptr;
   if(path == NULL) {
     return inode_index;
   }
-  char *token;
-  token = strtok(path, DIRECTORY_MARKER);
-  if(token == NULL) { // If token is null that means that we've been given the current directory so just return that.
-    return inode_index;
-  }
-  if((next_inode = find_next_inode(inode_index, token)) && inode_table[next_inode - 1].i_mode & EXT2_S_IFDIR) {
-    return traverse_path(next_inode, strtok(NULL, ""));
-  } else if(strtok(NULL, "") == NULL) { 
-    return next_inode;
-  } else {
-    return 0;
+  // If there is no token that means that we've been given the current directory so just return that.
+  char *token = strtok_r(path, DIRECTORY_MARKER, &saveptr);
+  while(token != NULL) {
+    int next_inode = find_next_inode(inode_index, token);
+    char *next_token = strtok_r(NULL, DIRECTORY_MARKER, &saveptr);
+    if(next_inode == 0 || !(get_inode(next_inode)->i_mode & EXT2_S_IFDIR)) {
+      // Only the last entry of the path may be missing or something other than a directory
+      return next_token == NULL ? next_inode : 0;
+    }
+    inode_index = next_inode;
+    token = next_token;
   }
+  return inode_index;
 }
@@ -1,34 +1,187 @@
+#include <sys/types.h>
 #include "ext2.h"
 
 #define DIRECTORY_MARKER "/"
 
 #define INDIRECT_BLOCK_IDX 12
+#define DOUBLE_INDIRECT_BLOCK_IDX 13
+#define TRIPLE_INDIRECT_BLOCK_IDX 14
+
+// Number of block pointers held by an indirect block
+#define POINTERS_PER_BLOCK (block_size / sizeof(unsigned int))
+
+// A good number of blocks to ask block_iter_next for at a time
+#define BLOCK_ITER_BATCH 64
 
 extern unsigned char *disk;
+extern size_t disk_size;
+extern int disk_fd;
 extern struct ext2_super_block *sb;
+// The group descriptor table, indexed by block group number
 extern struct ext2_group_desc *bgdt;
-extern char *block_bitmap;
-extern char *inode_bitmap;
-extern struct ext2_inode *inode_table;
+extern unsigned int group_count;
+// The image's block size, read from the superblock: 1024, 2048 or 4096
+extern unsigned int block_size;
 
-#define block(block_number) ((block_number) * (EXT2_BLOCK_SIZE))
+#define block(block_number) ((size_t)(block_number) * block_size)
 
 
 extern void init_disk(const char *image_file);
 
+// Maps the image without ever writing to it: changes made through disk stay in this process
+extern void init_disk_readonly(const char *image_file);
+
+// Writes every change made through the mapping back to the image file, only msyncing the blocks marked dirty.
+// Returns 0 on success, -1 on error
+extern int flush_disk();
+
+// Marks the blocks covering len bytes of the mapping starting at ptr as changed, so flush_disk writes them back
+extern void mark_dirty(const void *ptr, size_t len);
+
+// Marks count blocks starting at first as changed
+extern void mark_blocks_dirty(unsigned int first, unsigned int count);
+
+// Removes every occurrence of the given option from argv. Returns 1 if it was there, otherwise 0
+extern int take_option(int *argc, char const *argv[], const char *option);
+
+// Removes the given option and the argument after it from argv. Returns that argument, or NULL if the option isn't
+// there or nothing follows it
+extern const char *take_option_value(int *argc, char const *argv[], const char *option);
+
+// Copies len bytes at src_offset of the host file src_fd into the image, starting at the given block.
+// Returns the number of bytes copied, or -1 on error
+extern ssize_t import_blocks(int src_fd, off_t src_offset, unsigned int block_num, size_t len);
+
+//--- Functions for locating per-group metadata ---
+
+// Returns the block group that holds the given block
+extern unsigned int block_group(unsigned int block_num);
+
+// Returns the block group that holds the given inode
+extern unsigned int inode_group(unsigned int inode_num);
+
+// Returns the number of the first block covered by the given group
+extern unsigned int group_first_block(unsigned int group);
+
+// Returns the number of blocks covered by the given group, the last group may be short
+extern unsigned int group_blocks_count(unsigned int group);
+
+// Returns the block bitmap of the given group
+extern char *get_block_bitmap(unsigned int group);
+
+// Returns the inode bitmap of the given group
+extern char *get_inode_bitmap(unsigned int group);
+
+// Returns a pointer to the inode with the given number in its group's inode table
+extern struct ext2_inode *get_inode(unsigned int inode_num);
+
+// Returns 1 if the given block is marked as used in its group's block bitmap, otherwise 0
+extern int block_in_use(unsigned int block_num);
+
+// Returns 1 if the given inode is marked as used in its group's inode bitmap, otherwise 0
+extern int inode_in_use(unsigned int inode_num);
+
+//--- Functions for mapping an inode's logical blocks to physical blocks ---
+
+// Walks the data blocks of an inode in logical order, across the direct, single, double and triple indirect blocks
+struct block_iter {
+  struct ext2_inode *inode;
+  unsigned int next;         // next logical block to return
+  unsigned int count;        // number of logical blocks in the file
+  unsigned int *leaf;        // pointers of the indirect block mapping [leaf_first, leaf_end), NULL for a hole
+  unsigned int leaf_first;
+  unsigned int leaf_end;
+};
+
+// Returns the number of logical blocks in the inode's data, based on its size
+extern unsigned int inode_logical_blocks(struct ext2_inode *inode);
+
+// Returns the physical block holding the given logical block of the inode, or 0 if it is a hole
+extern unsigned int get_inode_block(struct ext2_inode *inode, unsigned int logical);
+
+// Starts walking the data blocks of the given inode
+extern void block_iter_init(struct block_iter *iter, struct ext2_inode *inode);
+
+// Stores the physical blocks of up to n of the next logical blocks in blocks, 0 for holes. Returns how many were stored, 0 at the end of the file
+extern int block_iter_next(struct block_iter *iter, unsigned int *blocks, int n);
+
+// Calls visit on every block owned by the inode, indirect blocks included. Stops and returns visit's result if it is non-zero
+extern int for_each_inode_block(struct ext2_inode *inode, int (*visit)(unsigned int block_num, void *arg), void *arg);
+
+// Returns the number of indirect blocks needed to map the first count logical blocks of a file
+extern unsigned int indirect_blocks_needed(unsigned int count);
+
+// Returns the number of indirect blocks needed to map the given logical blocks, listed in increasing order, leaving holes between them
+extern unsigned int indirect_blocks_needed_sparse(const unsigned int *logical, unsigned int count);
+
+// Frees the blocks mapping logical blocks at or after keep, and the indirect blocks left with nothing to map, lowering
+// i_blocks to match. Setting i_size is left to the caller
+extern void truncate_inode_blocks(struct ext2_inode *inode, unsigned int keep);
+
+// Maps the given logical block to blocks[*used], taking any indirect block needed on the way from blocks first. Returns the data block, 0 if out of range
+extern unsigned int map_inode_block(struct ext2_inode *inode, unsigned int logical, unsigned int *blocks, unsigned int *used);
+
+//--- Functions for searching and updating bitmaps ---
+// Bitmaps are handled a 64-bit word at a time, so the buffer backing a bitmap of nbits bits must be readable,
+// and writable when it is updated, up to the next multiple of 8 bytes. On-disk bitmaps always are, as they fill a whole block.
+
+// Returns the number of set bits in [start, nbits)
+extern unsigned int bitmap_count(const char *bitmap, unsigned int start, unsigned int nbits);
+
+// Sets the len bits starting at start. Returns how many of them were clear before
+extern unsigned int bitmap_set_range(char *bitmap, unsigned int start, unsigned int len);
+
+// Clears the len bits starting at start. Returns how many of them were set before
+extern unsigned int bitmap_clear_range(char *bitmap, unsigned int start, unsigned int len);
+
+// Returns the index of the first clear bit in [start, nbits), or -1 if every bit is set
+extern int bitmap_find_zero(const char *bitmap, unsigned int start, unsigned int nbits);
+
+// Returns the index of the first set bit in [start, nbits), or -1 if every bit is clear
+extern int bitmap_find_one(const char *bitmap, unsigned int start, unsigned int nbits);
+
+// Returns the index of the first run of len clear bits in [start, nbits), or -1 if there is no such run
+extern int bitmap_find_zero_run(const char *bitmap, unsigned int start, unsigned int nbits, unsigned int len);
+
 //--- Functions for writing to the File system ---
 
 extern struct ext2_dir_entry *insert_dir_entry(unsigned int inode_id, unsigned int new_inode_id, char *filename, int type);
 
+// Lets insert_dir_entry give a full single block directory a hash index instead of a second block, on images with
+// the dir_index feature. Off unless a tool is run with --index: it changes the directory's on-disk format
+extern void index_growing_dirs(int enabled);
+
 // Finds the next avaliable free inode in the inode bitmap
 extern unsigned int find_available_inode();
 
-// Finds the next avaliable free block in the block bitmap
+// Finds the next avaliable free block in the block bitmap, starting from the allocation cursor
 extern unsigned int find_available_block();
 
+// Finds the first free block at or after goal, wrapping around the image, returns 0 if no block is free
+extern unsigned int find_available_block_near(unsigned int goal);
+
+// Finds count contiguous free blocks within one block group at or after goal and returns the first of them, 0 if there is no such run
+extern unsigned int find_available_block_run(unsigned int goal, unsigned int count);
+
+// Reserves count free blocks at or after goal, marking them used and updating the free counters in one pass.
+// The block numbers are stored in blocks. Returns 0 on success, or -1 with nothing reserved if there aren't enough free blocks
+extern int reserve_blocks(unsigned int goal, unsigned int count, unsigned int *blocks);
+
+// Unsets count blocks previously returned by reserve_blocks in the block bitmap
+extern void release_blocks(unsigned int count, unsigned int *blocks);
+
 // Sets the given block as used in the block bitmap
 extern void allocate_block(unsigned int block_ind);
 
+// Sets count blocks starting at first as used, which may span block groups. Only blocks that were free change the free counters
+extern void allocate_block_run(unsigned int first, unsigned int count);
+
+// Unsets count blocks starting at first as used, which may span block groups. Only blocks that were used change the free counters
+extern void deallocate_block_run(unsigned int first, unsigned int count);
+
+// Returns how many of the count blocks starting at first are marked as used
+extern unsigned int blocks_in_use(unsigned int first, unsigned int count);
+
 // Sets the given inode as used in the inode bitmap
 extern void allocate_inode(unsigned int inode_ind);
 
@@ -38,10 +191,20 @@ extern void deallocate_inode(unsigned int inode_num);
 // Unset the given block as used in the block bitmap
 extern void deallocate_block(unsigned int block_ind);
 
-// Tries to insert a directory entry of given name and inode into the given block, returns 0 if it's unsuccessful
+// Unsets count blocks in any order in the block bitmaps, updating the free counters once per group. Sorts blocks
+extern void deallocate_blocks(unsigned int *blocks, unsigned int count);
+
+// Unsets count inodes in any order in the inode bitmaps, updating the free and directory counters once per group. Sorts inodes
+extern void deallocate_inodes(unsigned int *inodes, unsigned int count);
+
+// Appends a new block to the given directory inode and returns it, 0 if there is no space
+extern unsigned int add_dir_block(struct ext2_inode *inode);
+
+// Tries to insert a directory entry of given name and inode into the first space in the given block it fits in, returns 0 if it's unsuccessful
 extern struct ext2_dir_entry *insert_dir_entry_into_block(struct ext2_inode *inode, unsigned int new_inode_id, unsigned int block_num, char *filename, int type);
 
-// Returns a pointer to an oversized directory entry with size or more extra space. Return NULL if no oversized entry fitting this exists.
+// Returns a pointer to an oversized directory entry with size or more extra space, counting an unused entry as free space as a whole.
+// Return NULL if no oversized entry fitting this exists.
 extern struct ext2_dir_entry *find_oversized_entry(int size, unsigned int block_num, struct ext2_dir_entry *start_dir);
 
 //Searches the given block index for a directory entry for the name. Returns the inode index if found, otherwise 0.
@@ -62,5 +225,35 @@ extern void split_parent_path_and_target(char *path, char *target);
 // Searches for the name in the directory entry of the given inode, returns the index of the inode referenced by that directory entry if found, otherwise returns 0.
 extern int find_next_inode(int inode_index, char *name);
 
-// Given a path and a start inode, this function will try to traverse the path recursively starting at the given inode. Returns the last found inode index if the path is valid, otherwise returns 0.
+//--- Dentry cache, remembering lookups of (directory inode, name) pairs, misses included ---
+// find_next_inode and insert_dir_entry keep it up to date, code that changes directory entries by hand must too
+
+// Returns the cached inode for name in parent, 0 if it is cached as missing, or -1 if nothing is cached
+extern int dcache_lookup(unsigned int parent, const char *name);
+
+// Caches that name in parent refers to inode, or that it doesn't exist if inode is 0
+extern void dcache_insert(unsigned int parent, const char *name, unsigned int inode);
+
+// Forgets whatever is cached for name in parent
+extern void dcache_remove(unsigned int parent, const char *name);
+
+// Empties the dentry cache
+extern void dcache_clear();
+
+//--- Free space tracker, remembering the largest hole in each block of the linear directories a run inserts into ---
+// insert_dir_entry keeps it up to date, code that removes directory entries or frees directory blocks must too
+
+// Inserts the entry into the first block of the linear directory with room for it. Returns NULL if there is none
+extern struct ext2_dir_entry *dspace_insert(unsigned int dir_inode_num, unsigned int new_inode_id, char *filename, int type);
+
+// Measures the given block of the directory again after entries in it were removed
+extern void dspace_block_changed(unsigned int dir_inode_num, unsigned int block_num);
+
+// Forgets what is known about the directory
+extern void dspace_forget(unsigned int dir_inode_num);
+
+// Empties the free space tracker
+extern void dspace_clear();
+
+// Given a path and a start inode, this function will try to traverse the path starting at the given inode. Returns the last found inode index if the path is valid, otherwise returns 0.
 extern int traverse_path(int inode_index, char *path);
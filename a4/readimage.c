@@ -11,13 +11,13 @@ unsigned char *disk;
 
 void print_dir_info(struct ext2_super_block *sb, int inode_index, struct ext2_inode *inode) {
   for(int i = 0; i < (int)inode->i_blocks/(2 <<sb->s_log_block_size); i++) {
-    struct ext2_dir_entry *directory = (struct ext2_dir_entry *)(disk + inode->i_block[i] * EXT2_BLOCK_SIZE);
+    struct ext2_dir_entry *directory = (struct ext2_dir_entry *)(disk + inode->i_block[i] * EXT2_BLOCK_SIZE(sb));
 
     printf("   DIR BLOCK NUM: %u (for inode %u)\n", inode->i_block[i], directory->inode);
 
 
     int j = 0;
-    while(j < EXT2_BLOCK_SIZE && directory->rec_len != 0) {
+    while(j < EXT2_BLOCK_SIZE(sb) && directory->rec_len != 0) {
       char type;
       if(directory->file_type && EXT2_FT_DIR) {
         type = 'd';
@@ -32,8 +32,8 @@ void print_dir_info(struct ext2_super_block *sb, int inode_index, struct ext2_in
       }
       printf("Inode: %u rec_len: %u name_len: %u type= %c name=%.*s\n", directory->inode, directory->rec_len, directory->name_len, type, directory->name_len, directory->name);
       j += directory->rec_len;
-      if(j < EXT2_BLOCK_SIZE) {
-        directory = (struct ext2_dir_entry *)(disk + inode->i_block[i] * EXT2_BLOCK_SIZE + j);
+      if(j < EXT2_BLOCK_SIZE(sb)) {
+        directory = (struct ext2_dir_entry *)(disk + inode->i_block[i] * EXT2_BLOCK_SIZE(sb) + j);
       }
     }
   }
@@ -65,17 +65,26 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
+    // Only ever read, so read-only snapshots and images in use can be inspected
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[1]);
+        exit(1);
+    }
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    disk = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if(disk == MAP_FAILED) {
         perror("mmap");
         exit(1);
     }
+    // The bitmaps and inode table are printed front to back
+    madvise(disk, st.st_size, MADV_SEQUENTIAL);
 
-    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-    struct ext2_group_desc *bgdt = (struct ext2_group_desc *)(disk + 1024 + EXT2_BLOCK_SIZE);
-    struct ext2_inode *inode_tab = (struct ext2_inode *)(disk + 1024 * bgdt->bg_inode_table);
+    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + EXT2_SUPERBLOCK_OFFSET);
+    // The group descriptors follow the block holding the superblock, which is block 0 once blocks are over 1K
+    struct ext2_group_desc *bgdt = (struct ext2_group_desc *)(disk + (sb->s_first_data_block + 1) * EXT2_BLOCK_SIZE(sb));
+    struct ext2_inode *inode_tab = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE(sb) * bgdt->bg_inode_table);
     struct ext2_inode *ino = &inode_tab[14];
     printf("size: %d\n", ino->i_size);
     printf("block num: %d\n", ino->i_block[0]);
@@ -90,7 +99,7 @@ int main(int argc, char **argv) {
     printf("    free inodes: %d\n", bgdt->bg_free_inodes_count);
     printf("    used_dirs: %d\n", bgdt->bg_used_dirs_count);
 
-    char *block_bitmap = (char *)(disk + bgdt->bg_block_bitmap * EXT2_BLOCK_SIZE);
+    char *block_bitmap = (char *)(disk + bgdt->bg_block_bitmap * EXT2_BLOCK_SIZE(sb));
     printf("Block bitmap: ");
     for(int i = 0; i < (int)sb->s_blocks_count/8; i++) {
       for(int j = 0; j < 8; j++) {
@@ -104,7 +113,7 @@ int main(int argc, char **argv) {
     }
     printf("\n");
 
-    char *inode_bitmap = (char *)(disk + bgdt->bg_inode_bitmap * EXT2_BLOCK_SIZE);
+    char *inode_bitmap = (char *)(disk + bgdt->bg_inode_bitmap * EXT2_BLOCK_SIZE(sb));
     printf("Inode bitmap: ");
     for(int i = 0; i < (int)sb->s_inodes_count/8; i++) {
       for(int j = 0; j < 8; j++) {
@@ -119,7 +128,7 @@ int main(int argc, char **argv) {
     printf("\n\n");
 
     printf("Inodes:\n");
-    struct ext2_inode *inode_table = (struct ext2_inode *)(disk + bgdt->bg_inode_table * EXT2_BLOCK_SIZE);
+    struct ext2_inode *inode_table = (struct ext2_inode *)(disk + bgdt->bg_inode_table * EXT2_BLOCK_SIZE(sb));
 
     print_inode_info(sb, EXT2_ROOT_INO, &inode_table[EXT2_ROOT_INO - 1]);
 
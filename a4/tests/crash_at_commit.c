@@ -0,0 +1,11 @@
+#include <unistd.h>
+#include <sys/types.h>
+
+/*
+ * Preloaded into a tool to make it die as it commits. The undo log is emptied with ftruncate once the image
+ * is synced, so exiting there leaves every change on disk along with the log that undoes them, as a crash
+ * would, for the next open to roll back.
+ */
+int ftruncate(int fd, off_t length) {
+  _exit(99);
+}
@@ -0,0 +1,675 @@
+#!/bin/bash
+# Runs the tools against copies of the sample images and checks what they leave behind.
+# Usage: tests/run_tests.sh [test name...], from the directory holding the tools
+TOOLS=$(cd "$(dirname "$0")/.." && pwd)
+# Every scratch image and file goes in a directory of its own, removed however the run ends, and the tests run
+# from it so nothing they leave behind lands next to the tools
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+trap 'exit 130' INT TERM
+cd "$WORK" || exit 1
+failed=0
+
+fail() {
+  echo "FAIL: $*"
+  return 1
+}
+
+# Prints the little endian number of the given size in bytes at the given offset of a file
+read_number() {
+  od -An -tu"$3" -j "$2" -N "$3" "$1" | tr -d ' '
+}
+
+# Prints the image's block size
+block_size_of() {
+  echo $((1024 << $(read_number "$1" $((1024 + 24)) 4)))
+}
+
+# Prints where the given inode is in the image
+inode_offset() {
+  local bs=$(block_size_of "$1")
+  local first_data=$(read_number "$1" $((1024 + 20)) 4)
+  local per_group=$(read_number "$1" $((1024 + 40)) 4)
+  local inode_size=$(read_number "$1" $((1024 + 88)) 2)
+  local table=$(read_number "$1" $(((first_data + 1) * bs + ($2 - 1) / per_group * 32 + 8)) 4)
+  echo $((table * bs + ($2 - 1) % per_group * inode_size))
+}
+
+# Prints the field of the given size in bytes at the given offset of an inode
+inode_field() {
+  read_number "$1" $(($(inode_offset "$1" "$2") + $3)) "$4"
+}
+
+# Prints the i_flags of the given inode
+inode_flags() {
+  inode_field "$1" "$2" 32 4
+}
+
+# Prints the free block count in the superblock
+free_blocks() {
+  read_number "$1" $((1024 + 12)) 4
+}
+
+# Prints the inode of the entry with the given name in the directory with the given inode
+dir_entry_inode() {
+  local bs=$(block_size_of "$1")
+  local dir=$(inode_offset "$1" "$2")
+  local size=$(read_number "$1" $((dir + 4)) 4)
+  for ((b = 0; b < size / bs && b < 12; b++)); do
+    local base=$(($(read_number "$1" $((dir + 40 + b * 4)) 4) * bs))
+    local end=$((base + bs))
+    while [ $base -lt $end ]; do
+      local inode=$(read_number "$1" $base 4)
+      local rec_len=$(read_number "$1" $((base + 4)) 2)
+      local name_len=$(read_number "$1" $((base + 6)) 1)
+      if [ "$inode" -ne 0 ] && [ "$(dd if="$1" bs=1 skip=$((base + 8)) count=$name_len 2> /dev/null)" = "$3" ]; then
+        echo $inode
+        return
+      fi
+      [ "$rec_len" -ge 8 ] || break
+      base=$((base + rec_len))
+    done
+  done
+}
+
+# Prints the inode of the entry with the given name in the root directory
+root_entry_inode() {
+  dir_entry_inode "$1" 2 "$2"
+}
+
+# Prints the inode at the given absolute path, or nothing if there is none
+path_inode() {
+  local inode=2
+  local name
+  for name in $(tr '/' ' ' <<< "$2"); do
+    inode=$(dir_entry_inode "$1" $inode "$name")
+    [ -n "$inode" ] || return
+  done
+  echo $inode
+}
+
+# Prints the target of the symbolic link with the given inode, kept in i_block by a fast symlink, which has no blocks,
+# and in its first block otherwise
+link_target() {
+  local inode=$(inode_offset "$1" "$2")
+  local size=$(read_number "$1" $((inode + 4)) 4)
+  local at=$((inode + 40))
+  if [ "$(read_number "$1" $((inode + 28)) 4)" -ne 0 ]; then
+    at=$(($(read_number "$1" $at 4) * $(block_size_of "$1")))
+  fi
+  dd if="$1" bs=1 skip=$at count=$size 2> /dev/null
+}
+
+# A copy of emptydisk.img with its counters fixed, which it ships with wrong
+fresh_image() {
+  cp "$TOOLS/emptydisk.img" "$1"
+  "$TOOLS/ext2_checker" "$1" > /dev/null
+}
+
+# Checks the image needs no fixes
+check_clean() {
+  local out=$("$TOOLS/ext2_checker" "$1")
+  [ "$out" = "0 file system inconsistencies repaired!" ] || fail "ext2_checker: $out"
+}
+
+# Makes an image with mkfs.ext2 of the given block size and size in blocks, with the given number of inodes and
+# blocks per group when set
+make_image() {
+  mkfs.ext2 -q -F -b "$2" ${4:+-N "$4"} ${5:+-g "$5"} "$1" "$3" > /dev/null 2>&1 || fail "mkfs.ext2 $*"
+}
+
+# Checks e2fsck finds nothing to fix, which covers more than ext2_checker does but can't read the sample images
+fsck_clean() {
+  local out
+  out=$(e2fsck -fn "$1" 2>&1) || fail "e2fsck: $(grep -v '^Pass\|^e2fsck' <<< "$out" | head -5)"
+}
+
+# Marks a test as skipped when e2fsprogs, which it makes and checks its images with, isn't installed
+need_e2fsprogs() {
+  command -v mkfs.ext2 > /dev/null && command -v e2fsck > /dev/null || { echo "mkfs.ext2 or e2fsck not found"; return 77; }
+}
+
+# An indexed directory that can't split a full leaf because the image is full drops its index and takes the entry
+# wherever there is room, as a linear directory
+test_index_fallback() {
+  local img=$WORK/index.img
+  local long=$(head -c 200 /dev/zero | tr '\0' 'n')
+  local mid=$(head -c 100 /dev/zero | tr '\0' 'm')
+  fresh_image "$img"
+  head -c 1000 /dev/urandom > "$WORK/f"
+  "$TOOLS/ext2_cp" "$img" "$WORK/f" /f && "$TOOLS/ext2_mkdir" "$img" /d || return 1
+  local dir_inode=$(root_entry_inode "$img" d)
+
+  for i in $(seq 1 20); do
+    "$TOOLS/ext2_ln" --index "$img" /f "/d/$long$i" || return 1
+  done
+  [ $(($(inode_flags "$img" $dir_inode) & 0x1000)) -ne 0 ] || fail "/d was not indexed" || return 1
+
+  # Take every free block, then keep linking until there is no room anywhere
+  local n=0
+  for size in 65536 16384 4096 1024; do
+    head -c $size /dev/urandom > "$WORK/fill"
+    while "$TOOLS/ext2_cp" "$img" "$WORK/fill" "/fill$n" 2> /dev/null; do
+      n=$((n + 1))
+    done
+  done
+  n=1
+  while "$TOOLS/ext2_ln" --index "$img" /f "/d/$mid$n" 2> /dev/null; do
+    n=$((n + 1))
+  done
+  [ $(($(inode_flags "$img" $dir_inode) & 0x1000)) -eq 0 ] || fail "/d kept its index" || return 1
+
+  check_clean "$img" || return 1
+  for i in $(seq 1 20); do
+    "$TOOLS/ext2_cat" "$img" "/d/$long$i" | cmp -s - "$WORK/f" || fail "/d/${long:0:8}...$i lost" || return 1
+  done
+  for i in $(seq 1 $((n - 1))); do
+    "$TOOLS/ext2_cat" "$img" "/d/$mid$i" | cmp -s - "$WORK/f" || fail "/d/${mid:0:8}...$i lost" || return 1
+  done
+}
+
+# A defrag that dies as it commits is rolled back whole on the next open, including a file moved into blocks another
+# file moved out of earlier in the same run
+test_defrag_rollback() {
+  local img=$WORK/defrag.img
+  fresh_image "$img"
+  for f in a:8 b:1 c:1 F:9 G:2; do
+    head -c $((${f#*:} * 1024)) /dev/urandom > "$WORK/${f%:*}"
+  done
+  # /F fills the hole /a leaves and carries on past /c, /G is split around /c
+  "$TOOLS/ext2_cp" "$img" "$WORK/a" /a && "$TOOLS/ext2_cp" "$img" "$WORK/b" /b && "$TOOLS/ext2_cp" "$img" "$WORK/c" /c &&
+    "$TOOLS/ext2_rm" "$img" /a && "$TOOLS/ext2_cp" "$img" "$WORK/F" /F &&
+    "$TOOLS/ext2_rm" "$img" /b && "$TOOLS/ext2_cp" "$img" "$WORK/G" /G || return 1
+
+  LD_PRELOAD="$TOOLS/tests/crash_at_commit.so" "$TOOLS/ext2_defrag" "$img" > /dev/null
+  [ $? -eq 99 ] || fail "ext2_defrag did not reach its commit" || return 1
+  check_clean "$img" 2> /dev/null || return 1
+  for f in F G c; do
+    "$TOOLS/ext2_cat" "$img" "/$f" | cmp -s - "$WORK/$f" || fail "/$f changed by the rolled back defrag" || return 1
+  done
+
+  # Left to finish, the same defrag leaves nothing fragmented
+  "$TOOLS/ext2_defrag" "$img" > /dev/null || return 1
+  [[ "$("$TOOLS/ext2_defrag" --report "$img" | tail -1)" == *", 0 fragmented" ]] || fail "still fragmented" || return 1
+  check_clean "$img" || return 1
+  for f in F G c; do
+    "$TOOLS/ext2_cat" "$img" "/$f" | cmp -s - "$WORK/$f" || fail "/$f changed by defrag" || return 1
+  done
+}
+
+# Every file in more than one extent gets a non-zero score, however large it is, and a defrag brings them all to 0
+test_defrag_score() {
+  local img=$WORK/score.img
+  fresh_image "$img"
+  head -c 1024 /dev/urandom > "$WORK/small"
+  for i in $(seq 1 5); do
+    "$TOOLS/ext2_cp" "$img" "$WORK/small" "/s$i" || return 1
+  done
+  for i in 1 3 5; do
+    "$TOOLS/ext2_rm" "$img" "/s$i" || return 1
+  done
+  # Fills the holes left between the small files and then carries on past them
+  head -c 40960 /dev/urandom > "$WORK/big"
+  "$TOOLS/ext2_cp" "$img" "$WORK/big" /big || return 1
+
+  local line=$("$TOOLS/ext2_defrag" --report "$img" | awk '$5 == "/big"')
+  [ -n "$line" ] || fail "/big not reported" || return 1
+  awk '$4 > 1 && ($1 + 0 == 0 || $2 + 0 == 0) { exit 1 }' <<< "$line" || fail "fragmented /big scored 0: $line" || return 1
+  "$TOOLS/ext2_defrag" --report "$img" | awk 'NR > 1 && $5 ~ /^\// && $4 > 1 && ($1 + 0 == 0 || $2 + 0 == 0) { exit 1 }' ||
+    fail "a fragmented file scored 0" || return 1
+
+  "$TOOLS/ext2_defrag" "$img" > /dev/null || return 1
+  "$TOOLS/ext2_defrag" --report "$img" | awk 'NR > 1 && $5 == "/big" && ($1 + 0 != 0 || $4 != 1) { exit 1 }' ||
+    fail "/big still fragmented" || return 1
+  "$TOOLS/ext2_cat" "$img" /big | cmp -s - "$WORK/big" || fail "/big changed by defrag" || return 1
+  check_clean "$img"
+}
+
+# ext2_cp -r copies symbolic links as they are, short ones as fast symlinks, and refuses what it can't copy rather
+# than leaving it out
+test_cp_tree_links() {
+  local img=$WORK/links.img
+  local long=../$(head -c 100 /dev/zero | tr '\0' 'l')
+  fresh_image "$img"
+  mkdir -p "$WORK/src/a"
+  echo data > "$WORK/src/a/f"
+  ln -s ../missing "$WORK/src/a/lnk"
+  ln -s "$long" "$WORK/src/long"
+  "$TOOLS/ext2_cp" "$img" -r "$WORK/src" /t || fail "ext2_cp -r failed" || return 1
+  for l in a/lnk:../missing:0 long:$long:2; do
+    local path=/t/${l%%:*} target=${l#*:}
+    local link=$(path_inode "$img" $path)
+    [ -n "$link" ] || fail "$path not copied" || return 1
+    [ $(($(inode_field "$img" $link 0 2) & 0xF000)) -eq $((0xA000)) ] || fail "$path is not a symbolic link" || return 1
+    [ "$(link_target "$img" $link)" = "${target%:*}" ] || fail "$path points at $(link_target "$img" $link)" || return 1
+    [ "$(inode_field "$img" $link 28 4)" -eq "${target##*:}" ] || fail "$path has i_blocks $(inode_field "$img" $link 28 4)" ||
+      return 1
+  done
+  "$TOOLS/ext2_cat" "$img" /t/a/f | cmp -s - "$WORK/src/a/f" || fail "/t/a/f lost" || return 1
+  check_clean "$img" || return 1
+
+  mkfifo "$WORK/src/fifo"
+  "$TOOLS/ext2_cp" "$img" -r "$WORK/src" /u 2> /dev/null && fail "ext2_cp -r skipped a fifo and succeeded" && return 1
+  [ -z "$(root_entry_inode "$img" u)" ] || fail "/u kept after the failed copy" || return 1
+  check_clean "$img"
+}
+
+# Free inodes and blocks are found first fit across bitmap words and block groups, so freed ones are reused in order
+test_bitmap_search() {
+  need_e2fsprogs || return
+  local img=$WORK/search.img
+  make_image "$img" 1024 8192 256 1024 || return 1
+  head -c 1024 /dev/urandom > "$WORK/small"
+  for i in $(seq 1 100); do
+    "$TOOLS/ext2_cp" "$img" "$WORK/small" "/f$i" || return 1
+  done
+  local low=$(root_entry_inode "$img" f20) high=$(root_entry_inode "$img" f70)
+  [ $((high / 32)) -gt $((low / 32)) ] || fail "/f20 and /f70 share a group" || return 1
+
+  "$TOOLS/ext2_rm" "$img" /f70 && "$TOOLS/ext2_rm" "$img" /f20 || return 1
+  local free=$(free_blocks "$img")
+  "$TOOLS/ext2_cp" "$img" "$WORK/small" /n1 && "$TOOLS/ext2_cp" "$img" "$WORK/small" /n2 || return 1
+  [ "$(root_entry_inode "$img" n1)" = "$low" ] || fail "/n1 did not reuse inode $low" || return 1
+  [ "$(root_entry_inode "$img" n2)" = "$high" ] || fail "/n2 did not reuse inode $high" || return 1
+  [ "$(free_blocks "$img")" -eq $((free - 2)) ] || fail "free blocks went from $free to $(free_blocks "$img")" || return 1
+  fsck_clean "$img"
+}
+
+# ext2_cp reserves a file's blocks, indirect ones included, as one run before copying, and takes none when the
+# whole file doesn't fit
+test_cp_reserve() {
+  need_e2fsprogs || return
+  local img=$WORK/reserve.img
+  make_image "$img" 1024 4096 || return 1
+  head -c $((600 * 1024)) /dev/urandom > "$WORK/big"
+  "$TOOLS/ext2_cp" "$img" "$WORK/big" /big || return 1
+  "$TOOLS/ext2_defrag" --report "$img" | awk '$5 == "/big" && $4 == 1 { found = 1 } END { exit !found }' ||
+    fail "/big is not one extent" || return 1
+
+  local free=$(free_blocks "$img")
+  head -c $((free * 1024 + 1024)) /dev/urandom > "$WORK/huge"
+  "$TOOLS/ext2_cp" "$img" "$WORK/huge" /huge 2> /dev/null && fail "a file bigger than the free space was copied" && return 1
+  [ "$(free_blocks "$img")" -eq $free ] || fail "the failed copy kept $((free - $(free_blocks "$img"))) blocks" || return 1
+  "$TOOLS/ext2_cat" "$img" /big | cmp -s - "$WORK/big" || fail "/big changed" || return 1
+  fsck_clean "$img"
+}
+
+# Files copied in straight from the host file come out the same at every size around a block boundary, with i_size
+# and i_blocks matching what they hold
+test_cp_sizes() {
+  need_e2fsprogs || return
+  local img=$WORK/sizes.img
+  make_image "$img" 1024 4096 || return 1
+  for size in 0 1 1023 1024 1025 12289 300000; do
+    head -c $size /dev/urandom > "$WORK/s$size"
+    "$TOOLS/ext2_cp" "$img" "$WORK/s$size" "/s$size" || return 1
+  done
+  for size in 0 1 1023 1024 1025 12289 300000; do
+    local inode=$(root_entry_inode "$img" "s$size")
+    "$TOOLS/ext2_cat" "$img" "/s$size" | cmp -s - "$WORK/s$size" || fail "/s$size changed" || return 1
+    [ "$(inode_field "$img" $inode 4 4)" -eq $size ] || fail "/s$size has i_size $(inode_field "$img" $inode 4 4)" || return 1
+  done
+  fsck_clean "$img"
+}
+
+# A file reaching into triple indirect blocks, kept small by leaving holes, is copied, read back and removed with
+# every block, indirect ones included, accounted for
+test_triple_indirect() {
+  need_e2fsprogs || return
+  local img=$WORK/triple.img
+  make_image "$img" 1024 4096 || return 1
+  local free=$(free_blocks "$img")
+  # 1K blocks: single indirect from block 12, double from 268 and triple from 65804
+  head -c 4096 /dev/urandom > "$WORK/tri"
+  for block in 300 70000; do
+    head -c 4096 /dev/urandom | dd of="$WORK/tri" bs=1024 seek=$block conv=notrunc 2> /dev/null
+  done
+  "$TOOLS/ext2_cp" "$img" "$WORK/tri" /tri || return 1
+  "$TOOLS/ext2_cat" "$img" /tri | cmp -s - "$WORK/tri" || fail "/tri changed" || return 1
+  [ "$(inode_field "$img" $(root_entry_inode "$img" tri) 96 4)" -ne 0 ] || fail "/tri has no triple indirect block" || return 1
+  fsck_clean "$img" || return 1
+
+  "$TOOLS/ext2_rm" "$img" /tri || return 1
+  [ "$(free_blocks "$img")" -eq $free ] || fail "removing /tri left $((free - $(free_blocks "$img"))) blocks" || return 1
+  fsck_clean "$img"
+}
+
+# Lookups cached earlier in a batch follow names that are removed, created again and removed with their directory
+test_dentry_cache() {
+  need_e2fsprogs || return
+  local img=$WORK/dcache.img
+  make_image "$img" 1024 4096 || return 1
+  head -c 3000 /dev/urandom > "$WORK/one"
+  head -c 5000 /dev/urandom > "$WORK/two"
+  printf '%s\n' "mkdir /d" "cp $WORK/one /d/x" "rm /d/x" "cp $WORK/two /d/x" "ln /d/x /d/y" "mkdir /d/sub" \
+    "cp $WORK/one /d/sub/z" "rm -r /d" "mkdir /d" "mkdir /d/sub" "cp $WORK/one /d/x" "ln /d/x /d/sub/z" > "$WORK/script"
+  "$TOOLS/ext2_batch" "$img" "$WORK/script" || return 1
+
+  "$TOOLS/ext2_cat" "$img" /d/x | cmp -s - "$WORK/one" || fail "/d/x is not the last copy" || return 1
+  "$TOOLS/ext2_cat" "$img" /d/sub/z | cmp -s - "$WORK/one" || fail "/d/sub/z is not linked to /d/x" || return 1
+  [ -z "$(path_inode "$img" /d/y)" ] || fail "/d/y outlived its directory" || return 1
+  [ "$(inode_field "$img" $(path_inode "$img" /d/x) 26 2)" -eq 2 ] || fail "/d/x does not have 2 links" || return 1
+  fsck_clean "$img"
+}
+
+# Writes a little endian number of the given size in bytes at the given offset of a file
+write_number() {
+  local bytes=""
+  for ((i = 0; i < $3; i++)); do
+    bytes+=$(printf '\\x%02x' $((($4 >> (i * 8)) & 0xFF)))
+  done
+  printf "$bytes" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# The checker counts the free bits in every bitmap and fixes each counter that disagrees, by exactly how far off it is
+test_checker_counts() {
+  need_e2fsprogs || return
+  local img=$WORK/counts.img
+  make_image "$img" 1024 8192 256 1024 || return 1
+  head -c 5000 /dev/urandom > "$WORK/f"
+  "$TOOLS/ext2_cp" "$img" "$WORK/f" /f || return 1
+
+  # Group 3's free blocks and group 5's free inodes, then the superblock's free blocks
+  local group_free=$(read_number "$img" $((2048 + 3 * 32 + 12)) 2)
+  local inodes_free=$(read_number "$img" $((2048 + 5 * 32 + 14)) 2)
+  local sb_free=$(free_blocks "$img")
+  write_number "$img" $((2048 + 3 * 32 + 12)) 2 $((group_free - 17))
+  write_number "$img" $((2048 + 5 * 32 + 14)) 2 $((inodes_free + 3))
+  write_number "$img" $((1024 + 12)) 4 $((sb_free + 100))
+
+  local out=$("$TOOLS/ext2_checker" "$img")
+  for expected in "free blocks counter was off by 17 " "free inode counter was off by -3 " \
+      "superblock's free blocks counter was off by -100 " "3 file system inconsistencies repaired!"; do
+    grep -q "$expected" <<< "$out" || fail "ext2_checker did not report '$expected': $out" || return 1
+  done
+  [ "$(free_blocks "$img")" -eq $sb_free ] || fail "superblock free blocks is $(free_blocks "$img"), not $sb_free" || return 1
+  check_clean "$img" && fsck_clean "$img"
+}
+
+# Prints the number of blocks of the given size that differ between two files of the same size
+changed_blocks() {
+  cmp -l "$1" "$2" | awk -v bs="$3" '{ blocks[int(($1 - 1) / bs)] = 1 } END { print length(blocks) }'
+}
+
+# Only the blocks an operation changes are written back, and every tool commits with --sync, leaving no log behind
+test_sync_writes() {
+  need_e2fsprogs || return
+  local img=$WORK/sync.img
+  make_image "$img" 1024 8192 256 1024 || return 1
+  head -c 5000 /dev/urandom > "$WORK/f"
+  "$TOOLS/ext2_cp" "$img" "$WORK/f" /f || return 1
+
+  # The superblock, group descriptor, both bitmaps, two inode table blocks, the root and the new directory's block
+  cp "$img" "$WORK/before.img"
+  "$TOOLS/ext2_mkdir" --sync "$img" /d || return 1
+  local changed=$(changed_blocks "$WORK/before.img" "$img" 1024)
+  [ "$changed" -le 8 ] || fail "mkdir changed $changed blocks" || return 1
+
+  "$TOOLS/ext2_cp" --sync "$img" "$WORK/f" /d/g && "$TOOLS/ext2_ln" --sync "$img" /d/g /h &&
+    "$TOOLS/ext2_ln" --sync "$img" -s /d/g /s && "$TOOLS/ext2_rm" --sync "$img" /f &&
+    "$TOOLS/ext2_restore" --sync "$img" /f && "$TOOLS/ext2_compact_dir" --sync "$img" /d > /dev/null &&
+    "$TOOLS/ext2_defrag" --sync "$img" > /dev/null && "$TOOLS/ext2_checker" --sync "$img" > /dev/null || return 1
+  [ ! -e "$img.journal" ] || fail "the log was left behind" || return 1
+  for f in /f /d/g /h; do
+    "$TOOLS/ext2_cat" "$img" $f | cmp -s - "$WORK/f" || fail "$f changed" || return 1
+  done
+  fsck_clean "$img"
+}
+
+# Inspection tools never write the image: a dry run reports what it would fix, and neither it, ext2_cat nor a defrag
+# report replays or removes a log left next to the image
+test_read_only() {
+  need_e2fsprogs || return
+  local img=$WORK/ro.img
+  make_image "$img" 1024 4096 || return 1
+  head -c 5000 /dev/urandom > "$WORK/f"
+  "$TOOLS/ext2_cp" "$img" "$WORK/f" /f || return 1
+  write_number "$img" $((1024 + 12)) 4 $(($(free_blocks "$img") + 5))
+  head -c 2048 /dev/urandom > "$img.journal"
+  cp "$img" "$WORK/before.img"
+  cp "$img.journal" "$WORK/before.journal"
+
+  local out=$("$TOOLS/ext2_checker" --dry-run "$img")
+  [[ "$out" == *"1 file system inconsistencies found, image left unchanged" ]] || fail "ext2_checker --dry-run: $out" ||
+    return 1
+  "$TOOLS/ext2_cat" "$img" /f | cmp -s - "$WORK/f" || fail "ext2_cat read /f wrong" || return 1
+  "$TOOLS/ext2_defrag" --report "$img" > /dev/null || return 1
+  cmp -s "$img" "$WORK/before.img" || fail "the image changed" || return 1
+  cmp -s "$img.journal" "$WORK/before.journal" || fail "the log changed" || return 1
+}
+
+# ext2_cat exports a file reaching into double indirect blocks to standard output and to a host file, and refuses
+# directories and missing paths
+test_cat_export() {
+  need_e2fsprogs || return
+  local img=$WORK/cat.img
+  make_image "$img" 1024 4096 || return 1
+  # 1K blocks: double indirect from block 268
+  head -c $((1024 * 1024 + 77)) /dev/urandom > "$WORK/double"
+  "$TOOLS/ext2_cp" "$img" "$WORK/double" /double && "$TOOLS/ext2_mkdir" "$img" /d || return 1
+  [ "$(inode_field "$img" $(root_entry_inode "$img" double) 92 4)" -ne 0 ] || fail "/double has no double indirect block" ||
+    return 1
+
+  "$TOOLS/ext2_cat" "$img" /double | cmp -s - "$WORK/double" || fail "/double on stdout differs" || return 1
+  "$TOOLS/ext2_cat" "$img" /double "$WORK/out" && cmp -s "$WORK/out" "$WORK/double" || fail "/double in a file differs" ||
+    return 1
+  "$TOOLS/ext2_cat" "$img" /d > /dev/null 2>&1 && fail "ext2_cat exported a directory" && return 1
+  "$TOOLS/ext2_cat" "$img" /missing > /dev/null 2>&1 && fail "ext2_cat exported a missing file" && return 1
+  return 0
+}
+
+# Blocks of zeros, whether holes in the host file or written out, become holes in the image: i_blocks only counts the
+# blocks holding data and the indirect blocks mapping them, and the file still reads back whole
+test_sparse_copy() {
+  need_e2fsprogs || return
+  local img=$WORK/sparse.img
+  make_image "$img" 1024 4096 || return 1
+  local free=$(free_blocks "$img")
+  # Data in blocks 0-3 and 600-603, zeros written out in blocks 100-199, and a hole up to the end at 1M
+  head -c 4096 /dev/urandom > "$WORK/sparse"
+  head -c $((100 * 1024)) /dev/zero | dd of="$WORK/sparse" bs=1024 seek=100 conv=notrunc 2> /dev/null
+  head -c 4096 /dev/urandom | dd of="$WORK/sparse" bs=1024 seek=600 conv=notrunc 2> /dev/null
+  truncate -s 1M "$WORK/sparse"
+  "$TOOLS/ext2_cp" "$img" "$WORK/sparse" /sparse || return 1
+
+  local inode=$(root_entry_inode "$img" sparse)
+  # 8 data blocks, and a double indirect block and the indirect block below it for blocks 600-603
+  [ "$(inode_field "$img" $inode 28 4)" -eq 20 ] || fail "/sparse has i_blocks $(inode_field "$img" $inode 28 4), not 20" ||
+    return 1
+  [ "$(inode_field "$img" $inode 4 4)" -eq $((1024 * 1024)) ] || fail "/sparse lost its size" || return 1
+  [ "$(free_blocks "$img")" -eq $((free - 10)) ] || fail "/sparse took $((free - $(free_blocks "$img"))) blocks" || return 1
+  "$TOOLS/ext2_cat" "$img" /sparse | cmp -s - "$WORK/sparse" || fail "/sparse changed" || return 1
+  fsck_clean "$img"
+}
+
+# Every tool works on images with 2K and 4K blocks, the sizes read from the superblock
+test_block_sizes() {
+  need_e2fsprogs || return
+  head -c $((3 * 1024 * 1024 + 5)) /dev/urandom > "$WORK/big"
+  head -c 5000 /dev/urandom > "$WORK/small"
+  for bs in 2048 4096; do
+    local img=$WORK/bs$bs.img
+    make_image "$img" $bs $((16 * 1024 * 1024 / bs)) || return 1
+    "$TOOLS/ext2_mkdir" "$img" /d && "$TOOLS/ext2_cp" "$img" "$WORK/big" /d/big &&
+      "$TOOLS/ext2_cp" "$img" "$WORK/small" /small && "$TOOLS/ext2_ln" "$img" /small /d/hard &&
+      "$TOOLS/ext2_ln" "$img" -s /d/big /link && "$TOOLS/ext2_rm" "$img" /d/big &&
+      "$TOOLS/ext2_restore" "$img" /d/big || fail "tools failed with $bs byte blocks" || return 1
+    printf 'mkdir /e\nmkdir /e/f\ncp %s /e/f/g\nrm -r /e/f\n' "$WORK/small" | "$TOOLS/ext2_batch" "$img" ||
+      fail "ext2_batch failed with $bs byte blocks" || return 1
+
+    [ "$(block_size_of "$img")" -eq $bs ] || return 1
+    "$TOOLS/ext2_cat" "$img" /d/big | cmp -s - "$WORK/big" || fail "/d/big changed with $bs byte blocks" || return 1
+    "$TOOLS/ext2_cat" "$img" /d/hard | cmp -s - "$WORK/small" || fail "/d/hard changed with $bs byte blocks" || return 1
+    [ "$(link_target "$img" $(root_entry_inode "$img" link))" = /d/big ] || fail "/link lost with $bs byte blocks" ||
+      return 1
+    [ -n "$(path_inode "$img" /e)" ] && [ -z "$(path_inode "$img" /e/f)" ] || fail "/e wrong with $bs byte blocks" ||
+      return 1
+    check_clean "$img" && fsck_clean "$img" || return 1
+  done
+}
+
+# restore --list shows every removed entry and whether it can come back, and --all brings back the ones that can
+test_restore_all() {
+  need_e2fsprogs || return
+  local img=$WORK/restore.img
+  make_image "$img" 1024 4096 || return 1
+  "$TOOLS/ext2_mkdir" "$img" /d || return 1
+  for name in a b c e; do
+    head -c 3000 /dev/urandom > "$WORK/$name"
+    "$TOOLS/ext2_cp" "$img" "$WORK/$name" "/d/$name" || return 1
+  done
+  "$TOOLS/ext2_rm" "$img" /d/a && "$TOOLS/ext2_rm" "$img" /d/c && "$TOOLS/ext2_rm" "$img" /d/e || return 1
+  # Takes the inode /d/a had
+  "$TOOLS/ext2_cp" "$img" "$WORK/b" /new || return 1
+
+  local list=$("$TOOLS/ext2_restore" --list "$img" /d)
+  for expected in "inode-in-use .* /d/a" "restorable .* /d/c" "restorable .* /d/e"; do
+    grep -q "^$expected\$" <<< "$list" || fail "--list did not show '$expected': $list" || return 1
+  done
+  [ "$(wc -l <<< "$list")" -eq 3 ] || fail "--list showed more than the removed entries: $list" || return 1
+
+  "$TOOLS/ext2_restore" --all "$img" /d > /dev/null 2>&1 || return 1
+  for name in c e; do
+    "$TOOLS/ext2_cat" "$img" "/d/$name" | cmp -s - "$WORK/$name" || fail "/d/$name not restored" || return 1
+  done
+  [ -z "$(path_inode "$img" /d/a)" ] || fail "/d/a restored over an inode in use" || return 1
+  [ "$("$TOOLS/ext2_restore" --list "$img" /d | wc -l)" -eq 1 ] || fail "restored entries still listed" || return 1
+  check_clean "$img" && fsck_clean "$img"
+}
+
+# rm -r frees every block and inode of a tree, indirect blocks included, except files still linked from outside it
+test_rm_tree() {
+  need_e2fsprogs || return
+  local img=$WORK/rmtree.img
+  make_image "$img" 1024 8192 256 1024 || return 1
+  head -c 5000 /dev/urandom > "$WORK/small"
+  head -c $((400 * 1024)) /dev/urandom > "$WORK/big"
+  "$TOOLS/ext2_cp" "$img" "$WORK/small" /kept || return 1
+  local free=$(free_blocks "$img") free_inodes=$(read_number "$img" $((1024 + 16)) 4)
+  local root_links=$(inode_field "$img" 2 26 2)
+
+  mkdir -p "$WORK/tree/a/b/c" "$WORK/tree/e"
+  cp "$WORK/big" "$WORK/tree/a/b/c/big"
+  cp "$WORK/small" "$WORK/tree/a/small"
+  ln -s ../a/small "$WORK/tree/e/link"
+  "$TOOLS/ext2_cp" "$img" -r "$WORK/tree" /tree && "$TOOLS/ext2_ln" "$img" /tree/a/small /outside || return 1
+  "$TOOLS/ext2_rm" "$img" /tree 2> /dev/null && fail "rm without -r removed a directory" && return 1
+  "$TOOLS/ext2_rm" -r "$img" /tree || return 1
+
+  [ -z "$(root_entry_inode "$img" tree)" ] || fail "/tree is still there" || return 1
+  "$TOOLS/ext2_cat" "$img" /outside | cmp -s - "$WORK/small" || fail "/outside lost its data" || return 1
+  [ "$(inode_field "$img" $(root_entry_inode "$img" outside) 26 2)" -eq 1 ] || fail "/outside has the wrong link count" ||
+    return 1
+  # Only /outside's inode and blocks stay taken
+  [ "$(free_blocks "$img")" -eq $((free - 5)) ] || fail "free blocks $(free_blocks "$img"), expected $((free - 5))" || return 1
+  [ "$(read_number "$img" $((1024 + 16)) 4)" -eq $((free_inodes - 1)) ] || fail "inodes left taken" || return 1
+  [ "$(inode_field "$img" 2 26 2)" -eq $root_links ] || fail "/ has the wrong link count" || return 1
+  check_clean "$img" && fsck_clean "$img"
+}
+
+# compact_dir repacks a directory most of whose entries were removed into fewer blocks, frees the rest, and every
+# name left still finds its file
+test_compact_dir() {
+  need_e2fsprogs || return
+  local img=$WORK/compact.img
+  local pad=$(head -c 40 /dev/zero | tr '\0' 'p')
+  make_image "$img" 1024 8192 512 || return 1
+  head -c 100 /dev/urandom > "$WORK/small"
+  {
+    echo "mkdir /d"
+    echo "cp $WORK/small /d/target"
+    for i in $(seq 1 200); do echo "ln -s /d/target /d/$pad$i"; done
+    for i in $(seq 1 200); do [ $((i % 10)) -eq 0 ] || echo "rm /d/$pad$i"; done
+  } > "$WORK/script"
+  "$TOOLS/ext2_batch" "$img" "$WORK/script" || return 1
+  local dir=$(root_entry_inode "$img" d)
+  local size=$(inode_field "$img" $dir 4 4) free=$(free_blocks "$img")
+
+  "$TOOLS/ext2_compact_dir" "$img" /d > /dev/null || return 1
+  local new_size=$(inode_field "$img" $dir 4 4)
+  [ $new_size -lt $size ] || fail "/d stayed at $size bytes" || return 1
+  [ "$(free_blocks "$img")" -eq $((free + (size - new_size) / 1024)) ] || fail "emptied blocks not freed" || return 1
+  for i in $(seq 10 10 200); do
+    local link=$(path_inode "$img" /d/$pad$i)
+    [ -n "$link" ] && [ "$(link_target "$img" $link)" = /d/target ] || fail "/d/...$i lost" || return 1
+  done
+  [ -z "$(path_inode "$img" /d/${pad}11)" ] || fail "a removed name came back" || return 1
+  check_clean "$img" && fsck_clean "$img"
+}
+
+# A new entry goes into the room a removed one left in an earlier block rather than at the end of the directory
+test_dir_slack() {
+  need_e2fsprogs || return
+  local img=$WORK/slack.img
+  local pad=$(head -c 40 /dev/zero | tr '\0' 'p')
+  make_image "$img" 1024 4096 || return 1
+  {
+    echo "mkdir /d"
+    for i in $(seq 10 99); do echo "mkdir /d/$pad$i"; done
+  } > "$WORK/script"
+  "$TOOLS/ext2_batch" "$img" "$WORK/script" || return 1
+  local dir=$(root_entry_inode "$img" d)
+  local size=$(inode_field "$img" $dir 4 4)
+  [ $size -ge 3072 ] || fail "/d only has $size bytes" || return 1
+  local first=$(($(inode_field "$img" $dir 40 4) * 1024))
+
+  # /d/...12 is in the middle of the first block
+  "$TOOLS/ext2_rm" -r "$img" "/d/${pad}12" && "$TOOLS/ext2_mkdir" "$img" "/d/${pad}xx" || return 1
+  [ "$(inode_field "$img" $dir 4 4)" -eq $size ] || fail "/d grew to $(inode_field "$img" $dir 4 4) bytes" || return 1
+  dd if="$img" bs=1 skip=$first count=1024 2> /dev/null | grep -qa "${pad}xx" ||
+    fail "the new entry did not take the first block's room" || return 1
+  [ -n "$(path_inode "$img" /d/${pad}xx)" ] && [ -n "$(path_inode "$img" /d/${pad}13)" ] || fail "lookups broke" || return 1
+  check_clean "$img" && fsck_clean "$img"
+}
+
+# A tool that fails part way leaves the image as it found it
+test_failed_rollback() {
+  local img=$WORK/failed.img
+  fresh_image "$img"
+  mkdir -p "$WORK/tree"
+  for i in $(seq 1 12); do
+    head -c 16384 /dev/urandom > "$WORK/tree/f$i"
+  done
+  "$TOOLS/ext2_defrag" --report "$img" > "$WORK/before.txt"
+
+  # The image has room for some of the files but not all of them
+  "$TOOLS/ext2_cp" "$img" -r "$WORK/tree" /tree > /dev/null 2>&1 && fail "ext2_cp -r did not run out of room" && return 1
+  "$TOOLS/ext2_defrag" --report "$img" | diff -q - "$WORK/before.txt" > /dev/null || fail "the failed copy left changes" || return 1
+  [ ! -e "$img.journal" ] || fail "the log was left behind" || return 1
+  check_clean "$img"
+}
+
+# A batch is committed once at the end, so a failing command undoes the whole script, unless it commits every N
+# commands, which keeps the groups committed before the failure
+test_batch_commits() {
+  local img=$WORK/batch.img
+  printf 'mkdir /a\nmkdir /b\nmkdir /c\nrm /missing\n' > "$WORK/script"
+
+  fresh_image "$img"
+  "$TOOLS/ext2_batch" "$img" "$WORK/script" 2> /dev/null && fail "the script did not fail" && return 1
+  for d in a b c; do
+    [ -z "$(root_entry_inode "$img" $d)" ] || fail "/$d kept after the failed script" || return 1
+  done
+  check_clean "$img" || return 1
+
+  fresh_image "$img"
+  "$TOOLS/ext2_batch" --commit-every 2 "$img" "$WORK/script" 2> /dev/null && fail "the script did not fail" && return 1
+  [ -n "$(root_entry_inode "$img" a)" ] && [ -n "$(root_entry_inode "$img" b)" ] || fail "committed /a and /b lost" || return 1
+  [ -z "$(root_entry_inode "$img" c)" ] || fail "uncommitted /c kept" || return 1
+  [ ! -e "$img.journal" ] || fail "the log was left behind" || return 1
+  check_clean "$img"
+}
+
+tests=("$@")
+if [ ${#tests[@]} -eq 0 ]; then
+  tests=($(declare -F | awk '$3 ~ /^test_/ { sub(/^test_/, "", $3); print $3 }'))
+fi
+for t in "${tests[@]}"; do
+  "test_$t"
+  case $? in
+    0) echo "ok: $t" ;;
+    77) echo "skipped: $t" ;;
+    *) echo "failed: $t"; failed=1 ;;
+  esac
+done
+exit $failed